@@ -0,0 +1,92 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <SDL2/SDL.h>
+
+#include "z80.h"
+#include "state.h"
+#include "machine.h"
+
+#define BENCH_WARMUP 600
+#define BENCH_CHILDREN 256
+/* Frames each child runs with its own input */
+#define BENCH_DEPTH 8
+
+static double bench_us(uint64_t ticks) {
+  return 1e6 * ticks / SDL_GetPerformanceFrequency() / BENCH_CHILDREN;
+}
+
+/***
+ * Branch one state into children the way a tree search does, once with
+ * forks and once by loading a save state into a spare machine, and count
+ * the pages the forks had to copy.
+ */
+int main(int argc, char* argv[]) {
+  const char* rom = argc > 1 ? argv[1] : "rom/mega_man.gg";
+  struct gg_machine* parent = gg_machine_create(rom);
+  struct gg_machine* spare = gg_machine_create(rom);
+  struct gg_machine* child;
+  static uint8_t state[STATE_SIZE];
+  uint64_t start, fork_ticks = 0, copy_ticks = 0, copied = 0;
+  uint32_t i, frame;
+
+  if (parent == NULL || spare == NULL)
+    return 1;
+  gg_machine_select(spare);
+  render_set_silent(1);
+  gg_machine_select(parent);
+  render_set_silent(1);
+  for (frame = 0; frame < BENCH_WARMUP; frame++)
+    z80_run_frame();
+
+  for (i = 0; i < BENCH_CHILDREN; i++) {
+    start = SDL_GetPerformanceCounter();
+    child = gg_machine_fork(parent);
+    fork_ticks += SDL_GetPerformanceCounter() - start;
+    gg_machine_select(child);
+    for (frame = 0; frame < BENCH_DEPTH; frame++) {
+      io_set_buttons(1 << ((i + frame) % 8));
+      z80_run_frame();
+    }
+    copied += child->pages.copied;
+    gg_machine_destroy(child);
+
+    gg_machine_select(parent);
+    start = SDL_GetPerformanceCounter();
+    state_save(state, sizeof(state));
+    gg_machine_select(spare);
+    state_load(state, sizeof(state));
+    copy_ticks += SDL_GetPerformanceCounter() - start;
+    gg_machine_select(parent);
+  }
+
+  printf("\n%-22s %10.2f us\n", "fork", bench_us(fork_ticks));
+  printf("%-22s %10.2f us\n", "save state copy", bench_us(copy_ticks));
+  printf("%-22s %10.1f of %u, after %u frames\n", "pages copied by a fork",
+      (double)copied / BENCH_CHILDREN, PAGE_COUNT, BENCH_DEPTH);
+  printf("%-22s %10u\n", "pages parent copied", parent->pages.copied);
+  gg_machine_destroy(spare);
+  gg_machine_destroy(parent);
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "render.h"
+#include "sched.h"
+#include "machine.h"
+
+#define BENCH_WARMUP 60
+#define BENCH_FRAMES 600
+/* Frames both backends draw with the scroll registers set by hand */
+#define BENCH_SCROLL_FRAMES 64
+
+/* Milliseconds per frame for running the ROM, optionally drawing every
+ * line of every frame */
+static double bench_run(const char* rom, const struct render_backend* backend, int redraw) {
+  struct gg_machine* m = gg_machine_create(rom);
+  uint64_t start, ticks = 0;
+  uint32_t frame;
+
+  render_set_backend(backend);
+  for (frame = 0; frame < BENCH_WARMUP; frame++)
+    z80_run_frame();
+
+  for (frame = 0; frame < BENCH_FRAMES; frame++) {
+    if (redraw)
+      render_invalidate();
+    start = SDL_GetPerformanceCounter();
+    z80_run_frame();
+    ticks += SDL_GetPerformanceCounter() - start;
+  }
+  gg_machine_destroy(m);
+  return 1000.0 * ticks / SDL_GetPerformanceFrequency() / BENCH_FRAMES;
+}
+
+static void bench_register(uint8_t reg, uint8_t value) {
+  vdp_control_write(0xbf, value);
+  vdp_control_write(0xbf, 0x80 | reg);
+}
+
+/***
+ * Hash of every frame drawn from pseudo random VRAM and CRAM, with the
+ * horizontal and vertical scroll and the vertical scroll lock changed
+ * between frames. The CPU does not run, so there are no mid-line writes
+ * and both backends have to give the same frames.
+ */
+static void bench_scroll(const char* rom, const struct render_backend* backend,
+    uint32_t* hashes) {
+  struct gg_machine* m = gg_machine_create(rom);
+  uint32_t frame, hash, seed = 1, i;
+
+  render_set_backend(backend);
+  vdp_control_read(0xbf);
+  vdp_control_write(0xbf, 0x00);
+  vdp_control_write(0xbf, 0x40);
+  for (i = 0; i < VRAM_SZ; i++) {
+    seed = seed * 1103515245 + 12345;
+    vdp_data_write(0xbe, seed >> 16);
+  }
+  vdp_control_write(0xbf, 0x00);
+  vdp_control_write(0xbf, 0xc0);
+  for (i = 0; i < CRAM_SZ; i++)
+    vdp_data_write(0xbe, i * 37);
+  /* Name table at 0x3800, sprites at 0x3f00 with tiles from 0x0000 */
+  bench_register(1, 0x40);
+  bench_register(2, 0xff);
+  bench_register(5, 0xff);
+  bench_register(6, 0xfb);
+
+  for (frame = 0; frame < BENCH_SCROLL_FRAMES; frame++) {
+    bench_register(0, (frame & 3) << 6);
+    bench_register(8, frame * 13);
+    bench_register(9, frame * 7 % 224);
+    machine->z80.cycles = machine->vdp.frame_start + VDP_FRAME_CYCLES;
+    sched_dispatch(machine->z80.cycles);
+
+    hash = 2166136261u;
+    for (i = 0; i < sizeof(machine->render.cache->framebuffer); i++)
+      hash = (hash ^ ((uint8_t*)machine->render.cache->framebuffer)[i]) * 16777619u;
+    hashes[frame] = hash;
+  }
+  gg_machine_destroy(m);
+}
+
+int main(int argc, char* argv[]) {
+  const struct render_backend* backends[] = { &render_fast, &render_accurate };
+  const char* rom = argc > 1 ? argv[1] : "rom/mega_man.gg";
+  double as_run[2], redraw[2];
+  uint32_t scroll[2][BENCH_SCROLL_FRAMES];
+  unsigned i, differ = 0;
+
+  for (i = 0; i < 2; i++) {
+    as_run[i] = bench_run(rom, backends[i], 0);
+    redraw[i] = bench_run(rom, backends[i], 1);
+    bench_scroll(rom, backends[i], scroll[i]);
+  }
+  for (i = 0; i < BENCH_SCROLL_FRAMES; i++)
+    differ += scroll[0][i] != scroll[1][i];
+
+  printf("\n%-10s %12s %12s\n", "backend", "ms/frame", "full redraw");
+  for (i = 0; i < 2; i++)
+    printf("%-10s %12.3f %12.3f\n", backends[i]->name, as_run[i], redraw[i]);
+  printf("%u of %u scrolled frames differ between the backends\n", differ,
+      BENCH_SCROLL_FRAMES);
+  return differ != 0;
+}
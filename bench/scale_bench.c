@@ -0,0 +1,108 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <SDL2/SDL.h>
+
+#include "scale.h"
+
+#define BENCH_FRAMES 500
+
+static uint32_t out[GG_HEIGHT * SCALE_MAX][GG_WIDTH * SCALE_MAX];
+
+static double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* FNV-1a over the output, to compare builds with and without SIMD */
+static uint32_t bench_hash(unsigned factor) {
+  const uint8_t* p;
+  uint32_t hash = 2166136261u;
+  unsigned y, i;
+
+  for (y = 0; y < GG_HEIGHT * factor; y++) {
+    p = (const uint8_t*)out[y];
+    for (i = 0; i < GG_WIDTH * factor * 4; i++)
+      hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/* Something like a game screen: 8x8 tiles of a few colours each, with
+ * diagonal edges and a gradient for the filters to find */
+static void bench_fill(void) {
+  static const uint32_t colors[8] = {
+    0xff000000, 0xffffffff, 0xff2255aa, 0xff3366bb,
+    0xffaa4411, 0xffbb5522, 0xff44cc44, 0xff55dd55,
+  };
+  uint32_t* row;
+  unsigned x, y, tile;
+
+  srand(1);
+  for (y = 0; y < GG_HEIGHT; y++) {
+    row = scale_source(y);
+    for (x = 0; x < GG_WIDTH; x++) {
+      tile = (x / 8 * 7 + y / 8 * 13) & 7;
+      if ((x & 7) > (y & 7))
+        row[x] = colors[tile];
+      else if ((rand() & 15) == 0)
+        row[x] = colors[rand() & 7];
+      else
+        row[x] = colors[(tile + 1) & 7];
+    }
+  }
+  scale_update(0, GG_HEIGHT);
+}
+
+int main(void) {
+  static const unsigned threads[] = { 1, 2, 4 };
+  const struct scale_filter* filters;
+  unsigned count, f, t, frame;
+  double start, ms;
+
+  bench_fill();
+  filters = scale_filters(&count);
+  for (f = 0; f < count; f++) {
+    if (filters[f].run == NULL)
+      continue;
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+      scale_init(threads[t]);
+      memset(out, 0, sizeof(out));
+      start = bench_now();
+      for (frame = 0; frame < BENCH_FRAMES; frame++)
+        scale_frame(&filters[f], (uint8_t*)out, sizeof(out[0]), 0, GG_HEIGHT);
+      ms = (bench_now() - start) * 1e3 / BENCH_FRAMES;
+      scale_destroy();
+
+      printf("%-10s %u threads %7.3f ms/frame %08x\n", filters[f].name,
+          threads[t], ms, bench_hash(filters[f].factor));
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tile_decode.h"
+
+#define BENCH_TILES 512
+#define BENCH_ROUNDS 2000
+
+static uint8_t vram[BENCH_TILES * 32];
+static uint8_t tiles[BENCH_TILES][2][64];
+static uint8_t expect[BENCH_TILES][2][64];
+
+static double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  const struct tile_decode_kernel* kernels;
+  unsigned count, k, round, tile;
+  double start, ns, base = 0;
+
+  srand(1);
+  for (tile = 0; tile < sizeof(vram); tile++)
+    vram[tile] = rand();
+
+  tile_decode_init();
+  kernels = tile_decode_kernels(&count);
+  for (tile = 0; tile < BENCH_TILES; tile++)
+    tile_decode_reference(&vram[tile * 32], expect[tile][0], expect[tile][1], 8);
+
+  for (k = 0; k < count; k++) {
+    memset(tiles, 0, sizeof(tiles));
+    start = bench_now();
+    for (round = 0; round < BENCH_ROUNDS; round++)
+      for (tile = 0; tile < BENCH_TILES; tile++)
+        kernels[k].decode(&vram[tile * 32], tiles[tile][0], tiles[tile][1], 8);
+    ns = (bench_now() - start) * 1e9 / ((double)BENCH_ROUNDS * BENCH_TILES);
+    if (k == 0)
+      base = ns;
+
+    printf("%-10s %7.2f ns/tile %6.2fx %s\n", kernels[k].name, ns, base / ns,
+        memcmp(tiles, expect, sizeof(tiles)) ? "MISMATCH" : "ok");
+  }
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __AUDIO_H__
+#define __AUDIO_H__
+
+/* Stereo frames the ring holds, a power of two */
+#define AUDIO_RING 16384
+/* Frames SDL asks for per callback */
+#define AUDIO_CALLBACK_FRAMES 512
+/* Largest change of the resampling ratio, 0.5% */
+#define AUDIO_MAX_ADJUST 0.005
+/* How fast the rate control learns a steady drift, per frame */
+#define AUDIO_DRIFT_GAIN 0.000002
+
+struct audio_stats {
+  double latency_ms;    /* Audio queued in the ring, smoothed, and the device buffer */
+  double target_ms;     /* Latency the rate control steers to */
+  double ratio;         /* Current resampling ratio */
+  uint32_t underruns;   /* Callbacks the ring could not fill */
+  uint32_t overruns;    /* Frames dropped because the ring was full */
+};
+
+int audio_init(unsigned latency_ms);
+void audio_push(const int16_t* samples, unsigned count);
+void audio_stats(struct audio_stats* stats);
+void audio_destroy(void);
+
+#endif /*__AUDIO_H__*/
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdint.h>
+
+/* Frames an instance runs before its worker looks for other work */
+#define BATCH_SLICE 60
+#define BATCH_MAX_WORKERS 64
+/* Frames to wait for a boot PC, a minute */
+#define BATCH_BOOT_LIMIT 3600
+
+struct gg_machine;
+
+/***
+ * One line of the job file: a ROM run for a number of frames with the
+ * buttons of a movie, one io_set_buttons() byte per frame, the last one
+ * held when the movie is shorter. A job can be several episodes, each
+ * starting from a reset with the movie from the top. Resets go back to a
+ * boot snapshot if the job has a boot point, a number of frames or a PC.
+ * Outputs are the hash of the final state, a save state file and the
+ * final frame as a PPM.
+ */
+struct batch_job {
+  char* rom;
+  char* movie;
+  char* state_path;
+  char* ppm_path;
+  uint32_t frames;      /* Per episode */
+  uint32_t episodes;
+  uint32_t boot_frames; /* 0 if resets power up */
+  int32_t boot_pc;      /* -1 unless the boot point is a PC */
+  int want_hash;
+
+  uint8_t* buttons;
+  uint32_t buttons_count;
+  struct gg_machine* machine;
+  uint32_t done;        /* Frames run so far, over all episodes */
+  uint32_t hash;
+  int failed;
+};
+
+int batch_run(const char* path, unsigned workers);
+
+#endif /*__BATCH_H__*/
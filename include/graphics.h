@@ -25,8 +25,26 @@
 #define GG_WIDTH   160
 #define GG_HEIGHT  144
 #define GG_DEPTH   4
+/* Initial window size as a multiple of the display */
+#define GG_SCALE   3
+
+/* Counters of the video output */
+struct gg_graphics_stats {
+  uint32_t presented;   /* Frames shown */
+  uint32_t dropped;     /* Frames replaced before the render thread took them */
+  uint32_t duplicated;  /* Frames shown again for the window, not the emulation */
+  uint32_t filtered;    /* Frames run through the upscaling filter */
+  uint32_t filter_us;   /* Time spent converting and filtering them */
+};
+
+struct scale_filter;
+
+void gg_graphics_set_filter(const struct scale_filter* filter);
 
 void gg_graphics_init(void);
+int gg_graphics_present(void);
+void gg_graphics_expose(void);
+void gg_graphics_stats(struct gg_graphics_stats* stats);
 void gg_graphics_destroy(void);
 
 #endif /*__GRAPHICS_H__*/
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __IO_H__
+#define __IO_H__
+
+/* Joypad bits on port 0xdc, active low */
+#define JOY_UP      0x01
+#define JOY_DOWN    0x02
+#define JOY_LEFT    0x04
+#define JOY_RIGHT   0x08
+#define JOY_BUTTON1 0x10
+#define JOY_BUTTON2 0x20
+/* Start button, reported on bit 7 of port 0x00 */
+#define JOY_START   0x80
+
+/* Serial bytes that cross the link per frame and direction, 4800 baud
+ * would allow eight */
+#define IO_LINK_BYTES 8
+
+/* Link status bits on port 0x05 */
+#define IO_LINK_TX_FULL  0x01
+#define IO_LINK_RX_READY 0x02
+#define IO_LINK_TX_ON    0x10
+
+/***
+ * What one Game Gear puts on the link during a frame: the parallel pins
+ * it drives at the end of it and the serial bytes it sent. The other
+ * machine sees them during a later frame, so the link needs nothing but
+ * this per frame.
+ */
+struct io_link_frame {
+  uint8_t parallel;
+  uint8_t count;
+  uint8_t bytes[IO_LINK_BYTES];
+};
+
+typedef uint8_t (*io_read_handler)(uint8_t port);
+typedef void (*io_write_handler)(uint8_t port, uint8_t value);
+
+/***
+ * Port map of the Game Gear. Every one of the 256 ports has a read and a
+ * write handler, mirrors included, so that an access is a single indexed
+ * call without decoding the port number.
+ */
+struct io_state {
+  uint8_t buttons;    /* Currently pressed buttons, JOY_* bits */
+  uint8_t link[6];    /* Gear-to-Gear link registers 0x01 - 0x05 */
+  uint8_t link_pins;  /* Parallel pins driven by the other machine */
+  uint8_t tx[IO_LINK_BYTES];  /* Bytes sent this frame */
+  uint8_t tx_count;
+  uint8_t rx[IO_LINK_BYTES];  /* Bytes received and not read yet */
+  uint8_t rx_count;
+  uint8_t stereo;     /* PSG stereo control, port 0x06 */
+  uint8_t mem_ctrl;   /* Memory control, port 0x3e */
+  uint8_t io_ctrl;    /* I/O control, port 0x3f */
+  uint8_t sms_mode;   /* SMS cartridge, start acts as the pause button */
+};
+
+extern io_read_handler io_read_map[256];
+extern io_write_handler io_write_map[256];
+
+void io_init(void);
+void io_set_buttons(uint8_t buttons);
+uint64_t io_read_stable_until(uint8_t port);
+void io_link_output(struct io_link_frame* out);
+void io_link_input(const struct io_link_frame* in);
+
+static inline uint8_t io_read(uint8_t port) {
+  return io_read_map[port](port);
+}
+
+static inline void io_write(uint8_t port, uint8_t value) {
+  io_write_map[port](port, value);
+}
+
+#endif /*__IO_H__*/
@@ -22,5 +22,6 @@
 #define __LOADER_H__
 
 uint8_t* loader_load_rom(const char* path, uint8_t* rom_buffer);
+uint8_t loader_rom_region(const uint8_t* rom_buffer);
 
 #endif /*__LOADER_H__*/
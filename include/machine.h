@@ -0,0 +1,68 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __MACHINE_H__
+#define __MACHINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "io.h"
+#include "sched.h"
+#include "psg.h"
+#include "render.h"
+#include "page.h"
+
+/***
+ * Everything one Game Gear is made of. The devices reach the machine they
+ * emulate through the per thread machine pointer, so any number of them
+ * can live in one process, each stepped by one thread at a time. What is
+ * left outside are tables that are the same for every machine and the
+ * front end: window, audio device, rewind and netplay.
+ */
+struct gg_machine {
+  const uint8_t* rom;  /* Shared with other machines, see rom_cache_get() */
+  uint32_t rom_hash;  /* FNV-1a of the ROM, identifies it in save states */
+  const uint8_t* boot; /* Snapshot resets go back to, see gg_machine_set_boot() */
+  struct z80_state z80;
+  struct page_table pages; /* RAM and VRAM, shared with forks */
+  struct vdp_state vdp;
+  struct io_state io;
+  struct sched_state sched;
+  struct psg_state psg;
+  struct render_state render;
+};
+
+/* Machine the calling thread emulates */
+extern __thread struct gg_machine* machine;
+
+struct gg_machine* gg_machine_create(const char* rom_path);
+void gg_machine_destroy(struct gg_machine* m);
+void gg_machine_select(struct gg_machine* m);
+void gg_machine_run_frame(struct gg_machine* m);
+size_t gg_machine_run_boot(struct gg_machine* m, uint32_t frames, int32_t pc,
+    uint8_t* buf, size_t size);
+void gg_machine_set_boot(struct gg_machine* m, const uint8_t* state);
+int gg_machine_reset(struct gg_machine* m);
+struct gg_machine* gg_machine_fork(struct gg_machine* parent);
+
+#endif /*__MACHINE_H__*/
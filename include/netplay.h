@@ -0,0 +1,66 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __NETPLAY_H__
+#define __NETPLAY_H__
+
+#include <stdint.h>
+
+/* Frames the link takes unless the spec says otherwise. The real link
+ * takes none, but input that arrives before it is needed never has to be
+ * predicted; this should cover the one way latency and a frame */
+#define NETPLAY_LINK_FRAMES 4
+/* Most frames the link may take */
+#define NETPLAY_LINK_MAX 15
+/* Frames kept to roll back to, each a full save state */
+#define NETPLAY_WINDOW 32
+/* Frames the machine may run past the newest one heard from the other */
+#define NETPLAY_LEAD 16
+/* Frames of the other machine's link output remembered */
+#define NETPLAY_REMOTE 128
+/* Confirmed frame checksums kept to compare with the other side */
+#define NETPLAY_CHECKS 64
+/* Packets held back to inject latency */
+#define NETPLAY_QUEUE 256
+
+struct netplay_stats {
+  uint32_t frames;      /* Frames run */
+  uint32_t rollbacks;   /* Times a wrong prediction was undone */
+  uint32_t replayed;    /* Frames run again by them */
+  uint32_t max_replay;  /* Most frames one rollback ran again */
+  uint32_t replays[NETPLAY_WINDOW + 1]; /* Rollbacks by frames replayed */
+  uint32_t stalls;      /* Frames waited because the other side was behind */
+  uint32_t sent;
+  uint32_t received;
+  uint32_t dropped;     /* Packets thrown away to inject loss */
+  uint32_t late;        /* Corrections older than the window, desyncs */
+  uint32_t checks;      /* Checksums compared */
+  uint32_t desyncs;     /* Checksums that differed */
+  int32_t lead;         /* Frames ahead of the newest one heard */
+  uint64_t rollback_ticks; /* Performance counter ticks spent replaying */
+};
+
+int netplay_init(const char* spec);
+int netplay_run_frame(void);
+void netplay_drain(unsigned ms);
+void netplay_stats(struct netplay_stats* stats);
+void netplay_destroy(void);
+
+#endif /*__NETPLAY_H__*/
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __PAGE_H__
+#define __PAGE_H__
+
+#include <stdint.h>
+
+#include "z80.h"
+
+/* RAM and VRAM are made of pages of this size, the unit forks share */
+#define PAGE_SHIFT 10
+#define PAGE_SZ (1 << PAGE_SHIFT)
+/* Offsets of RAM and VRAM in the pages of a machine */
+#define PAGE_RAM 0
+#define PAGE_VRAM RAM_SZ
+#define PAGE_COUNT ((RAM_SZ + VRAM_SZ) >> PAGE_SHIFT)
+
+struct page;
+
+/***
+ * Pages of a machine. read[] points at the data of every page; write[]
+ * does too once the machine owns the page, and is NULL while the page is
+ * shared with a fork, so the first write copies it.
+ */
+struct page_table {
+  uint8_t* read[PAGE_COUNT];
+  uint8_t* write[PAGE_COUNT];
+  struct page* pages[PAGE_COUNT];
+
+  /* Statistics */
+  uint32_t forks;       /* Times the machine was forked */
+  uint32_t copied;      /* Pages copied because a shared one was written */
+};
+
+int page_alloc(struct page_table* table);
+void page_free(struct page_table* table);
+void page_share(struct page_table* child, struct page_table* parent);
+uint8_t* page_own(struct page_table* table, uint32_t index);
+void page_copy_out(const struct page_table* table, uint32_t offset, uint8_t* out,
+    uint32_t size);
+void page_copy_in(struct page_table* table, uint32_t offset, const uint8_t* in,
+    uint32_t size);
+uint32_t page_shared(const struct page_table* table);
+
+/* Byte at offset, which is PAGE_RAM or PAGE_VRAM plus the address */
+static inline uint8_t page_read(const struct page_table* table, uint32_t offset) {
+  return table->read[offset >> PAGE_SHIFT][offset & (PAGE_SZ - 1)];
+}
+
+/* Bytes from offset to the end of its page */
+static inline const uint8_t* page_data(const struct page_table* table, uint32_t offset) {
+  return &table->read[offset >> PAGE_SHIFT][offset & (PAGE_SZ - 1)];
+}
+
+static inline void page_write(struct page_table* table, uint32_t offset, uint8_t value) {
+  uint8_t* data = table->write[offset >> PAGE_SHIFT];
+
+  if (data == NULL)
+    data = page_own(table, offset >> PAGE_SHIFT);
+  data[offset & (PAGE_SZ - 1)] = value;
+}
+
+#endif /*__PAGE_H__*/
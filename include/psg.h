@@ -0,0 +1,77 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __PSG_H__
+#define __PSG_H__
+
+/* Default output rate until the audio device reports its own */
+#define PSG_RATE 44100
+/* Phases and taps of the band limited step */
+#define PSG_PHASES 32
+#define PSG_TAPS 16
+/* Samples of deltas one frame can produce, plenty for 96 kHz */
+#define PSG_BUFFER 2048
+/* High pass of the output, about 14 Hz at 44.1 kHz */
+#define PSG_BASS_SHIFT 9
+
+struct psg_channel {
+  uint16_t period;    /* Tone: 10 bit period, noise: control bits */
+  uint8_t volume;     /* Attenuation in 2 dB steps, 15 is off */
+  uint8_t output;     /* State of the channel's flip-flop */
+  uint64_t next;      /* Cycle the flip-flop toggles next */
+  int16_t amp[2];     /* What the channel adds to left and right now */
+};
+
+/***
+ * SN76489 with the Game Gear's stereo register. The chip is not clocked
+ * along with the CPU: it catches up to the current cycle when it is
+ * written to and at the end of a frame. Every change of a channel's
+ * output is added to the sample buffer as a band limited step, so only
+ * the flip-flop toggles cost time, not the 3.58 MHz clock.
+ */
+struct psg_state {
+  struct psg_channel channel[4];
+  uint8_t latch;          /* Channel << 1 | volume bit of the last latch */
+  uint8_t stereo;         /* Port 0x06: left enables high, right low */
+  uint16_t lfsr;          /* Noise shift register */
+  uint64_t time;          /* Cycle the channels are synced to */
+
+  uint32_t rate;          /* Output sample rate */
+  uint64_t factor;        /* Samples per cycle, 32.32 fixed point */
+  uint64_t base_cycle;    /* Cycle at the start of the buffer... */
+  uint32_t base_pos;      /* ...plus this fraction of a sample, 16.16 */
+  int32_t buffer[2][PSG_BUFFER + PSG_TAPS];
+  int32_t sum[2];         /* Integrators of left and right */
+
+  uint8_t silent;         /* Run the channels without producing sound */
+  uint32_t events;        /* Deltas added since the last frame ended */
+  uint64_t total_events;
+};
+
+void psg_init(void);
+void psg_set_rate(uint32_t rate);
+void psg_set_ratio(double ratio);
+void psg_reset_output(void);
+void psg_write(uint8_t value);
+void psg_stereo_write(uint8_t value);
+void psg_sync(uint64_t cycle);
+unsigned psg_end_frame(uint64_t cycle, int16_t* out);
+
+#endif /*__PSG_H__*/
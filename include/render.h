@@ -0,0 +1,185 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include "z80.h"
+#include "vdp.h"
+#include "graphics.h"
+
+/* Mode 4 has 512 tiles of 32 bytes in VRAM */
+#define RENDER_TILES 512
+
+/* Position of the Game Gear window inside the 256x192 VDP picture */
+#define RENDER_GG_X 48
+#define RENDER_GG_Y 24
+
+/* The parts of the VDP the renderer draws from. It follows the live state
+ * through the VDP writes, possibly a frame behind */
+struct render_view {
+  uint8_t vram[VRAM_SZ];
+  uint8_t cram[CRAM_SZ];
+  /* The CRAM entries as 12 bit colours, BBBBGGGGRRRR */
+  uint16_t colors[CRAM_SZ / 2];
+  uint8_t regs[16];
+  uint8_t vscroll;
+};
+
+/* Kinds of VDP writes the renderer is told about */
+enum render_event_type {
+  RENDER_VRAM,       /* addr: VRAM address, value: byte */
+  RENDER_CRAM,       /* addr: colour 0 - 31, value: 12 bit colour */
+  RENDER_REG,        /* addr: register, value: byte */
+  RENDER_FRAME_END
+};
+
+struct render_event {
+  uint16_t addr;
+  uint16_t value;
+  uint8_t type;
+  uint16_t line;     /* Line and dot the write happened on */
+  uint16_t dot;
+};
+
+/***
+ * A backend draws lines of the Game Gear window from the view. draw()
+ * writes the colours of the screen pixels [from, to) of a line, 0 - 256,
+ * to the framebuffer row out, which starts at screen pixel RENDER_GG_X.
+ * Per line backends are always called with the whole line.
+ */
+struct render_backend {
+  const char* name;
+  uint8_t per_pixel;
+  void (*draw)(uint16_t line, uint16_t from, uint16_t to, uint16_t* out);
+};
+
+extern const struct render_backend render_fast;
+extern const struct render_backend render_accurate;
+
+/***
+ * Per line bit mask of the sprites covering it, bit n is sprite n, kept
+ * up to date from SAT writes. Built for the SAT address and sprite height
+ * given here.
+ */
+struct render_sprites {
+  uint64_t lines[256];
+  uint16_t base;
+  uint8_t height;     /* 0 until built */
+  /* Index of the 0xd0 terminator, 64 if there is none */
+  uint8_t end;
+};
+
+/***
+ * Caches of the scanline renderer. None of this is machine state, all of
+ * it can be rebuilt from VRAM and the VDP registers. Only the thread that
+ * draws touches it, see render_frame_acquire(). Machines that never draw
+ * never allocate it.
+ *
+ * Changes are tracked with stamps: every write to VRAM records the current
+ * stamp for its tile and its 64 byte block (one name table row), SAT writes
+ * record it for the lines the sprite covers. A line remembers the stamp it
+ * was drawn with and the registers it depends on, and is only drawn again
+ * if one of them changed.
+ */
+struct render_cache {
+  struct render_view view;
+  /* 12 bit colours of the visible window, looked up when drawn */
+  uint16_t framebuffer[GG_HEIGHT][GG_WIDTH];
+  /* Decoded tiles, one byte per pixel: [tile][hflip][row * 8 + x].
+   * Vertical flipping only changes the row, so it is not stored */
+  uint8_t tiles[RENDER_TILES][2][64];
+  /* Tiles written since they were last decoded */
+  uint8_t dirty[RENDER_TILES];
+  uint16_t dirty_list[RENDER_TILES];
+  uint16_t dirty_count;
+  /* Next line and dot to draw */
+  uint16_t line;
+  uint16_t dot;
+
+  /* Stamp of the next batch of lines, 0 marks a line as never drawn */
+  uint32_t stamp;
+  uint32_t tile_stamp[RENDER_TILES];
+  uint32_t vram_stamp[VRAM_SZ >> 6];
+  /* Stamp of the last colour change, lines drawn before show the old one */
+  uint32_t cram_stamp;
+  uint32_t sprite_stamp[GG_HEIGHT];
+  /* Per window line: stamp it was drawn with and registers it used */
+  uint32_t line_stamp[GG_HEIGHT];
+  uint64_t line_regs[GG_HEIGHT];
+
+  /* Sprites of the view */
+  struct render_sprites sprites;
+
+  /* Window rows drawn in the current frame, [top, bottom) */
+  uint16_t frame_top;
+  uint16_t frame_bottom;
+  /* Rows of the last finished frame that differ from the frame before */
+  uint16_t update_top;
+  uint16_t update_bottom;
+
+  /* Sprites of the line the per pixel renderer draws */
+  struct {
+    uint8_t count;
+    int16_t x[8];
+    uint16_t tile[8];
+    uint8_t row[8];
+  } line_sprites;
+};
+
+/* What a machine keeps of the renderer whether it draws or not */
+struct render_state {
+  const struct render_backend* backend;
+  /* Set up on the first frame drawn, NULL until then */
+  struct render_cache* cache;
+  /* Worker drawing the frames, see render_set_pipelined() */
+  struct render_pipe* pipe;
+  /* Sprites of the live SAT and the next active line the sprite flags
+   * are raised for, see render_flags_sync() */
+  struct render_sprites sprites;
+  uint16_t flags_line;
+  /* Frames are emulated but not drawn, see render_set_silent() */
+  int silent;
+
+  /* Statistics */
+  uint64_t lines_drawn;
+  uint64_t lines_skipped;
+  uint64_t frames_unchanged;
+};
+
+void render_init(void);
+void render_destroy(void);
+void render_invalidate(void);
+void render_set_pipelined(int enabled);
+void render_set_silent(int silent);
+void render_set_backend(const struct render_backend* backend);
+const struct render_backend* render_find_backend(const char* name);
+void render_write(uint8_t type, uint16_t addr, uint16_t value);
+void render_flags_sync(uint16_t line);
+void render_frame_end(void);
+void render_frame_acquire(void);
+void render_frame_release(void);
+void render_sprite_rebuild(void);
+
+/* For the backends */
+uint8_t render_sprite_list(uint16_t line, uint8_t* list);
+uint16_t render_sprite_tile(uint16_t line, uint8_t n, uint8_t* row);
+
+#endif /*__RENDER_H__*/
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#include <stddef.h>
+
+/* Snapshots between two full ones; the others are deltas against them */
+#define REWIND_KEY_INTERVAL 60
+/* Most snapshots kept, whatever the budget */
+#define REWIND_RECORDS 65536
+
+struct rewind_stats {
+  uint32_t snapshots;   /* Snapshots held */
+  uint32_t frames;      /* Frames of history they cover */
+  size_t bytes;         /* Memory the snapshots take */
+  uint64_t captures;    /* Snapshots taken so far */
+  uint64_t capture_ticks; /* Performance counter ticks spent taking them */
+};
+
+int rewind_init(size_t budget, unsigned interval);
+void rewind_capture(void);
+int rewind_step(void);
+void rewind_stats(struct rewind_stats* stats);
+void rewind_destroy(void);
+
+#endif /*__REWIND_H__*/
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __ROM_CACHE_H__
+#define __ROM_CACHE_H__
+
+#include <stdint.h>
+
+struct rom_cache_stats {
+  uint32_t images;      /* ROM images loaded */
+  uint32_t users;       /* Machines sharing them */
+  uint32_t loads;       /* ROMs asked for */
+  uint32_t reads;       /* Files read for them */
+  uint32_t hits;        /* Of them already loaded */
+};
+
+const uint8_t* rom_cache_get(const char* path, uint32_t* hash);
+void rom_cache_share(const uint8_t* rom);
+void rom_cache_put(const uint8_t* rom);
+void rom_cache_stats(struct rom_cache_stats* stats);
+
+#endif /*__ROM_CACHE_H__*/
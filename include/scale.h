@@ -0,0 +1,58 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SCALE_H__
+#define __SCALE_H__
+
+#include "graphics.h"
+
+/* Largest factor of all filters */
+#define SCALE_MAX 3
+/* Row length of the source buffer, 4 pixels of border on either side */
+#define SCALE_PITCH (GG_WIDTH + 8)
+/* Largest number of bands a frame is split into */
+#define SCALE_THREADS 8
+
+/***
+ * An upscaling filter turns the source rows [y0, y1) into factor times as
+ * many rows of factor times the width. dst points at the first output row,
+ * pitch is in bytes. Filters read neighbours across the border, which
+ * repeats the outermost pixels.
+ */
+typedef void (*scale_fn)(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1);
+
+struct scale_filter {
+  const char* name;
+  uint8_t factor;
+  scale_fn run;
+};
+
+const struct scale_filter* scale_find(const char* name);
+const struct scale_filter* scale_filters(unsigned* count);
+
+void scale_init(unsigned threads);
+void scale_destroy(void);
+uint32_t* scale_source(uint16_t y);
+void scale_update(uint16_t top, uint16_t bottom);
+void scale_span(uint16_t* top, uint16_t* bottom);
+void scale_frame(const struct scale_filter* filter, uint8_t* dst, int pitch,
+    uint16_t top, uint16_t bottom);
+
+#endif /*__SCALE_H__*/
@@ -0,0 +1,67 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+/***
+ * Events the devices can schedule. Every event exists at most once, so
+ * rescheduling an event replaces its pending entry.
+ */
+enum sched_event {
+  SCHED_LINE_IRQ,     /* VDP line counter underflow */
+  SCHED_FRAME_IRQ,    /* VDP frame (vblank) interrupt */
+  SCHED_FRAME_END,    /* Last cycle of the last scanline */
+  SCHED_NMI,          /* Start button in SMS mode */
+  SCHED_EVENTS
+};
+
+#define SCHED_NEVER UINT64_MAX
+
+/* Called with the cycle the event was scheduled for */
+typedef void (*sched_callback)(uint64_t when);
+
+struct sched_entry {
+  uint64_t when;
+  uint8_t pending;
+};
+
+/***
+ * Binary min-heap of pending events ordered by the CPU cycle they fire
+ * on. The CPU runs in one block up to the deadline, which is the earliest
+ * pending event unless a device breaks the block early.
+ */
+struct sched_state {
+  struct sched_entry events[SCHED_EVENTS];
+  uint8_t heap[SCHED_EVENTS];   /* Event ids, heap ordered by when */
+  uint8_t slot[SCHED_EVENTS];   /* Position of each event in heap[] */
+  uint8_t count;
+  uint64_t deadline;
+};
+
+void sched_init(void);
+void sched_register(enum sched_event event, sched_callback callback);
+void sched_add(enum sched_event event, uint64_t when);
+void sched_cancel(enum sched_event event);
+uint64_t sched_next(void);
+void sched_dispatch(uint64_t now);
+void sched_break(void);
+
+#endif /*__SCHED_H__*/
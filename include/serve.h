@@ -0,0 +1,103 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SERVE_H__
+#define __SERVE_H__
+
+#include <stdint.h>
+
+#include "z80.h"
+#include "graphics.h"
+#include "state.h"
+
+/***
+ * Step/observe server for agents in another process. Commands arrive on
+ * a Unix domain socket, observations are read from a shared memory file
+ * next to it, <socket>.shm. All integers are in the byte order of the
+ * machine running the server.
+ *
+ * A request is a uint32_t count followed by that many commands. They
+ * run in order for each instance, and instances run in parallel. The
+ * reply is a struct serve_reply followed by one status byte per command,
+ * 0 if it worked.
+ */
+#define SERVE_MAGIC "SGGM"
+#define SERVE_VERSION 1
+#define SERVE_MAX_INSTANCES 256
+#define SERVE_MAX_COMMANDS 4096
+/* Stereo pairs of sound one step keeps, 11 frames at 44.1 kHz */
+#define SERVE_AUDIO_SAMPLES 8192
+/* The header takes the first page of the file, instances follow */
+#define SERVE_HEADER_SIZE 4096
+
+enum serve_op {
+  SERVE_RESET,    /* Power up, or go back to the boot snapshot */
+  SERVE_STEP,     /* Run frames with the buttons held */
+  SERVE_SAVE,     /* Save the machine to its state area */
+  SERVE_LOAD      /* Load the machine from its state area */
+};
+
+/* Observations a step fills in besides RAM */
+#define SERVE_FRAMEBUFFER 0x01
+#define SERVE_AUDIO       0x02
+
+struct serve_command {
+  uint8_t op;
+  uint8_t flags;      /* SERVE_FRAMEBUFFER and SERVE_AUDIO for a step */
+  uint8_t buttons;    /* io_set_buttons() mask held during a step */
+  uint8_t reserved;
+  uint16_t instance;
+  uint16_t frames;    /* Frames a step runs */
+};
+
+struct serve_reply {
+  uint32_t count;     /* Status bytes that follow */
+  uint32_t failed;    /* Commands that did not work */
+  uint64_t service_ns; /* From the request arriving to the reply */
+};
+
+/* Start of the shared memory file */
+struct serve_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t instances;
+  uint32_t instance_size; /* Distance of the instances, page aligned */
+  uint32_t state_size;    /* Size of the state area */
+};
+
+/***
+ * Observations of one instance, at SERVE_HEADER_SIZE + n * instance_size.
+ * A step writes RAM, and the framebuffer and the sound if asked to,
+ * before the reply is sent.
+ */
+struct serve_instance {
+  uint32_t frame;         /* Frames run since the last reset */
+  uint32_t audio_count;   /* Stereo pairs in audio from the last step */
+  uint32_t audio_dropped; /* Pairs of the last step that did not fit */
+  uint32_t state_bytes;   /* Size of the last save */
+  uint16_t framebuffer[GG_HEIGHT][GG_WIDTH]; /* 12 bit colours, BBBBGGGGRRRR */
+  uint8_t ram[RAM_SZ];
+  int16_t audio[SERVE_AUDIO_SAMPLES * 2]; /* Interleaved left and right */
+  uint8_t state[STATE_SIZE];
+};
+
+int serve_run(const char* path, const char* rom_path, unsigned instances, int stats);
+
+#endif /*__SERVE_H__*/
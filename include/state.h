@@ -0,0 +1,72 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stddef.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "io.h"
+#include "sched.h"
+#include "psg.h"
+
+#define STATE_MAGIC "SGGS"
+/* Bump whenever a saved struct changes */
+#define STATE_VERSION 2
+
+struct state_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;      /* sizeof(struct state_blob) of the writer */
+  uint32_t rom_hash;  /* FNV-1a of the ROM the state belongs to */
+};
+
+/***
+ * A save state is the device structs copied one after the other, so
+ * saving and loading are a handful of memcpys. Everything derived from
+ * them, the render caches and the audio output, is rebuilt on load. The
+ * layout depends on the build; the size in the header catches a state
+ * from a build with different structs.
+ */
+struct state_blob {
+  struct state_header header;
+  struct z80_state z80;
+  uint8_t ram[RAM_SZ];
+  uint8_t vram[VRAM_SZ];
+  struct vdp_state vdp;
+  struct io_state io;
+  struct sched_state sched;
+  struct psg_channel psg_channel[4];
+  uint8_t psg_latch;
+  uint8_t psg_stereo;
+  uint16_t psg_lfsr;
+  uint64_t psg_time;
+};
+
+#define STATE_SIZE sizeof(struct state_blob)
+
+size_t state_save(uint8_t* buf, size_t size);
+int state_load(const uint8_t* buf, size_t size);
+int state_save_file(const char* path);
+int state_load_file(const char* path);
+
+#endif /*__STATE_H__*/
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __TILE_DECODE_H__
+#define __TILE_DECODE_H__
+
+/***
+ * Planar to chunky conversion of mode 4 tiles. Every tile row is stored as
+ * 4 bytes, one per bitplane, with the leftmost pixel in bit 7. A kernel
+ * decodes the given number of rows into one byte per pixel and writes the
+ * same rows mirrored horizontally to flip. Both outputs use 8 bytes per
+ * row, src is read with 4 bytes per row.
+ */
+typedef void (*tile_decode_fn)(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows);
+
+struct tile_decode_kernel {
+  const char* name;
+  tile_decode_fn decode;
+};
+
+/* Kernel picked by tile_decode_init() */
+extern tile_decode_fn tile_decode;
+
+void tile_decode_init(void);
+const struct tile_decode_kernel* tile_decode_kernels(unsigned* count);
+
+void tile_decode_reference(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows);
+void tile_decode_scalar(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows);
+
+#endif /*__TILE_DECODE_H__*/
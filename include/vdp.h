@@ -0,0 +1,79 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __VDP_H__
+#define __VDP_H__
+
+/* Game Gear CRAM holds 32 colours with 2 bytes each */
+#define CRAM_SZ 64
+
+/* NTSC timing in CPU cycles */
+#define VDP_LINE_CYCLES   228
+#define VDP_LINES         262
+#define VDP_ACTIVE_LINES  192
+#define VDP_FRAME_CYCLES  (VDP_LINE_CYCLES * VDP_LINES)
+/* Frames per second, about 59.92 */
+#define VDP_FRAME_RATE    ((double)Z80_CLOCK / VDP_FRAME_CYCLES)
+/* The frame interrupt flag is raised at the start of line 0xc1 */
+#define VDP_VBLANK_LINE   0xc1
+
+/* Status register bits */
+#define VDP_STATUS_VBLANK    0x80
+#define VDP_STATUS_OVERFLOW  0x40
+#define VDP_STATUS_COLLISION 0x20
+
+/* Access codes set by the second control byte */
+#define VDP_CODE_VRAM_READ  0
+#define VDP_CODE_VRAM_WRITE 1
+#define VDP_CODE_REG_WRITE  2
+#define VDP_CODE_CRAM_WRITE 3
+
+struct vdp_state {
+  uint8_t regs[16];
+  uint8_t cram[CRAM_SZ];
+  uint16_t addr;        /* 14 bit VRAM/CRAM address */
+  uint8_t code;         /* Access code, VDP_CODE_* */
+  uint8_t latch;        /* First byte of a control word */
+  uint8_t latch_full;   /* Set if the first control byte was written */
+  uint8_t read_buffer;  /* Prefetched byte for data port reads */
+  uint8_t cram_latch;   /* Low byte of a pending CRAM write */
+  uint8_t status;
+  uint8_t line_irq;     /* Line interrupt pending */
+  uint8_t line_reload;  /* R10 latched for the line counter */
+  uint8_t vscroll;      /* R9 latched at the start of the frame */
+  uint64_t frame_start; /* CPU cycle the current frame started on */
+  uint32_t frame;       /* Number of completed frames */
+};
+
+void vdp_init(void);
+uint16_t vdp_current_line(void);
+uint16_t vdp_current_dot(void);
+uint64_t vdp_next_line(void);
+uint64_t vdp_vcounter_reached(uint8_t value);
+void vdp_update_irq(void);
+
+uint8_t vdp_data_read(uint8_t port);
+void vdp_data_write(uint8_t port, uint8_t value);
+uint8_t vdp_control_read(uint8_t port);
+void vdp_control_write(uint8_t port, uint8_t value);
+uint8_t vdp_vcounter_read(uint8_t port);
+uint8_t vdp_hcounter_read(uint8_t port);
+
+#endif /*__VDP_H__*/
@@ -23,9 +23,52 @@
 
 #define RAM_SZ  8192
 #define VRAM_SZ 16384
+#define ROM_SZ  (512 * 1024)
 
-void z80_init(const char* rom_path);
+/* Size of a bank selected by the Sega mapper */
+#define ROM_BANK_SZ 16384
+
+/* NTSC Game Gear CPU clock in Hz */
+#define Z80_CLOCK 3579545
+
+/***
+* Struct which holds the Z80's processor state
+*/
+struct z80_vCPU {
+  uint8_t gp[12]; /* General Purpose Registers */
+  uint8_t acc;  /* Accumulator */
+  uint8_t flags;  /* Flags register */
+  uint8_t acc_;   /* A' */
+  uint8_t flags_; /* F' */
+  uint8_t r;    /* Memory Refresh */
+  uint8_t i;    /* Interrupt Vector */
+  uint16_t ix;  /* Index Register */
+  uint16_t iy;  /* Index Register */
+  uint16_t sp;  /* Stack Pointer */
+  uint16_t pc;  /* Program Counter */
+  uint8_t iff1;   /*Interrupt Enable/Disable Flip-Flop I*/
+  uint8_t iff2;   /*Interrupt Enable/Disable Flip-Flop II*/
+  uint8_t im;     /* Interrupt Mode 0, 1 or 2 */
+};
+
+struct z80_state {
+  struct z80_vCPU vcpu;
+  uint8_t mapper[4]; /* Sega mapper registers 0xfffc - 0xffff */
+  uint64_t cycles;  /* T-states since reset */
+  uint8_t halted;   /* Set by HALT until the next interrupt */
+  uint8_t irq_line; /* Level of the maskable interrupt line */
+  uint8_t nmi_pending;
+  uint8_t ei_delay; /* EI takes effect after the next instruction */
+  uint64_t idle_cycles; /* Cycles skipped in HALT and idle loops */
+};
+
+void z80_init(void);
 void z80_emulate_cycle(void);
+void z80_run(uint64_t until);
+int z80_run_to(uint64_t until, uint16_t pc);
+void z80_run_frame(void);
+void z80_set_irq(uint8_t level);
+void z80_nmi(void);
 
 void z80_update_flags(uint8_t value, uint8_t mask);
 
@@ -37,6 +80,8 @@ int z80_ram_valid(uint16_t);
 uint8_t z80_get_t_reg(uint8_t);
 uint8_t z80_get_s_reg(uint8_t);
 uint8_t z80_fetch_instruction(void);
+uint8_t z80_read_byte(uint16_t);
+void z80_write_byte(uint16_t, uint8_t);
 void z80_decode_insn(void);
 
 void z80_swap_reg(uint8_t*, uint8_t*);
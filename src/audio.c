@@ -0,0 +1,174 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "audio.h"
+#include "psg.h"
+
+/***
+ * Samples go from the emulation to the audio callback through a single
+ * producer, single consumer ring of stereo frames packed into 32 bits.
+ * Each side only ever writes its own index, so neither takes a lock and
+ * the emulation never waits for the device.
+ */
+static struct {
+  uint32_t frames[AUDIO_RING];
+  SDL_atomic_t write;   /* Frames pushed so far, wraps */
+  SDL_atomic_t read;    /* Frames played so far, wraps */
+  SDL_atomic_t underruns;
+  uint32_t overruns;
+  uint32_t last;        /* Frame repeated while the ring is empty */
+  SDL_AudioDeviceID device;
+  uint32_t rate;
+  uint16_t device_frames;
+  uint32_t target;      /* Fill level the rate control aims for */
+  double fill;          /* Fill level, smoothed over frames */
+  double drift;         /* Integral part of the rate control */
+  double ratio;
+  uint8_t playing;
+} audio_state;
+
+/* Audio thread: take what the ring has, hold the last frame if it runs dry
+ * so an underrun is a gap and not a click */
+static void audio_callback(void* data, Uint8* stream, int len) {
+  uint32_t* out = (uint32_t*)stream;
+  uint32_t count = len / sizeof(uint32_t), i;
+  uint32_t read = SDL_AtomicGet(&audio_state.read);
+  uint32_t available = (uint32_t)SDL_AtomicGet(&audio_state.write) - read;
+  (void)data;
+
+  if (available < count)
+    SDL_AtomicAdd(&audio_state.underruns, 1);
+  for (i = 0; i < count && i < available; i++)
+    out[i] = audio_state.frames[(read + i) & (AUDIO_RING - 1)];
+  if (i > 0)
+    audio_state.last = out[i - 1];
+  for (; i < count; i++)
+    out[i] = audio_state.last;
+  SDL_AtomicSet(&audio_state.read, read + (available < count ? available : count));
+}
+
+/***
+ * Open the device and make the PSG produce samples at its rate. The ring
+ * is steered to hold latency_ms worth of audio on top of the device's own
+ * buffer. Returns -1 if there is no audio, pushing is harmless then.
+ */
+int audio_init(unsigned latency_ms) {
+  SDL_AudioSpec want, have;
+
+  memset(&audio_state, 0, sizeof(audio_state));
+  memset(&want, 0, sizeof(want));
+  want.freq = PSG_RATE;
+  want.format = AUDIO_S16SYS;
+  want.channels = 2;
+  want.samples = AUDIO_CALLBACK_FRAMES;
+  want.callback = audio_callback;
+
+  audio_state.device = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+      SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audio_state.device == 0) {
+    printf("%s\n", SDL_GetError());
+    return -1;
+  }
+
+  audio_state.rate = have.freq;
+  audio_state.device_frames = have.samples;
+  audio_state.target = (uint64_t)have.freq * latency_ms / 1000;
+  if (audio_state.target > AUDIO_RING / 2)
+    audio_state.target = AUDIO_RING / 2;
+  audio_state.fill = audio_state.target;
+  audio_state.ratio = 1.0;
+  psg_set_rate(have.freq);
+  /* The device starts once the ring is filled up to the target */
+  return 0;
+}
+
+/***
+ * Queue a frame's worth of samples and steer the resampling ratio. A ring
+ * fuller than the target makes the PSG produce slightly fewer samples per
+ * emulated second, an emptier one slightly more. The proportional part
+ * reacts to jitter, the integral part learns the steady drift between the
+ * emulation and the device clock, so the latency settles on the target
+ * rather than next to it. The change is at most AUDIO_MAX_ADJUST, which
+ * nobody hears.
+ */
+void audio_push(const int16_t* samples, unsigned count) {
+  uint32_t write = SDL_AtomicGet(&audio_state.write);
+  uint32_t used = write - (uint32_t)SDL_AtomicGet(&audio_state.read);
+  uint32_t i;
+  double error, adjust;
+
+  if (audio_state.device == 0)
+    return;
+
+  if (count > AUDIO_RING - used) {
+    audio_state.overruns += count - (AUDIO_RING - used);
+    count = AUDIO_RING - used;
+  }
+  for (i = 0; i < count; i++)
+    audio_state.frames[(write + i) & (AUDIO_RING - 1)] =
+        (uint16_t)samples[i * 2] | ((uint32_t)(uint16_t)samples[i * 2 + 1] << 16);
+  SDL_AtomicSet(&audio_state.write, write + count);
+  if (!audio_state.playing && used + count >= audio_state.target) {
+    audio_state.playing = 1;
+    SDL_PauseAudioDevice(audio_state.device, 0);
+  }
+
+  /* The fill level jumps by a callback at a time, only its trend counts */
+  audio_state.fill += ((double)(used + count) - audio_state.fill) / 32;
+  error = (audio_state.target - audio_state.fill) / audio_state.target;
+  audio_state.drift += error * AUDIO_DRIFT_GAIN;
+  if (audio_state.drift > AUDIO_MAX_ADJUST)
+    audio_state.drift = AUDIO_MAX_ADJUST;
+  if (audio_state.drift < -AUDIO_MAX_ADJUST)
+    audio_state.drift = -AUDIO_MAX_ADJUST;
+  adjust = error * AUDIO_MAX_ADJUST + audio_state.drift;
+  if (adjust > AUDIO_MAX_ADJUST)
+    adjust = AUDIO_MAX_ADJUST;
+  if (adjust < -AUDIO_MAX_ADJUST)
+    adjust = -AUDIO_MAX_ADJUST;
+  audio_state.ratio = 1.0 + adjust;
+  psg_set_ratio(audio_state.ratio);
+}
+
+/* Called on the emulation thread, like audio_push */
+void audio_stats(struct audio_stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (audio_state.device == 0)
+    return;
+  stats->latency_ms = 1000.0 * (audio_state.fill + audio_state.device_frames) /
+      audio_state.rate;
+  stats->target_ms = 1000.0 * (audio_state.target + audio_state.device_frames) /
+      audio_state.rate;
+  stats->ratio = audio_state.ratio;
+  stats->underruns = SDL_AtomicGet(&audio_state.underruns);
+  stats->overruns = audio_state.overruns;
+}
+
+void audio_destroy(void) {
+  if (audio_state.device != 0)
+    SDL_CloseAudioDevice(audio_state.device);
+  audio_state.device = 0;
+}
@@ -0,0 +1,565 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "batch.h"
+#include "machine.h"
+#include "rom_cache.h"
+#include "state.h"
+
+/***
+ * Batch runner: every job is a machine of its own, run headless without
+ * sound and drawing only the frames an output needs. Each worker owns a
+ * deque of jobs. It takes the newest from the bottom of its own, runs it
+ * for a slice of whole frames and puts it back, so a machine stays on
+ * one core while the worker has nothing else to do. A worker that runs
+ * out steals the oldest job from the top of another, which spreads long
+ * jobs across the cores a slice at a time.
+ *
+ * Jobs that reset to a boot point share the snapshot: the first job to
+ * need it runs its machine there and every later reset of any job with
+ * the same ROM and boot point is a save state load. Jobs that need it
+ * while it is taken wait for that one snapshot only.
+ */
+
+struct batch_boot {
+  uint32_t rom_hash;
+  uint32_t frames;
+  int32_t pc;
+  uint8_t* state;   /* NULL if the boot PC was never reached */
+  int taken;        /* The state is final, until then it is being taken */
+  SDL_cond* ready;  /* Signalled with boot_lock when it is */
+  struct batch_boot* next;
+};
+
+struct batch_worker {
+  SDL_mutex* lock;
+  struct batch_job** deque;   /* Ring, big enough for every job */
+  unsigned head;
+  unsigned count;
+  unsigned capacity;
+  SDL_Thread* thread;
+  unsigned index;
+
+  uint64_t frames;
+  uint64_t slices;
+  uint64_t steals;
+  uint64_t busy_ticks;
+  uint64_t resets;
+  uint64_t reset_ticks;
+  uint64_t boots;
+  uint64_t boot_ticks;
+};
+
+static struct {
+  struct batch_worker workers[BATCH_MAX_WORKERS];
+  unsigned count;
+  SDL_atomic_t remaining;   /* Jobs not finished yet */
+  /* Boot snapshots, the list and their taken flags are guarded by the
+   * lock; a snapshot is taken without holding it */
+  SDL_mutex* boot_lock;
+  struct batch_boot* boots;
+} batch_pool;
+
+static void batch_push(struct batch_worker* worker, struct batch_job* job) {
+  SDL_LockMutex(worker->lock);
+  worker->deque[(worker->head + worker->count++) % worker->capacity] = job;
+  SDL_UnlockMutex(worker->lock);
+}
+
+/* Newest job of the worker's own deque */
+static struct batch_job* batch_pop(struct batch_worker* worker) {
+  struct batch_job* job = NULL;
+
+  SDL_LockMutex(worker->lock);
+  if (worker->count > 0)
+    job = worker->deque[(worker->head + --worker->count) % worker->capacity];
+  SDL_UnlockMutex(worker->lock);
+  return job;
+}
+
+/* Oldest job of another worker's deque */
+static struct batch_job* batch_steal(struct batch_worker* victim) {
+  struct batch_job* job = NULL;
+
+  SDL_LockMutex(victim->lock);
+  if (victim->count > 0) {
+    job = victim->deque[victim->head];
+    victim->head = (victim->head + 1) % victim->capacity;
+    victim->count--;
+  }
+  SDL_UnlockMutex(victim->lock);
+  return job;
+}
+
+static char* batch_read_file(const char* path, uint32_t* size) {
+  FILE* file = fopen(path, "rb");
+  char* data;
+  long length;
+
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = malloc(length > 0 ? length : 1);
+  if (data == NULL || fread(data, 1, length, file) != (size_t)length) {
+    printf("Could not read %s\n", path);
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  *size = length;
+  return data;
+}
+
+/* The last frame in Game Gear colours, as a binary PPM */
+static int batch_write_ppm(const char* path) {
+  FILE* file;
+  uint16_t color;
+  uint8_t rgb[3];
+  int x, y;
+
+  if (machine->render.cache == NULL) {
+    printf("No frame was drawn for %s\n", path);
+    return -1;
+  }
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", GG_WIDTH, GG_HEIGHT);
+  for (y = 0; y < GG_HEIGHT; y++) {
+    for (x = 0; x < GG_WIDTH; x++) {
+      color = machine->render.cache->framebuffer[y][x];
+      rgb[0] = (color & 0x00f) * 17;
+      rgb[1] = ((color >> 4) & 0x0f) * 17;
+      rgb[2] = ((color >> 8) & 0x0f) * 17;
+      fwrite(rgb, 1, sizeof(rgb), file);
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/* Write what the job asked for and let go of its machine */
+static void batch_finish(struct batch_job* job) {
+  uint8_t* state;
+  uint32_t hash = 2166136261u;
+  size_t i, size;
+
+  if (job->want_hash) {
+    state = calloc(1, STATE_SIZE);
+    if (state == NULL) {
+      printf("Could not allocate a state for %s\n", job->rom);
+      job->failed = 1;
+    } else {
+      size = state_save(state, STATE_SIZE);
+      for (i = 0; i < size; i++)
+        hash = (hash ^ state[i]) * 16777619u;
+      job->hash = hash;
+      free(state);
+    }
+  }
+  if (job->state_path != NULL && state_save_file(job->state_path) != 0)
+    job->failed = 1;
+  if (job->ppm_path != NULL && batch_write_ppm(job->ppm_path) != 0)
+    job->failed = 1;
+  gg_machine_destroy(job->machine);
+  job->machine = NULL;
+}
+
+/***
+ * Snapshot of the job's boot point, taken on the job's machine if no job
+ * took it yet. NULL if the boot PC is never reached.
+ */
+static const uint8_t* batch_boot(struct batch_worker* self, struct batch_job* job) {
+  struct batch_boot* boot;
+  uint64_t start;
+
+  SDL_LockMutex(batch_pool.boot_lock);
+  for (boot = batch_pool.boots; boot != NULL; boot = boot->next)
+    if (boot->rom_hash == machine->rom_hash && boot->frames == job->boot_frames &&
+        boot->pc == job->boot_pc)
+      break;
+  if (boot != NULL) {
+    while (!boot->taken)
+      SDL_CondWait(boot->ready, batch_pool.boot_lock);
+    SDL_UnlockMutex(batch_pool.boot_lock);
+    return boot->state;
+  }
+
+  boot = calloc(1, sizeof(*boot));
+  if (boot != NULL) {
+    boot->state = malloc(STATE_SIZE);
+    boot->ready = SDL_CreateCond();
+  }
+  if (boot == NULL || boot->state == NULL || boot->ready == NULL) {
+    printf("Could not allocate a boot snapshot\n");
+    if (boot != NULL) {
+      free(boot->state);
+      if (boot->ready != NULL)
+        SDL_DestroyCond(boot->ready);
+    }
+    free(boot);
+    SDL_UnlockMutex(batch_pool.boot_lock);
+    return NULL;
+  }
+  boot->rom_hash = machine->rom_hash;
+  boot->frames = job->boot_frames;
+  boot->pc = job->boot_pc;
+  boot->next = batch_pool.boots;
+  batch_pool.boots = boot;
+  SDL_UnlockMutex(batch_pool.boot_lock);
+
+  start = SDL_GetPerformanceCounter();
+  if (gg_machine_run_boot(job->machine, job->boot_frames, job->boot_pc, boot->state,
+      STATE_SIZE) == 0) {
+    printf("%s never reached PC 0x%04x in %u frames\n", job->rom, job->boot_pc,
+        job->boot_frames);
+    free(boot->state);
+    boot->state = NULL;
+  }
+  self->boot_ticks += SDL_GetPerformanceCounter() - start;
+  self->boots++;
+
+  SDL_LockMutex(batch_pool.boot_lock);
+  boot->taken = 1;
+  SDL_CondBroadcast(boot->ready);
+  SDL_UnlockMutex(batch_pool.boot_lock);
+  return boot->state;
+}
+
+/* Start the next episode of the job */
+static void batch_reset(struct batch_worker* self, struct batch_job* job) {
+  uint64_t start = SDL_GetPerformanceCounter();
+
+  if (gg_machine_reset(job->machine) != 0)
+    job->failed = 1;
+  self->reset_ticks += SDL_GetPerformanceCounter() - start;
+  self->resets++;
+}
+
+/* Run a slice of the job, returns the frames run */
+static uint32_t batch_slice(struct batch_worker* self, struct batch_job* job) {
+  uint32_t total = job->frames * job->episodes;
+  uint32_t count = total - job->done;
+  uint32_t i, frame;
+
+  if (job->machine == NULL) {
+    job->machine = gg_machine_create(job->rom);
+    if (job->machine == NULL) {
+      job->failed = 1;
+      job->done = total;
+      return 0;
+    }
+    machine->psg.silent = 1;
+    render_set_silent(1);
+    if (job->boot_frames > 0) {
+      gg_machine_set_boot(job->machine, batch_boot(self, job));
+      if (job->machine->boot == NULL) {
+        job->failed = 1;
+        job->done = total;
+        return 0;
+      }
+      batch_reset(self, job);
+    }
+  }
+  gg_machine_select(job->machine);
+
+  if (count > BATCH_SLICE)
+    count = BATCH_SLICE;
+  for (i = 0; i < count; i++, job->done++) {
+    frame = job->done % job->frames;
+    if (frame == 0 && job->done > 0)
+      batch_reset(self, job);
+    if (job->buttons_count > 0)
+      io_set_buttons(job->buttons[frame < job->buttons_count ?
+          frame : job->buttons_count - 1]);
+    /* Only the frame written out is drawn */
+    if (job->ppm_path != NULL && job->done == total - 1)
+      render_set_silent(0);
+    z80_run_frame();
+  }
+  /* Nothing listens to the sound, keep its clock from running away */
+  psg_reset_output();
+  return count;
+}
+
+static int batch_worker(void* data) {
+  struct batch_worker* self = data;
+  struct batch_job* job;
+  uint64_t start;
+  unsigned i;
+
+  while (SDL_AtomicGet(&batch_pool.remaining) > 0) {
+    job = batch_pop(self);
+    for (i = 1; job == NULL && i < batch_pool.count; i++) {
+      job = batch_steal(&batch_pool.workers[(self->index + i) % batch_pool.count]);
+      if (job != NULL)
+        self->steals++;
+    }
+    /* Everything left is running on other workers */
+    if (job == NULL) {
+      SDL_Delay(1);
+      continue;
+    }
+
+    start = SDL_GetPerformanceCounter();
+    self->frames += batch_slice(self, job);
+    self->slices++;
+    if (job->done < job->frames * job->episodes) {
+      batch_push(self, job);
+    } else {
+      if (!job->failed)
+        batch_finish(job);
+      /* A job that failed on the way still has its machine */
+      gg_machine_destroy(job->machine);
+      job->machine = NULL;
+      SDL_AtomicAdd(&batch_pool.remaining, -1);
+    }
+    self->busy_ticks += SDL_GetPerformanceCounter() - start;
+  }
+  gg_machine_select(NULL);
+  return 0;
+}
+
+/* Parse "rom=<file> frames=<n> [episodes=<n>] [boot=<frames>|boot=@<pc>]
+ * [movie=<file>] [hash] [state=<file>] [ppm=<file>]", returns -1 if the
+ * line is not a job */
+static int batch_parse_job(char* line, struct batch_job* job) {
+  char* save = NULL;
+  char* token;
+
+  memset(job, 0, sizeof(*job));
+  job->episodes = 1;
+  job->boot_pc = -1;
+  for (token = strtok_r(line, " \t\r\n", &save); token != NULL;
+      token = strtok_r(NULL, " \t\r\n", &save)) {
+    if (!strncmp(token, "rom=", 4))
+      job->rom = strdup(token + 4);
+    else if (!strncmp(token, "frames=", 7))
+      job->frames = strtoul(token + 7, NULL, 0);
+    else if (!strncmp(token, "episodes=", 9))
+      job->episodes = strtoul(token + 9, NULL, 0);
+    else if (!strncmp(token, "boot=@", 6)) {
+      job->boot_pc = strtoul(token + 6, NULL, 16) & 0xffff;
+      job->boot_frames = BATCH_BOOT_LIMIT;
+    } else if (!strncmp(token, "boot=", 5))
+      job->boot_frames = strtoul(token + 5, NULL, 0);
+    else if (!strncmp(token, "movie=", 6))
+      job->movie = strdup(token + 6);
+    else if (!strncmp(token, "state=", 6))
+      job->state_path = strdup(token + 6);
+    else if (!strncmp(token, "ppm=", 4))
+      job->ppm_path = strdup(token + 4);
+    else if (!strcmp(token, "hash"))
+      job->want_hash = 1;
+    else
+      return -1;
+  }
+  return job->rom != NULL && job->frames > 0 && job->episodes > 0 ? 0 : -1;
+}
+
+/* Free the jobs and what their lines named */
+static void batch_free_jobs(struct batch_job* jobs, unsigned count) {
+  unsigned i;
+
+  for (i = 0; i < count; i++) {
+    free(jobs[i].rom);
+    free(jobs[i].movie);
+    free(jobs[i].state_path);
+    free(jobs[i].ppm_path);
+    free(jobs[i].buttons);
+  }
+  free(jobs);
+}
+
+static struct batch_job* batch_load(const char* path, unsigned* count) {
+  struct batch_job* jobs = NULL;
+  struct batch_job* more;
+  unsigned size = 0, line_number = 0;
+  char line[4096];
+  char* comment;
+  FILE* file = fopen(path, "r");
+
+  *count = 0;
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return NULL;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+    if (strspn(line, " \t\r\n") == strlen(line))
+      continue;
+    if (*count == size) {
+      size = size ? size * 2 : 64;
+      more = realloc(jobs, size * sizeof(*jobs));
+      if (more == NULL) {
+        printf("Could not allocate %u jobs\n", size);
+        fclose(file);
+        batch_free_jobs(jobs, *count);
+        return NULL;
+      }
+      jobs = more;
+    }
+    /* A job that fails to load is freed along with the ones before */
+    if (batch_parse_job(line, &jobs[*count]) != 0) {
+      printf("%s:%u: want rom=<file> frames=<n> [episodes=<n>] "
+          "[boot=<frames>|boot=@<pc>] [movie=<file>] [hash] [state=<file>] "
+          "[ppm=<file>]\n", path, line_number);
+      fclose(file);
+      batch_free_jobs(jobs, *count + 1);
+      return NULL;
+    }
+    if (jobs[*count].movie != NULL) {
+      jobs[*count].buttons = (uint8_t*)batch_read_file(jobs[*count].movie,
+          &jobs[*count].buttons_count);
+      if (jobs[*count].buttons == NULL) {
+        fclose(file);
+        batch_free_jobs(jobs, *count + 1);
+        return NULL;
+      }
+    }
+    (*count)++;
+  }
+  fclose(file);
+  return jobs;
+}
+
+/***
+ * Run every job in the file on a pool of workers, one per core unless
+ * given, and report the throughput. Returns -1 if the file could not be
+ * read or a job failed.
+ */
+int batch_run(const char* path, unsigned workers) {
+  struct batch_job* jobs;
+  struct batch_worker* worker;
+  struct rom_cache_stats roms;
+  struct batch_boot* boot;
+  unsigned count, i;
+  uint64_t start, ticks, frames = 0;
+  uint64_t resets = 0, reset_ticks = 0, boots = 0, boot_ticks = 0;
+  double frequency = SDL_GetPerformanceFrequency();
+  double seconds;
+  int failed = 0;
+
+  jobs = batch_load(path, &count);
+  if (jobs == NULL)
+    return -1;
+  if (workers == 0)
+    workers = SDL_GetCPUCount();
+  if (workers > BATCH_MAX_WORKERS)
+    workers = BATCH_MAX_WORKERS;
+
+  memset(&batch_pool, 0, sizeof(batch_pool));
+  batch_pool.count = workers;
+  batch_pool.boot_lock = SDL_CreateMutex();
+  SDL_AtomicSet(&batch_pool.remaining, count);
+  for (i = 0; i < workers; i++) {
+    worker = &batch_pool.workers[i];
+    worker->index = i;
+    worker->lock = SDL_CreateMutex();
+    worker->capacity = count;
+    worker->deque = calloc(count, sizeof(*worker->deque));
+    if (worker->deque == NULL) {
+      printf("Could not allocate the queue of worker %u\n", i);
+      SDL_DestroyMutex(worker->lock);
+      while (i-- > 0) {
+        SDL_DestroyMutex(batch_pool.workers[i].lock);
+        free(batch_pool.workers[i].deque);
+      }
+      SDL_DestroyMutex(batch_pool.boot_lock);
+      batch_free_jobs(jobs, count);
+      return -1;
+    }
+  }
+  /* Deal the jobs round robin, stealing evens out the rest */
+  for (i = 0; i < count; i++)
+    batch_push(&batch_pool.workers[i % workers], &jobs[i]);
+
+  start = SDL_GetPerformanceCounter();
+  for (i = 0; i < workers; i++)
+    batch_pool.workers[i].thread = SDL_CreateThread(batch_worker, "batch",
+        &batch_pool.workers[i]);
+  for (i = 0; i < workers; i++)
+    SDL_WaitThread(batch_pool.workers[i].thread, NULL);
+  ticks = SDL_GetPerformanceCounter() - start;
+  seconds = ticks / frequency;
+
+  for (i = 0; i < count; i++) {
+    if (jobs[i].failed) {
+      printf("job %u: %s failed\n", i, jobs[i].rom);
+      failed = 1;
+    } else if (jobs[i].want_hash) {
+      printf("job %u: %s %u frames, hash %08x\n", i, jobs[i].rom,
+          jobs[i].frames * jobs[i].episodes, jobs[i].hash);
+    }
+  }
+  for (i = 0; i < workers; i++) {
+    worker = &batch_pool.workers[i];
+    frames += worker->frames;
+    printf("worker %u: %llu frames in %llu slices, %llu steals, busy %.1f%%, "
+        "%.0f frames/s\n", i, (unsigned long long)worker->frames,
+        (unsigned long long)worker->slices, (unsigned long long)worker->steals,
+        100.0 * worker->busy_ticks / ticks,
+        worker->busy_ticks ? worker->frames * frequency / worker->busy_ticks : 0);
+    resets += worker->resets;
+    reset_ticks += worker->reset_ticks;
+    boots += worker->boots;
+    boot_ticks += worker->boot_ticks;
+    SDL_DestroyMutex(worker->lock);
+    free(worker->deque);
+  }
+  printf("%u jobs, %llu frames in %.2f s on %u workers: %.0f frames/s, "
+      "%.0f frames/s per core\n", count, (unsigned long long)frames, seconds, workers,
+      frames / seconds, frames / seconds / workers);
+  if (resets > 0)
+    printf("%llu resets, %.1f us each; %llu boot snapshots, %.1f ms each\n",
+        (unsigned long long)resets, reset_ticks * 1e6 / frequency / resets,
+        (unsigned long long)boots, boots ? boot_ticks * 1e3 / frequency / boots : 0);
+  rom_cache_stats(&roms);
+  printf("%u ROMs loaded, %u files read, %u shared an image already loaded\n",
+      roms.loads, roms.reads, roms.hits);
+
+  while (batch_pool.boots != NULL) {
+    boot = batch_pool.boots;
+    batch_pool.boots = boot->next;
+    SDL_DestroyCond(boot->ready);
+    free(boot->state);
+    free(boot);
+  }
+  SDL_DestroyMutex(batch_pool.boot_lock);
+  batch_free_jobs(jobs, count);
+  return failed ? -1 : 0;
+}
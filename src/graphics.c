@@ -21,34 +21,414 @@
 #include <SDL2/SDL.h>
 
 #include "../include/graphics.h"
+#include "../include/vdp.h"
+#include "../include/render.h"
+#include "../include/scale.h"
+#include "../include/machine.h"
 
 SDL_Window *G_window = NULL;
 SDL_Renderer *G_renderer = NULL;
+SDL_Texture *G_texture = NULL;
+
+/* Pixel format of the texture and every 12 bit Game Gear colour in that
+ * format */
+static uint32_t G_format = SDL_PIXELFORMAT_ARGB8888;
+static uint32_t G_lut[4096];
+
+/* Upscaling filter run on the render thread before the upload, none lets
+ * the renderer scale the frame on its own */
+static const struct scale_filter* G_filter = NULL;
+/* Threads a frame is filtered on. bench/scale_bench has every filter get
+ * slower with more threads, a 160x144 frame is too small to split */
+#define G_FILTER_THREADS 1
+
+/***
+ * SDL wants the window, the renderer and everything drawn with it on the
+ * thread that created the window, which has to be the main thread on
+ * macOS. So the main thread uploads and presents, and the render thread
+ * only does the work in between: it converts the frames to the texture's
+ * format and filters them.
+ *
+ * Frames go both ways through a triple buffer. The filling side fills
+ * the back slot and swaps it with the ready slot, the taking side swaps
+ * its front slot with the ready slot if that holds a frame it has not
+ * seen. Neither side ever waits for the other. If the last frame was not
+ * taken yet, its changed rows go out with the next one.
+ */
+#define SLOT_FRESH 4
+
+struct gg_frame {
+    uint16_t pixels[GG_HEIGHT][GG_WIDTH];
+    /* Rows that differ from the last frame the render thread took */
+    uint16_t top;
+    uint16_t bottom;
+};
+
+/* A converted frame, only the changed rows [top, bottom) are valid */
+struct gg_upload {
+    uint8_t* pixels;
+    uint16_t top;
+    uint16_t bottom;
+};
+
+static struct gg_frame G_frames[3];
+static SDL_atomic_t G_ready;
+static int G_back = 0;
+static int G_front = 1;
+/* Rows changed since the render thread last took a frame */
+static uint16_t G_pending_top = 0;
+static uint16_t G_pending_bottom = GG_HEIGHT;
+
+static struct gg_upload G_uploads[3];
+static SDL_atomic_t G_converted;
+static int G_upload_back = 0;
+static int G_upload_front = 1;
+static uint16_t G_upload_top;
+static uint16_t G_upload_bottom;
+/* Texture rows and bytes per row. The render thread keeps the whole
+ * converted picture, filters only redo the rows around the changed ones */
+static uint16_t G_rows;
+static int G_pitch;
+static uint8_t* G_image = NULL;
+
+static SDL_Thread *G_thread = NULL;
+/* Posted for every frame handed over and to quit */
+static SDL_sem *G_work = NULL;
+static SDL_atomic_t G_quit;
+/* Set if the window needs the last frame again */
+static SDL_atomic_t G_expose;
+
+static SDL_atomic_t G_presented;
+static SDL_atomic_t G_dropped;
+static SDL_atomic_t G_duplicated;
+static SDL_atomic_t G_filtered;
+static SDL_atomic_t G_filter_us;
+
+/* Use the window's format if we can convert to it, so the renderer does
+ * not have to */
+static uint32_t gg_graphics_format() {
+    uint32_t format = SDL_GetWindowPixelFormat(G_window);
+
+    switch (format) {
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+    case SDL_PIXELFORMAT_RGB565:
+        return format;
+    default:
+        return SDL_PIXELFORMAT_ARGB8888;
+    }
+}
+
+/* Game Gear colours are 12 bit: GGGGRRRR in the even and ----BBBB in the
+ * odd CRAM byte, the table is indexed with BBBBGGGGRRRR */
+static void gg_graphics_build_lut() {
+    uint16_t color;
+    uint8_t r, g, b;
+
+    for (color = 0; color < 4096; color++) {
+        r = color & 0x0f;
+        g = (color >> 4) & 0x0f;
+        b = color >> 8;
+        if (G_format == SDL_PIXELFORMAT_RGB565)
+            G_lut[color] = ((r << 12) | ((r >> 3) << 11)) | (g << 7) | ((g >> 2) << 5) |
+                (b << 1) | (b >> 3);
+        else
+            G_lut[color] = 0xff000000 | (r * 0x11 << 16) | (g * 0x11 << 8) | (b * 0x11);
+    }
+}
+
+/* Convert the changed rows of Game Gear colours into the picture */
+static void gg_graphics_convert(const struct gg_frame* frame, uint16_t* top,
+        uint16_t* bottom) {
+    uint8_t* pixels = G_image + frame->top * G_pitch;
+    uint16_t x, y;
+    const uint16_t* in;
+    uint16_t* out16;
+    uint32_t* out32;
+
+    for (y = frame->top; y < frame->bottom; y++, pixels += G_pitch) {
+        in = frame->pixels[y];
+        if (G_format == SDL_PIXELFORMAT_RGB565) {
+            out16 = (uint16_t*)pixels;
+            for (x = 0; x < GG_WIDTH; x++)
+                out16[x] = G_lut[in[x]];
+        } else {
+            out32 = (uint32_t*)pixels;
+            for (x = 0; x < GG_WIDTH; x++)
+                out32[x] = G_lut[in[x]];
+        }
+    }
+    *top = frame->top;
+    *bottom = frame->bottom;
+}
+
+/* Convert the changed rows into the filter's source, then filter them
+ * and the rows next to them into the picture */
+static void gg_graphics_filter(const struct gg_frame* frame, uint16_t* top_row,
+        uint16_t* bottom_row) {
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint16_t top = frame->top, bottom = frame->bottom, x, y;
+    uint8_t factor = G_filter->factor;
+    const uint16_t* in;
+    uint32_t* out;
+
+    for (y = top; y < bottom; y++) {
+        in = frame->pixels[y];
+        out = scale_source(y);
+        for (x = 0; x < GG_WIDTH; x++)
+            out[x] = G_lut[in[x]];
+    }
+    scale_update(top, bottom);
+    scale_span(&top, &bottom);
+    scale_frame(G_filter, G_image + top * factor * G_pitch, G_pitch, top, bottom);
+    *top_row = top * factor;
+    *bottom_row = bottom * factor;
+
+    SDL_AtomicAdd(&G_filtered, 1);
+    SDL_AtomicAdd(&G_filter_us, (SDL_GetPerformanceCounter() - start) * 1000000 /
+            SDL_GetPerformanceFrequency());
+}
+
+/* Hand the changed texture rows of the picture to the main thread */
+static void gg_graphics_hand_over(uint16_t top, uint16_t bottom) {
+    struct gg_upload* upload = &G_uploads[G_upload_back];
+    int old;
+
+    /* The main thread did not take the last one yet, its rows go too */
+    if (SDL_AtomicGet(&G_converted) & SLOT_FRESH) {
+        if (G_upload_top < top)
+            top = G_upload_top;
+        if (G_upload_bottom > bottom)
+            bottom = G_upload_bottom;
+    }
+    memcpy(upload->pixels + top * G_pitch, G_image + top * G_pitch,
+            (bottom - top) * G_pitch);
+    upload->top = top;
+    upload->bottom = bottom;
+    G_upload_top = top;
+    G_upload_bottom = bottom;
+
+    old = SDL_AtomicSet(&G_converted, G_upload_back | SLOT_FRESH);
+    G_upload_back = old & ~SLOT_FRESH;
+}
+
+/***
+ * Render thread: takes the newest frame the emulation handed over and
+ * converts, and filters if asked to, the rows that changed.
+ */
+static int gg_graphics_thread(void* data) {
+    struct gg_frame* frame;
+    uint16_t top, bottom;
+    int ready;
+    (void)data;
+
+    for (;;) {
+        SDL_SemWait(G_work);
+        if (SDL_AtomicGet(&G_quit))
+            break;
+        if (!(SDL_AtomicGet(&G_ready) & SLOT_FRESH))
+            continue;
+        ready = SDL_AtomicSet(&G_ready, G_front);
+        G_front = ready & ~SLOT_FRESH;
+        frame = &G_frames[G_front];
+        if (frame->top >= frame->bottom)
+            continue;
+
+        if (G_filter != NULL)
+            gg_graphics_filter(frame, &top, &bottom);
+        else
+            gg_graphics_convert(frame, &top, &bottom);
+        gg_graphics_hand_over(top, bottom);
+    }
+    return 0;
+}
+
+/* Select the upscaling filter, has to be called before gg_graphics_init */
+void gg_graphics_set_filter(const struct scale_filter* filter) {
+    G_filter = filter != NULL && filter->factor > 1 ? filter : NULL;
+}
 
 void gg_graphics_init() {
+    int factor = G_filter != NULL ? G_filter->factor : 1;
+    int i;
+
     if (SDL_Init(SDL_INIT_EVERYTHING) == -1) {
         printf("%s\n", SDL_GetError());
         return;
     }
 
-    G_window = SDL_CreateWindow("SGGEmu", 100, 100, GG_WIDTH, GG_HEIGHT, SDL_WINDOW_SHOWN);
+    G_window = SDL_CreateWindow("SGGEmu", 100, 100, GG_WIDTH * GG_SCALE,
+            GG_HEIGHT * GG_SCALE, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
     if (G_window == NULL) {
         printf("%s\n", SDL_GetError());
         return;
     }
-
-    G_renderer = SDL_CreateRenderer(G_window, -1,
-            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    /* No vsync, the emulation sets the pace and must not wait for the
+     * display as well */
+    G_renderer = SDL_CreateRenderer(G_window, -1, SDL_RENDERER_ACCELERATED);
     if (G_renderer == NULL) {
         printf("%s\n", SDL_GetError());
         return;
     }
 
+    /* The renderer scales the frame to the window, keeping the aspect
+     * ratio and sharp pixels. A filtered frame is factor times larger but
+     * still maps onto the same logical size */
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+    SDL_RenderSetLogicalSize(G_renderer, GG_WIDTH, GG_HEIGHT);
+
+    /* The filters blend and compare 8 bit channels */
+    G_format = G_filter != NULL ? SDL_PIXELFORMAT_ARGB8888 : gg_graphics_format();
+    G_texture = SDL_CreateTexture(G_renderer, G_format,
+            SDL_TEXTUREACCESS_STREAMING, GG_WIDTH * factor, GG_HEIGHT * factor);
+    if (G_texture == NULL) {
+        printf("%s\n", SDL_GetError());
+        return;
+    }
+
+    G_rows = GG_HEIGHT * factor;
+    G_pitch = GG_WIDTH * factor * SDL_BYTESPERPIXEL(G_format);
+    G_image = calloc(G_rows, G_pitch);
+    for (i = 0; i < 3; i++)
+        G_uploads[i].pixels = calloc(G_rows, G_pitch);
+    if (G_image == NULL || G_uploads[0].pixels == NULL || G_uploads[1].pixels == NULL ||
+            G_uploads[2].pixels == NULL) {
+        printf("Could not allocate the frame buffers\n");
+        return;
+    }
+
+    gg_graphics_build_lut();
+    if (G_filter != NULL)
+        scale_init(G_FILTER_THREADS);
+    SDL_AtomicSet(&G_ready, 2);
+    SDL_AtomicSet(&G_converted, 2);
+    SDL_AtomicSet(&G_quit, 0);
+    G_work = SDL_CreateSemaphore(0);
+    if (G_work == NULL) {
+        printf("%s\n", SDL_GetError());
+        return;
+    }
+    G_thread = SDL_CreateThread(gg_graphics_thread, "render", NULL);
+    if (G_thread == NULL) {
+        printf("%s\n", SDL_GetError());
+        return;
+    }
+
     SDL_Delay(2000);
 }
 
+/* The window was resized or uncovered, show the last frame again */
+void gg_graphics_expose() {
+    SDL_AtomicSet(&G_expose, 1);
+}
+
+/* Upload the newest converted frame if there is one and present */
+static void gg_graphics_show(void) {
+    struct gg_upload* upload;
+    SDL_Rect rect;
+    int show = SDL_AtomicSet(&G_expose, 0);
+    int fresh = 0;
+    int ready;
+
+    if (G_texture == NULL)
+        return;
+    if (SDL_AtomicGet(&G_converted) & SLOT_FRESH) {
+        ready = SDL_AtomicSet(&G_converted, G_upload_front);
+        G_upload_front = ready & ~SLOT_FRESH;
+        upload = &G_uploads[G_upload_front];
+        rect.x = 0;
+        rect.y = upload->top;
+        rect.w = G_pitch / SDL_BYTESPERPIXEL(G_format);
+        rect.h = upload->bottom - upload->top;
+        if (SDL_UpdateTexture(G_texture, &rect, upload->pixels + upload->top * G_pitch,
+                G_pitch) < 0)
+            printf("%s\n", SDL_GetError());
+        fresh = 1;
+    }
+    if (!show && !fresh)
+        return;
+
+    SDL_RenderClear(G_renderer);
+    SDL_RenderCopy(G_renderer, G_texture, NULL, NULL);
+    SDL_RenderPresent(G_renderer);
+    SDL_AtomicAdd(&G_presented, 1);
+    if (!fresh)
+        SDL_AtomicAdd(&G_duplicated, 1);
+}
+
+/***
+ * Hand the frame the VDP finished last to the render thread, then show
+ * the newest frame it converted. An unchanged frame is handed over as
+ * well but is neither converted nor presented. Call this from the thread
+ * that called gg_graphics_init. Returns 1 if the frame changed.
+ */
+int gg_graphics_present() {
+    struct gg_frame* frame = &G_frames[G_back];
+    struct render_cache* cache = machine->render.cache;
+    uint16_t top, bottom;
+    int old;
+
+    /* Nothing was drawn yet */
+    if (cache == NULL)
+        return 0;
+    top = cache->update_top;
+    bottom = cache->update_bottom;
+
+    /* If the last frame was not taken yet its rows have to go out with
+     * this one. Racing with the render thread only makes this larger */
+    if (SDL_AtomicGet(&G_ready) & SLOT_FRESH) {
+        if (G_pending_top < top)
+            top = G_pending_top;
+        if (G_pending_bottom > bottom)
+            bottom = G_pending_bottom;
+    }
+    if (top > bottom)
+        top = bottom;
+
+    memcpy(frame->pixels, cache->framebuffer, sizeof(frame->pixels));
+    frame->top = top;
+    frame->bottom = bottom;
+    G_pending_top = top;
+    G_pending_bottom = bottom;
+
+    old = SDL_AtomicSet(&G_ready, G_back | SLOT_FRESH);
+    if (old & SLOT_FRESH)
+        SDL_AtomicAdd(&G_dropped, 1);
+    G_back = old & ~SLOT_FRESH;
+    if (G_work != NULL)
+        SDL_SemPost(G_work);
+
+    gg_graphics_show();
+    return cache->update_top < cache->update_bottom;
+}
+
+void gg_graphics_stats(struct gg_graphics_stats* stats) {
+    stats->presented = SDL_AtomicGet(&G_presented);
+    stats->dropped = SDL_AtomicGet(&G_dropped);
+    stats->duplicated = SDL_AtomicGet(&G_duplicated);
+    stats->filtered = SDL_AtomicGet(&G_filtered);
+    stats->filter_us = SDL_AtomicGet(&G_filter_us);
+}
+
 void gg_graphics_destroy() {
-    SDL_DestroyRenderer(G_renderer);
+    int i;
+
+    SDL_AtomicSet(&G_quit, 1);
+    if (G_thread != NULL) {
+        SDL_SemPost(G_work);
+        SDL_WaitThread(G_thread, NULL);
+    }
+    if (G_work != NULL)
+        SDL_DestroySemaphore(G_work);
+    if (G_filter != NULL)
+        scale_destroy();
+    for (i = 0; i < 3; i++)
+        free(G_uploads[i].pixels);
+    free(G_image);
+    if (G_texture != NULL)
+        SDL_DestroyTexture(G_texture);
+    if (G_renderer != NULL)
+        SDL_DestroyRenderer(G_renderer);
     SDL_DestroyWindow(G_window);
     SDL_Quit();
 }
@@ -0,0 +1,260 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "io.h"
+#include "z80.h"
+#include "vdp.h"
+#include "sched.h"
+#include "psg.h"
+#include "machine.h"
+
+io_read_handler io_read_map[256];
+io_write_handler io_write_map[256];
+static int io_mapped;
+
+static uint8_t io_unmapped_read(uint8_t port) {
+  (void)port;
+  return 0xff;
+}
+
+static void io_unmapped_write(uint8_t port, uint8_t value) {
+  (void)port;
+  (void)value;
+}
+
+/* Port 0x00: start button and region */
+static uint8_t io_start_read(uint8_t port) {
+  (void)port;
+  /* Bit 7 is the start button (active low), bit 6 selects export region */
+  return ((machine->io.buttons & JOY_START) ? 0x00 : 0x80) | 0x40;
+}
+
+/***
+ * Ports 0x01 - 0x05: Gear-to-Gear link. Port 0x01 reads the other
+ * machine's pins where port 0x02 makes them inputs, port 0x03 sends and
+ * port 0x04 receives serial bytes, port 0x05 is the serial status. The
+ * other machine is only heard between frames, see io_link_input().
+ */
+static uint8_t io_link_read(uint8_t port) {
+  uint8_t inputs = machine->io.link[2] & 0x7f;
+  uint8_t value = machine->io.link[port];
+
+  switch (port) {
+  case 0x01:
+    return (value & ~inputs) | (machine->io.link_pins & inputs);
+  case 0x04:
+    /* Reading takes the byte, the next one moves up */
+    if (machine->io.rx_count > 0) {
+      machine->io.link[4] = machine->io.rx[0];
+      memmove(machine->io.rx, machine->io.rx + 1, --machine->io.rx_count);
+    } else {
+      machine->io.link[5] &= ~IO_LINK_RX_READY;
+    }
+    return value;
+  default:
+    return value;
+  }
+}
+
+static void io_link_write(uint8_t port, uint8_t value) {
+  switch (port) {
+  case 0x03:
+    machine->io.link[3] = value;
+    if ((machine->io.link[5] & IO_LINK_TX_ON) && machine->io.tx_count < IO_LINK_BYTES)
+      machine->io.tx[machine->io.tx_count++] = value;
+    break;
+  case 0x04:
+    /* The receive buffer is read only */
+    break;
+  case 0x05:
+    /* The status bits are read only */
+    machine->io.link[5] = (value & 0xf8) | (machine->io.link[5] & 0x07);
+    break;
+  default:
+    machine->io.link[port] = value;
+    break;
+  }
+}
+
+/* Port 0x06: PSG stereo control */
+static void io_stereo_write(uint8_t port, uint8_t value) {
+  (void)port;
+  machine->io.stereo = value;
+  psg_stereo_write(value);
+}
+
+/* Port 0x3e: memory control */
+static void io_mem_ctrl_write(uint8_t port, uint8_t value) {
+  (void)port;
+  machine->io.mem_ctrl = value;
+}
+
+/* Port 0x3f: I/O control */
+static void io_io_ctrl_write(uint8_t port, uint8_t value) {
+  (void)port;
+  machine->io.io_ctrl = value;
+}
+
+/* Ports 0x40 - 0x7f: SN76489 */
+static void io_psg_write(uint8_t port, uint8_t value) {
+  (void)port;
+  psg_write(value);
+}
+
+static void io_nmi_event(uint64_t when) {
+  (void)when;
+  z80_nmi();
+}
+
+/* Port 0xdc: joypad, active low */
+static uint8_t io_joypad_read(uint8_t port) {
+  (void)port;
+  return ~machine->io.buttons | 0xc0;
+}
+
+/* Port 0xdd: second joypad and TH lines, not connected on the Game Gear */
+static uint8_t io_joypad2_read(uint8_t port) {
+  (void)port;
+  return 0xff;
+}
+
+/***
+ * Build the port map. The Game Gear only decodes A7, A6 and A0 for most
+ * ports, so every device is mirrored across its whole range here once and
+ * the CPU never has to decode a port number again. The map is the same
+ * for every machine and built by the first one.
+ */
+static void io_build_map(void) {
+  uint16_t port;
+
+  for (port = 0; port < 256; port++) {
+    switch (port & 0xc1) {
+    case 0x00:
+    case 0x01:
+      /* 0x00 - 0x3f: memory control on even, I/O control on odd ports */
+      io_read_map[port] = io_unmapped_read;
+      io_write_map[port] = (port & 1) ? io_io_ctrl_write : io_mem_ctrl_write;
+      break;
+    case 0x40:
+      io_read_map[port] = vdp_vcounter_read;
+      io_write_map[port] = io_psg_write;
+      break;
+    case 0x41:
+      io_read_map[port] = vdp_hcounter_read;
+      io_write_map[port] = io_psg_write;
+      break;
+    case 0x80:
+      io_read_map[port] = vdp_data_read;
+      io_write_map[port] = vdp_data_write;
+      break;
+    case 0x81:
+      io_read_map[port] = vdp_control_read;
+      io_write_map[port] = vdp_control_write;
+      break;
+    case 0xc0:
+      io_read_map[port] = io_joypad_read;
+      io_write_map[port] = io_unmapped_write;
+      break;
+    case 0xc1:
+      io_read_map[port] = io_joypad2_read;
+      io_write_map[port] = io_unmapped_write;
+      break;
+    }
+  }
+
+  /* Game Gear specific registers override the SMS compatible mirrors */
+  io_read_map[0x00] = io_start_read;
+  io_write_map[0x00] = io_unmapped_write;
+  for (port = 0x01; port <= 0x05; port++) {
+    io_read_map[port] = io_link_read;
+    io_write_map[port] = io_link_write;
+  }
+  io_read_map[0x06] = io_unmapped_read;
+  io_write_map[0x06] = io_stereo_write;
+}
+
+void io_init(void) {
+  memset(&machine->io, 0, sizeof(machine->io));
+  /* Link defaults from the Game Gear documentation */
+  machine->io.link[1] = 0x7f;
+  machine->io.link[2] = 0xff;
+  machine->io.stereo = 0xff;
+
+  if (!io_mapped) {
+    io_build_map();
+    io_mapped = 1;
+  }
+  sched_register(SCHED_NMI, io_nmi_event);
+}
+
+/***
+ * Earliest cycle at which a read from the port can return a different
+ * value while the CPU does not write anything. Inputs only change between
+ * frames and VDP flags only on scheduled events, so those are stable until
+ * the next event. Returns 0 for ports that can change at any time.
+ */
+uint64_t io_read_stable_until(uint8_t port) {
+  io_read_handler handler = io_read_map[port];
+
+  if (handler == vdp_vcounter_read)
+    return vdp_next_line();
+  if (handler == io_joypad_read || handler == io_joypad2_read ||
+      handler == io_start_read || handler == vdp_control_read)
+    return SCHED_NEVER;
+  return 0;
+}
+
+/* End of a frame: what this machine put on the link during it */
+void io_link_output(struct io_link_frame* out) {
+  uint8_t outputs = ~machine->io.link[2] & 0x7f;
+
+  memset(out, 0, sizeof(*out));
+  out->parallel = machine->io.link[1] & outputs;
+  out->count = machine->io.tx_count;
+  memcpy(out->bytes, machine->io.tx, machine->io.tx_count);
+  machine->io.tx_count = 0;
+}
+
+/* Start of a frame: what the other machine put on the link during an
+ * earlier one. Bytes that do not fit in the receive queue are lost, as they would
+ * be overrun on the real link */
+void io_link_input(const struct io_link_frame* in) {
+  uint8_t i;
+
+  machine->io.link_pins = in->parallel;
+  for (i = 0; i < in->count && machine->io.rx_count < IO_LINK_BYTES; i++)
+    machine->io.rx[machine->io.rx_count++] = in->bytes[i];
+  if (!(machine->io.link[5] & IO_LINK_RX_READY) && machine->io.rx_count > 0) {
+    machine->io.link[4] = machine->io.rx[0];
+    memmove(machine->io.rx, machine->io.rx + 1, --machine->io.rx_count);
+    machine->io.link[5] |= IO_LINK_RX_READY;
+  }
+}
+
+void io_set_buttons(uint8_t buttons) {
+  /* In SMS mode pressing start raises an NMI like the pause button */
+  if (machine->io.sms_mode && (buttons & ~machine->io.buttons & JOY_START))
+    sched_add(SCHED_NMI, machine->z80.cycles);
+  machine->io.buttons = buttons;
+}
@@ -59,6 +59,17 @@ static void rom_size(uint8_t index) {
   printf("ROM Size:\t%s\n", rs);
 }
 
+/* Region code from the cartridge header, 0 if there is no header */
+uint8_t loader_rom_region(const uint8_t* rom_buffer) {
+  uint16_t i;
+
+  for(i = 0; i < sizeof(HEADER_LOC) / sizeof(HEADER_LOC[0]); i++) {
+    if(strncmp((const char *)SEGA_STRING, (const char *)&rom_buffer[HEADER_LOC[i]], sizeof(SEGA_STRING) - 1) == 0)
+      return (rom_buffer[HEADER_LOC[i] + 15] & 0xf0) >> 4;
+  }
+  return 0;
+}
+
 uint8_t* loader_load_rom(const char* path, uint8_t* rom_buffer) {
   size_t blocks = 0;
   uint16_t i;
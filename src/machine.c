@@ -0,0 +1,199 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "machine.h"
+#include "rom_cache.h"
+#include "state.h"
+
+__thread struct gg_machine* machine;
+
+/* The tables all machines share are built by the first one created */
+static SDL_SpinLock machine_create_lock;
+
+/***
+ * Power the machine up from scratch. The ROM stays, and so does how it
+ * is drawn and whether it makes a sound. Returns -1 if there is no
+ * memory for RAM and VRAM.
+ */
+static int gg_machine_power_on(struct gg_machine* m) {
+  const struct render_backend* backend = m->render.backend;
+  int pipelined = m->render.pipe != NULL;
+  int silent = m->render.silent;
+  int psg_silent = m->psg.silent;
+
+  if (page_alloc(&m->pages) != 0)
+    return -1;
+  gg_machine_select(m);
+  render_set_pipelined(0);
+  memset(&m->z80, 0, sizeof(m->z80));
+  memset(&m->vdp, 0, sizeof(m->vdp));
+  memset(&m->io, 0, sizeof(m->io));
+  memset(&m->sched, 0, sizeof(m->sched));
+  memset(&m->psg, 0, sizeof(m->psg));
+  SDL_AtomicLock(&machine_create_lock);
+  z80_init();
+  SDL_AtomicUnlock(&machine_create_lock);
+
+  if (backend != NULL)
+    m->render.backend = backend;
+  m->render.silent = silent;
+  m->psg.silent = psg_silent;
+  render_set_pipelined(pipelined);
+  return 0;
+}
+
+/***
+ * Power up a Game Gear with the given cartridge and make it the calling
+ * thread's machine. Any thread can create machines, also while others
+ * run theirs.
+ */
+struct gg_machine* gg_machine_create(const char* rom_path) {
+  struct gg_machine* m = calloc(1, sizeof(*m));
+
+  if (m != NULL)
+    m->rom = rom_cache_get(rom_path, &m->rom_hash);
+  if (m == NULL || m->rom == NULL) {
+    printf("Could not allocate a machine\n");
+    free(m);
+    return NULL;
+  }
+
+  if (gg_machine_power_on(m) != 0) {
+    gg_machine_destroy(m);
+    return NULL;
+  }
+  return m;
+}
+
+/***
+ * Branch parent into a new machine in the same state, e.g. to try other
+ * inputs from there. RAM and VRAM are shared page by page, copy-on-write
+ * for both, so a fork takes the same time however much memory is in use
+ * and costs only the pages either side writes afterwards. The fork is
+ * silent; its renderer is only set up when it draws. Call this between
+ * frames of the parent; the current machine stays selected.
+ */
+struct gg_machine* gg_machine_fork(struct gg_machine* parent) {
+  struct gg_machine* m = malloc(sizeof(*m));
+
+  if (m == NULL) {
+    printf("Could not allocate a machine\n");
+    return NULL;
+  }
+  /* The renderer caches are only allocated when it draws */
+  memset(m, 0, sizeof(*m));
+  m->rom = parent->rom;
+  rom_cache_share(m->rom);
+  m->rom_hash = parent->rom_hash;
+  m->boot = parent->boot;
+  m->z80 = parent->z80;
+  page_share(&m->pages, &parent->pages);
+  m->vdp = parent->vdp;
+  m->io = parent->io;
+  m->sched = parent->sched;
+  /* The sound chip, without the samples the parent did not play yet */
+  memcpy(&m->psg, &parent->psg, offsetof(struct psg_state, buffer));
+  m->psg.base_cycle = m->psg.time;
+  m->psg.base_pos = 0;
+  m->psg.silent = 1;
+  m->render.backend = parent->render.backend;
+  m->render.flags_line = parent->render.flags_line;
+  m->render.silent = 1;
+  return m;
+}
+
+void gg_machine_destroy(struct gg_machine* m) {
+  struct gg_machine* current = machine;
+
+  if (m == NULL)
+    return;
+  /* Stop the worker drawing for it */
+  machine = m;
+  render_destroy();
+  machine = current == m ? NULL : current;
+  page_free(&m->pages);
+  rom_cache_put(m->rom);
+  free(m);
+}
+
+/* Devices called from this thread act on m from now on */
+void gg_machine_select(struct gg_machine* m) {
+  machine = m;
+}
+
+/* Emulate one frame of m on the calling thread */
+void gg_machine_run_frame(struct gg_machine* m) {
+  machine = m;
+  z80_run_frame();
+}
+
+/***
+ * Power m up and run it to the point resets should go back to, e.g. the
+ * title screen: the given number of frames, or if pc is not -1 the end of
+ * the first frame in which the CPU reaches pc, giving up after that many
+ * frames. The machine is saved there to buf. Returns the size of the
+ * state, 0 if pc was never reached or buf is too small.
+ */
+size_t gg_machine_run_boot(struct gg_machine* m, uint32_t frames, int32_t pc,
+    uint8_t* buf, size_t size) {
+  uint32_t i;
+
+  if (gg_machine_power_on(m) != 0)
+    return 0;
+  for (i = 0; i < frames; i++) {
+    if (pc < 0) {
+      z80_run_frame();
+    } else if (z80_run_to(machine->vdp.frame_start + VDP_FRAME_CYCLES, pc)) {
+      z80_run_frame();
+      return state_save(buf, size);
+    }
+  }
+  return pc < 0 ? state_save(buf, size) : 0;
+}
+
+/***
+ * Make resets of m go back to the given snapshot instead of powering up.
+ * It is not copied, so one snapshot can serve any number of machines
+ * running the same ROM; keep it until they are gone. NULL goes back to
+ * powering up.
+ */
+void gg_machine_set_boot(struct gg_machine* m, const uint8_t* state) {
+  m->boot = state;
+}
+
+/***
+ * Reset m and make it the current machine. With a boot snapshot this is
+ * a save state load, a handful of memcpys instead of the frames it took
+ * to get there. Returns -1 if powering up ran out of memory.
+ */
+int gg_machine_reset(struct gg_machine* m) {
+  gg_machine_select(m);
+  if (m->boot != NULL && state_load(m->boot, STATE_SIZE) == 0)
+    return 0;
+  return gg_machine_power_on(m);
+}
@@ -20,61 +20,437 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <SDL2/SDL.h>
 
 #include "../include/z80.h"
 #include "../include/loader.h"
 #include "../include/graphics.h"
+#include "../include/io.h"
+#include "../include/vdp.h"
+#include "../include/render.h"
+#include "../include/scale.h"
+#include "../include/psg.h"
+#include "../include/audio.h"
+#include "../include/state.h"
+#include "../include/rewind.h"
+#include "../include/netplay.h"
+#include "../include/machine.h"
+#include "../include/batch.h"
+#include "../include/serve.h"
 
-extern SDL_Window *G_window;
-extern SDL_Renderer *G_renderer;
+/* Map the keyboard to the Game Gear buttons */
+static uint8_t key_to_button(SDL_Keycode key) {
+  switch (key) {
+  case SDLK_UP: return JOY_UP;
+  case SDLK_DOWN: return JOY_DOWN;
+  case SDLK_LEFT: return JOY_LEFT;
+  case SDLK_RIGHT: return JOY_RIGHT;
+  case SDLK_z: return JOY_BUTTON1;
+  case SDLK_x: return JOY_BUTTON2;
+  case SDLK_RETURN: return JOY_START;
+  default: return 0;
+  }
+}
+
+/* Audio queued ahead of the device unless -l says otherwise */
+#define AUDIO_LATENCY_MS 64
+
+/* MiB of rewind history unless -w says otherwise */
+#define REWIND_BUDGET_MIB 16
+
+/* Number of frames the statistics are averaged over */
+#define STATS_FRAMES 60
+
+struct frame_stats {
+  uint64_t idle_cycles;
+  uint64_t lines_drawn;
+  uint64_t lines_skipped;
+  uint64_t frames_unchanged;
+  uint64_t emulation_ticks;
+  uint64_t psg_events;
+  uint64_t ahead_ticks;
+  uint64_t restore_ticks;
+  struct rewind_stats rewind;
+  struct netplay_stats netplay;
+  struct gg_graphics_stats video;
+};
+
+/***
+ * Keep the emulation at the speed of the real machine. The frame rate
+ * follows from the emulated cycles, not from the display. Falling behind
+ * by more than a few frames restarts the clock instead of catching up.
+ */
+static void pace_frame(uint64_t* start, uint32_t* frames) {
+  uint64_t freq = SDL_GetPerformanceFrequency();
+  uint64_t now = SDL_GetPerformanceCounter();
+  uint64_t target;
+
+  (*frames)++;
+  target = *start + (uint64_t)((double)*frames * VDP_FRAME_CYCLES * freq / Z80_CLOCK);
+  if (now < target) {
+    SDL_Delay((target - now) * 1000 / freq);
+  } else if (now - target > freq / 10) {
+    *start = now;
+    *frames = 0;
+  }
+}
+
+/* F5 saves the machine next to the ROM, F8 loads it back */
+static void save_or_load(SDL_Keycode key, const char* path) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  int failed;
+
+  if (key == SDLK_F5)
+    failed = state_save_file(path);
+  else if (key == SDLK_F8)
+    failed = state_load_file(path);
+  else
+    return;
+  if (!failed)
+    printf("%s %s in %.1f us\n", key == SDLK_F5 ? "Saved" : "Loaded", path,
+        1e6 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+}
+
+/***
+ * Run-ahead: the real frame was emulated without being drawn. Remember
+ * the machine, emulate count frames further with the same input and
+ * draw only the last one, without sound. What the game does in reaction
+ * to the input shows up count frames earlier. The caller goes back to
+ * the saved state once the frame is presented.
+ */
+static void run_ahead(unsigned count, uint8_t* state) {
+  unsigned i;
+
+  state_save(state, STATE_SIZE);
+  machine->psg.silent = 1;
+  for (i = 1; i < count; i++)
+    z80_run_frame();
+  render_set_silent(0);
+  z80_run_frame();
+  machine->psg.silent = 0;
+}
 
 static void show_help(char* app_name) {
-  printf("%s -r <rom file>\n", app_name);
+  const struct scale_filter* filters;
+  unsigned count, i;
+
+  printf("%s [-p] [-s] [-a <frames>] [-b <job file>] [-f <filter>] [-i <instances>] "
+      "[-j <workers>] [-l <ms>] [-m <renderer>] [-n <link>] [-r <rom file>]\n"
+      "    [-S|--serve <socket>] [-w <MiB>]\n", app_name);
+  printf("  -a <frames>    Run ahead to hide the game's own input lag\n");
+  printf("  -b <job file>  Run the jobs in the file without a window and exit, one\n"
+      "                 per line: rom=<file> frames=<n> [episodes=<n>]\n"
+      "                 [boot=<frames>|boot=@<pc>] [movie=<file>] [hash]\n"
+      "                 [state=<file>] [ppm=<file>]\n");
+  printf("  -f <filter>    Upscaling filter:");
+  filters = scale_filters(&count);
+  for (i = 0; i < count; i++)
+    printf(" %s", filters[i].name);
+  printf("\n");
+  printf("  -i <instances> Machines --serve runs (default 1)\n");
+  printf("  -j <workers>   Threads for -b (default one per core)\n");
+  printf("  -l <ms>        Audio latency, 0 turns audio off (default %u)\n",
+      AUDIO_LATENCY_MS);
+  printf("  -m <renderer>  fast (per line, default) or accurate (per pixel)\n");
+  printf("  -n <link>      Gear-to-Gear link over UDP with rollback, <link> is\n"
+      "                 <local port>:<host>:<remote port>[:<link frames>[:<delay ms>"
+      "[:<loss %%>]]]\n"
+      "                 link frames default to %d, delay and loss are injected\n",
+      NETPLAY_LINK_FRAMES);
+  printf("  -p             Draw frames on a worker thread, one frame behind\n");
+  printf("  -r <rom file>  Game Gear ROM to run\n");
+  printf("  -s             Print per-frame statistics, with --serve per second\n");
+  printf("  -S, --serve <socket>\n"
+      "                 Run the ROM without a window for agents: commands on the\n"
+      "                 Unix socket, observations in <socket>.shm, see serve.h\n");
+  printf("  -w <MiB>       Memory for rewinding, 0 turns it off (default %u)\n",
+      REWIND_BUDGET_MIB);
+  printf("F5 saves the state to <rom file>.state, F8 loads it\n");
+  printf("Hold backspace to rewind\n");
+}
+
+/* Print averages since the last report */
+static void show_stats(struct frame_stats* last, uint64_t emulation_ticks,
+    uint64_t ahead_ticks, uint64_t restore_ticks) {
+  uint64_t idle = machine->z80.idle_cycles - last->idle_cycles;
+  struct gg_graphics_stats video;
+  struct audio_stats audio;
+  struct rewind_stats rewind;
+  struct netplay_stats netplay;
+  unsigned i;
+
+  printf("frame %u: idle %llu cycles/frame (%.1f%%)\n", machine->vdp.frame,
+      (unsigned long long)(idle / STATS_FRAMES),
+      100.0 * idle / ((double)STATS_FRAMES * VDP_FRAME_CYCLES));
+  printf("frame %u: drew %llu of %llu lines, %llu unchanged frames\n",
+      machine->vdp.frame,
+      (unsigned long long)(machine->render.lines_drawn - last->lines_drawn),
+      (unsigned long long)(machine->render.lines_drawn - last->lines_drawn +
+          machine->render.lines_skipped - last->lines_skipped),
+      (unsigned long long)(machine->render.frames_unchanged - last->frames_unchanged));
+  printf("frame %u: emulation and rendering %.2f ms/frame\n", machine->vdp.frame,
+      1000.0 * (emulation_ticks - last->emulation_ticks) /
+          SDL_GetPerformanceFrequency() / STATS_FRAMES);
+  gg_graphics_stats(&video);
+  printf("frame %u: presented %u, dropped %u, duplicated %u frames\n",
+      machine->vdp.frame, video.presented - last->video.presented,
+      video.dropped - last->video.dropped, video.duplicated - last->video.duplicated);
+  if (video.filtered != last->video.filtered)
+    printf("frame %u: filter %.3f ms/frame over %u frames\n", machine->vdp.frame,
+        (video.filter_us - last->video.filter_us) / 1000.0 /
+            (video.filtered - last->video.filtered),
+        video.filtered - last->video.filtered);
+  printf("frame %u: psg %llu steps/frame\n", machine->vdp.frame,
+      (unsigned long long)((machine->psg.total_events - last->psg_events) / STATS_FRAMES));
+  audio_stats(&audio);
+  if (audio.target_ms > 0)
+    printf("frame %u: audio latency %.1f ms (target %.1f), ratio %.4f, "
+        "%u underruns, %u overruns\n", machine->vdp.frame, audio.latency_ms,
+        audio.target_ms, audio.ratio, audio.underruns, audio.overruns);
+  rewind_stats(&rewind);
+  if (rewind.captures != last->rewind.captures)
+    printf("frame %u: rewind %.1f s in %.1f MiB (%.1f KiB/s), capture %.1f us/frame\n",
+        machine->vdp.frame, rewind.frames / VDP_FRAME_RATE, rewind.bytes / 1048576.0,
+        rewind.frames ? rewind.bytes / 1024.0 / (rewind.frames / VDP_FRAME_RATE) : 0,
+        1e6 * (rewind.capture_ticks - last->rewind.capture_ticks) /
+            SDL_GetPerformanceFrequency() / (rewind.captures - last->rewind.captures));
+  last->rewind = rewind;
+  netplay_stats(&netplay);
+  if (netplay.frames != last->netplay.frames) {
+    printf("frame %u: netplay %u rollbacks replaying %u frames, %.2f ms/frame, by length:",
+        machine->vdp.frame, netplay.rollbacks - last->netplay.rollbacks,
+        netplay.replayed - last->netplay.replayed,
+        1000.0 * (netplay.rollback_ticks - last->netplay.rollback_ticks) /
+            SDL_GetPerformanceFrequency() / STATS_FRAMES);
+    for (i = 1; i <= NETPLAY_WINDOW; i++)
+      if (netplay.replays[i] != last->netplay.replays[i])
+        printf(" %u:%u", i, netplay.replays[i] - last->netplay.replays[i]);
+    printf("\n");
+    printf("frame %u: netplay lead %d frames, %u stalls, %u of %u checksums differ, "
+        "%u corrections too late\n", machine->vdp.frame, netplay.lead,
+        netplay.stalls - last->netplay.stalls, netplay.desyncs, netplay.checks,
+        netplay.late);
+  }
+  last->netplay = netplay;
+  if (ahead_ticks != last->ahead_ticks)
+    printf("frame %u: run-ahead %.2f ms/frame, restore %.1f us/frame\n", machine->vdp.frame,
+        1000.0 * (ahead_ticks - last->ahead_ticks) / SDL_GetPerformanceFrequency() /
+            STATS_FRAMES,
+        1e6 * (restore_ticks - last->restore_ticks) / SDL_GetPerformanceFrequency() /
+            STATS_FRAMES);
+  last->ahead_ticks = ahead_ticks;
+  last->restore_ticks = restore_ticks;
+  last->idle_cycles = machine->z80.idle_cycles;
+  last->psg_events = machine->psg.total_events;
+  last->emulation_ticks = emulation_ticks;
+  last->video = video;
+  last->lines_drawn = machine->render.lines_drawn;
+  last->lines_skipped = machine->render.lines_skipped;
+  last->frames_unchanged = machine->render.frames_unchanged;
 }
 
 int main(int argc, char* argv[]) {
   SDL_Event e;
   int c;
   bool quit = false;
+  bool stats = false;
+  bool pipelined = false;
+  bool rewinding = false, rewound;
+  struct frame_stats last_stats = { 0 };
+  uint8_t buttons = 0;
+  uint64_t pace_start, start, ahead_start;
+  uint64_t emulation_ticks = 0, ahead_ticks = 0, restore_ticks = 0;
+  uint32_t pace_frames = 0;
+  static int16_t samples[PSG_BUFFER * 2];
+  unsigned sample_count, latency = AUDIO_LATENCY_MS, rewind_mib = REWIND_BUDGET_MIB;
+  unsigned ahead = 0;
+  static uint8_t ahead_state[STATE_SIZE];
   const char* rom_path = "rom/mega_man.gg";
+  const char* link = NULL;
+  const char* jobs = NULL;
+  const char* serve_path = NULL;
+  unsigned workers = 0, instances = 1;
+  struct gg_machine* gg;
+  char state_path[4096];
+  const struct render_backend* backend = &render_fast;
+  const struct scale_filter* filter = NULL;
 
-  (void)argc;
-  (void)argv;
+  static const struct option long_options[] = {
+    { "serve", required_argument, NULL, 'S' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
 
-  while ((c = getopt(argc, argv, "h?r")) != -1) {
+  while ((c = getopt_long(argc, argv, "a:b:f:h?i:j:l:m:n:pr:sS:w:", long_options,
+      NULL)) != -1) {
     switch (c) {
+    case 'r':
+      rom_path = optarg;
+      break;
+    case 's':
+      stats = true;
+      break;
+    case 'p':
+      pipelined = true;
+      break;
+    case 'f':
+      filter = scale_find(optarg);
+      if (filter == NULL) {
+        printf("Unknown filter %s\n", optarg);
+        show_help(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      ahead = atoi(optarg);
+      break;
+    case 'l':
+      latency = atoi(optarg);
+      break;
+    case 'w':
+      rewind_mib = atoi(optarg);
+      break;
+    case 'n':
+      link = optarg;
+      break;
+    case 'b':
+      jobs = optarg;
+      break;
+    case 'j':
+      workers = atoi(optarg);
+      break;
+    case 'i':
+      instances = atoi(optarg);
+      break;
+    case 'S':
+      serve_path = optarg;
+      break;
+    case 'm':
+      backend = render_find_backend(optarg);
+      if (backend == NULL) {
+        printf("Unknown renderer %s\n", optarg);
+        show_help(argv[0]);
+        return 1;
+      }
+      break;
     case 'h':
     case '?':
-    case 'r':
     default:
       show_help(argv[0]);
       return 0;
     }
   }
 
+  if (jobs != NULL)
+    return batch_run(jobs, workers) != 0;
+  if (serve_path != NULL)
+    return serve_run(serve_path, rom_path, instances, stats) != 0;
+
+  snprintf(state_path, sizeof(state_path), "%s.state", rom_path);
   /* Setup system state */
-  z80_init(rom_path);
+  gg = gg_machine_create(rom_path);
+  if (gg == NULL)
+    return 1;
   /* Init graphic subsystem of Game Gear */
+  gg_graphics_set_filter(filter);
   gg_graphics_init();
+  if (latency > 0)
+    audio_init(latency);
+  render_set_backend(backend);
+  /* The other machine only follows inputs, not jumps in time */
+  if (link != NULL) {
+    if (netplay_init(link) != 0)
+      return 1;
+    if (ahead > 0 || rewind_mib > 0)
+      printf("Netplay can't run ahead or rewind, ignoring -a and -w\n");
+    ahead = 0;
+    rewind_mib = 0;
+  }
+  /* The worker would show the frame run ahead one frame late */
+  if (ahead > 0 && pipelined) {
+    printf("Run-ahead draws on the CPU thread, ignoring -p\n");
+    pipelined = false;
+  }
+  render_set_pipelined(pipelined);
+  if (rewind_mib > 0)
+    rewind_init((size_t)rewind_mib << 20, 1);
 
 #ifdef DEBUG
   printf("\nStaring main emulation loop\n\n");
 #endif
+  pace_start = SDL_GetPerformanceCounter();
   while(!quit) {
     while (SDL_PollEvent(&e)) {
       if (e.type == SDL_QUIT)
         quit = true;
-      /*if (e.type == SDL_KEYDOWN)
-        quit = true;*/
+      if (e.type == SDL_KEYDOWN) {
+        buttons |= key_to_button(e.key.keysym.sym);
+        if (link == NULL || e.key.keysym.sym == SDLK_F5)
+          save_or_load(e.key.keysym.sym, state_path);
+        if (e.key.keysym.sym == SDLK_BACKSPACE)
+          rewinding = true;
+      }
+      if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_BACKSPACE)
+        rewinding = false;
+      if (e.type == SDL_KEYUP)
+        buttons &= ~key_to_button(e.key.keysym.sym);
+      io_set_buttons(buttons);
       if (e.type == SDL_MOUSEBUTTONDOWN)
         quit = true;
-      z80_emulate_cycle();
+      if (e.type == SDL_WINDOWEVENT)
+        gg_graphics_expose();
+    }
+    /* Emulate until the VDP finished the frame. In pipelined mode the
+     * frame shown is the one before, drawn while this one ran */
+    start = SDL_GetPerformanceCounter();
+    /* Rewinding goes back one snapshot and plays the frame after it
+     * without sound and without recording it */
+    rewound = rewinding && rewind_step() == 0;
+    if (ahead > 0)
+      render_set_silent(1);
+    if (link == NULL) {
+      z80_run_frame();
+    } else if (netplay_run_frame() != 0) {
+      /* The other machine fell behind, give it time to catch up */
+      SDL_Delay(1);
+      continue;
+    }
+    sample_count = psg_end_frame(machine->z80.cycles, samples);
+    if (ahead > 0) {
+      ahead_start = SDL_GetPerformanceCounter();
+      run_ahead(ahead, ahead_state);
+      ahead_ticks += SDL_GetPerformanceCounter() - ahead_start;
+    }
+    render_frame_acquire();
+    if (!rewound)
+      audio_push(samples, sample_count);
+    emulation_ticks += SDL_GetPerformanceCounter() - start;
+    gg_graphics_present();
+
+    if (stats && (machine->vdp.frame % STATS_FRAMES) == 0)
+      show_stats(&last_stats, emulation_ticks, ahead_ticks, restore_ticks);
+    render_frame_release();
+    if (ahead > 0) {
+      ahead_start = SDL_GetPerformanceCounter();
+      state_load(ahead_state, STATE_SIZE);
+      restore_ticks += SDL_GetPerformanceCounter() - ahead_start;
+      ahead_ticks += SDL_GetPerformanceCounter() - ahead_start;
     }
+    if (!rewound)
+      rewind_capture();
+    pace_frame(&pace_start, &pace_frames);
   }
 
+  render_set_pipelined(0);
+  netplay_destroy();
+  rewind_destroy();
+  audio_destroy();
+  gg_graphics_destroy();
+  gg_machine_destroy(gg);
   return 0;
 }
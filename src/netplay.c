@@ -0,0 +1,511 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <SDL2/SDL.h>
+
+#include "netplay.h"
+#include "state.h"
+#include "render.h"
+#include "machine.h"
+
+/***
+ * Rollback netplay over the Gear-to-Gear link. Each side runs its own
+ * Game Gear and the link only carries what io_link_output() collects:
+ * the parallel pins and the serial bytes of a frame, which the other
+ * machine sees a fixed number of frames later. That is all a frame
+ * depends on besides the local buttons, so it is the only thing sent.
+ *
+ * The link delay should cover the network latency. Each machine reacts
+ * to what the other sent, so a correction travels back and forth one
+ * link delay per trip; on a link faster than the network the corrections
+ * fall further behind with every trip and finally out of the window.
+ *
+ * A frame whose link input has not arrived yet runs on a prediction:
+ * the pins stay as they were and no bytes come in. When the real input
+ * differs, the machine goes back to the save state taken before that
+ * frame and runs the frames since again without sound and drawing.
+ * Rolling back can change what this machine sent, so every packet
+ * repeats the whole window and the other side rolls back in turn.
+ *
+ * A frame is confirmed once it leaves the window. Its checksum covers the
+ * link traffic both machines agreed on for it; the other side computes
+ * the same sum and a difference means the two machines ran on different
+ * input.
+ */
+
+#define NETPLAY_MAGIC "SGGN"
+
+struct netplay_slot {
+  int32_t frame;      /* Frame the slot holds, -1 if none */
+  uint8_t predicted;  /* Input was a guess */
+  struct io_link_frame input;   /* What the other machine sent the frame before */
+  struct io_link_frame output;  /* What this machine sent during the frame */
+  /* Machine at the start of the frame, aligned for struct state_blob */
+  uint8_t state[STATE_SIZE] __attribute__((aligned(8)));
+};
+
+struct netplay_remote {
+  int32_t frame;
+  struct io_link_frame output;
+};
+
+struct netplay_check {
+  int32_t frame;
+  uint32_t sum;
+  uint8_t compared;
+};
+
+/* Multi-byte fields are in network order */
+struct netplay_packet {
+  char magic[4];
+  int32_t frame;      /* Newest frame of output included */
+  int32_t count;      /* Frames of output included, oldest first */
+  int32_t check_frame;  /* Newest confirmed frame */
+  uint32_t check;       /* Its checksum */
+  struct io_link_frame output[NETPLAY_WINDOW];
+};
+
+struct netplay_delayed {
+  uint64_t due;
+  int size;
+  struct netplay_packet packet;
+};
+
+static struct {
+  int socket;
+  struct sockaddr_in peer;
+  int32_t link;           /* Frames the link takes */
+  unsigned delay_ms;      /* Injected one way latency */
+  unsigned loss;          /* Injected packet loss in percent */
+  uint32_t random;
+
+  int32_t frame;          /* Next frame to run */
+  int32_t heard;          /* Newest frame heard with all before it */
+  int32_t rollback;       /* Oldest frame that ran on wrong input */
+  struct io_link_frame confirmed[NETPLAY_CHECKS]; /* Output of confirmed frames */
+  struct netplay_slot slots[NETPLAY_WINDOW];
+  struct netplay_remote remote[NETPLAY_REMOTE];
+  struct netplay_check checks[NETPLAY_CHECKS];
+  struct netplay_check remote_checks[NETPLAY_CHECKS];
+  int32_t check_frame;
+
+  struct netplay_delayed queue[NETPLAY_QUEUE];
+  unsigned queue_head;
+  unsigned queue_count;
+  struct netplay_stats stats;
+} netplay_state = { .socket = -1 };
+
+static uint32_t netplay_hash(const struct io_link_frame* link) {
+  uint32_t hash = 2166136261u;
+  const uint8_t* p = (const uint8_t*)link;
+  unsigned i;
+
+  for (i = 0; i < sizeof(*link); i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  return hash;
+}
+
+/* Parse <local port>:<host>:<remote port>[:<link frames>[:<delay ms>[:<loss %>]]] */
+static int netplay_parse(const char* spec, unsigned* local, char* host, size_t size,
+    char* port) {
+  const char* first = strchr(spec, ':');
+  const char* second = first ? strchr(first + 1, ':') : NULL;
+  const char* rest;
+
+  if (first == NULL || second == NULL || (size_t)(second - first - 1) >= size)
+    return -1;
+  *local = atoi(spec);
+  memcpy(host, first + 1, second - first - 1);
+  host[second - first - 1] = '\0';
+  snprintf(port, 16, "%d", atoi(second + 1));
+  netplay_state.link = NETPLAY_LINK_FRAMES;
+  rest = strchr(second + 1, ':');
+  if (rest != NULL) {
+    netplay_state.link = atoi(rest + 1);
+    rest = strchr(rest + 1, ':');
+  }
+  if (rest != NULL) {
+    netplay_state.delay_ms = atoi(rest + 1);
+    rest = strchr(rest + 1, ':');
+  }
+  if (rest != NULL)
+    netplay_state.loss = atoi(rest + 1);
+  if (netplay_state.link < 1 || netplay_state.link > NETPLAY_LINK_MAX)
+    return -1;
+  return *local > 0 && *local < 65536 ? 0 : -1;
+}
+
+/***
+ * Open the link: listen on the local UDP port and send to the other
+ * machine. The delay and loss are applied to the packets this side sends,
+ * set them on both sides for a symmetric link.
+ */
+int netplay_init(const char* spec) {
+  struct sockaddr_in local;
+  struct addrinfo hints, *peer;
+  char host[256], port[16];
+  unsigned local_port;
+  int i;
+
+  memset(&netplay_state, 0, sizeof(netplay_state));
+  netplay_state.socket = -1;
+  if (netplay_parse(spec, &local_port, host, sizeof(host), port) != 0) {
+    printf("Netplay wants <local port>:<host>:<remote port>"
+        "[:<link frames>[:<delay ms>[:<loss %%>]]], at most %d link frames\n",
+        NETPLAY_LINK_MAX);
+    return -1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &peer) != 0) {
+    printf("Netplay can't resolve %s\n", host);
+    return -1;
+  }
+  memcpy(&netplay_state.peer, peer->ai_addr, sizeof(netplay_state.peer));
+  freeaddrinfo(peer);
+
+  netplay_state.socket = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(local_port);
+  if (netplay_state.socket < 0 ||
+      bind(netplay_state.socket, (struct sockaddr*)&local, sizeof(local)) != 0 ||
+      fcntl(netplay_state.socket, F_SETFL, O_NONBLOCK) != 0) {
+    printf("Netplay can't listen on port %u\n", local_port);
+    netplay_destroy();
+    return -1;
+  }
+
+  netplay_state.random = local_port * 2654435761u;
+  netplay_state.heard = -1;
+  netplay_state.rollback = INT32_MAX;
+  netplay_state.check_frame = -1;
+  for (i = 0; i < NETPLAY_WINDOW; i++)
+    netplay_state.slots[i].frame = -1;
+  for (i = 0; i < NETPLAY_REMOTE; i++)
+    netplay_state.remote[i].frame = -1;
+  for (i = 0; i < NETPLAY_CHECKS; i++) {
+    netplay_state.checks[i].frame = -1;
+    netplay_state.remote_checks[i].frame = -1;
+  }
+  printf("Netplay on port %u with %s:%s, link %d frames, %u ms delay, %u%% loss\n",
+      local_port, host, port, netplay_state.link, netplay_state.delay_ms,
+      netplay_state.loss);
+  return 0;
+}
+
+static void netplay_send_now(const struct netplay_packet* packet, int size) {
+  if (sendto(netplay_state.socket, packet, size, 0,
+      (struct sockaddr*)&netplay_state.peer, sizeof(netplay_state.peer)) == size)
+    netplay_state.stats.sent++;
+}
+
+/* Send what is due of the packets held back */
+static void netplay_flush(void) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  struct netplay_delayed* delayed;
+
+  while (netplay_state.queue_count > 0) {
+    delayed = &netplay_state.queue[netplay_state.queue_head];
+    if (delayed->due > now)
+      break;
+    netplay_send_now(&delayed->packet, delayed->size);
+    netplay_state.queue_head = (netplay_state.queue_head + 1) % NETPLAY_QUEUE;
+    netplay_state.queue_count--;
+  }
+}
+
+/* Send the output of every frame in the window and the newest checksum */
+static void netplay_send(void) {
+  struct netplay_packet packet;
+  struct netplay_delayed* delayed;
+  int32_t count = netplay_state.frame < NETPLAY_WINDOW ? netplay_state.frame : NETPLAY_WINDOW;
+  int32_t first = netplay_state.frame - count, i;
+  int size = offsetof(struct netplay_packet, output) + count * sizeof(struct io_link_frame);
+
+  memcpy(packet.magic, NETPLAY_MAGIC, sizeof(packet.magic));
+  packet.frame = htonl(netplay_state.frame - 1);
+  packet.count = htonl(count);
+  packet.check_frame = htonl(netplay_state.check_frame);
+  packet.check = netplay_state.check_frame < 0 ? 0 :
+      htonl(netplay_state.checks[netplay_state.check_frame % NETPLAY_CHECKS].sum);
+  for (i = 0; i < count; i++)
+    packet.output[i] = netplay_state.slots[(first + i) % NETPLAY_WINDOW].output;
+
+  /* xorshift, only has to look random */
+  netplay_state.random ^= netplay_state.random << 13;
+  netplay_state.random ^= netplay_state.random >> 17;
+  netplay_state.random ^= netplay_state.random << 5;
+  if (netplay_state.random % 100 < netplay_state.loss) {
+    netplay_state.stats.dropped++;
+    return;
+  }
+  if (netplay_state.delay_ms == 0) {
+    netplay_send_now(&packet, size);
+    return;
+  }
+  if (netplay_state.queue_count == NETPLAY_QUEUE) {
+    netplay_state.stats.dropped++;
+    return;
+  }
+  delayed = &netplay_state.queue[(netplay_state.queue_head + netplay_state.queue_count++) %
+      NETPLAY_QUEUE];
+  delayed->due = SDL_GetPerformanceCounter() +
+      netplay_state.delay_ms * SDL_GetPerformanceFrequency() / 1000;
+  delayed->size = size;
+  memcpy(&delayed->packet, &packet, size);
+}
+
+/* Compare a checksum once both sides have it */
+static void netplay_compare(int32_t frame) {
+  struct netplay_check* local = &netplay_state.checks[frame % NETPLAY_CHECKS];
+  struct netplay_check* remote = &netplay_state.remote_checks[frame % NETPLAY_CHECKS];
+
+  if (local->frame != frame || remote->frame != frame || local->compared)
+    return;
+  local->compared = 1;
+  netplay_state.stats.checks++;
+  if (local->sum != remote->sum) {
+    if (netplay_state.stats.desyncs++ == 0)
+      printf("Netplay desync at frame %d\n", frame);
+  }
+}
+
+/* Link output of the other machine for a frame, from a packet */
+static void netplay_heard(int32_t frame, const struct io_link_frame* output) {
+  struct netplay_remote* remote = &netplay_state.remote[frame % NETPLAY_REMOTE];
+  struct netplay_slot* slot;
+  int32_t next = frame + netplay_state.link;
+
+  if (remote->frame == frame && memcmp(&remote->output, output, sizeof(*output)) == 0)
+    return;
+  if (remote->frame > frame)
+    return;
+  remote->frame = frame;
+  remote->output = *output;
+  while (netplay_state.remote[(netplay_state.heard + 1) % NETPLAY_REMOTE].frame ==
+      netplay_state.heard + 1)
+    netplay_state.heard++;
+
+  /* The frame it reached ran on this input; roll back if it was different */
+  if (next >= netplay_state.frame)
+    return;
+  if (next <= netplay_state.frame - NETPLAY_WINDOW) {
+    if (netplay_state.stats.late++ == 0)
+      printf("Netplay correction for frame %d is too old to roll back\n", next);
+    return;
+  }
+  slot = &netplay_state.slots[next % NETPLAY_WINDOW];
+  if (memcmp(&slot->input, output, sizeof(*output)) != 0 && next < netplay_state.rollback)
+    netplay_state.rollback = next;
+}
+
+/* Frames a packet may talk about: the other side is never further than
+ * the remote history away from this one */
+static int netplay_near(int32_t frame) {
+  return frame >= netplay_state.frame - NETPLAY_REMOTE &&
+      frame <= netplay_state.frame + NETPLAY_REMOTE;
+}
+
+/* Read every packet waiting, from the other machine only */
+static void netplay_receive(void) {
+  struct netplay_packet packet;
+  struct netplay_check* check;
+  struct sockaddr_in from;
+  socklen_t from_size;
+  int32_t frame, count, i;
+  ssize_t size;
+
+  for (;;) {
+    from_size = sizeof(from);
+    size = recvfrom(netplay_state.socket, &packet, sizeof(packet), 0,
+        (struct sockaddr*)&from, &from_size);
+    if (size < 0)
+      break;
+    if (from_size != sizeof(from) || from.sin_family != AF_INET ||
+        from.sin_addr.s_addr != netplay_state.peer.sin_addr.s_addr ||
+        from.sin_port != netplay_state.peer.sin_port)
+      continue;
+    if ((size_t)size < offsetof(struct netplay_packet, output) ||
+        memcmp(packet.magic, NETPLAY_MAGIC, sizeof(packet.magic)) != 0)
+      continue;
+    frame = ntohl(packet.frame);
+    count = ntohl(packet.count);
+    if (count < 0 || count > NETPLAY_WINDOW || (size_t)size !=
+        offsetof(struct netplay_packet, output) + count * sizeof(struct io_link_frame))
+      continue;
+    /* Frames far from this side's would take the remote slots of frames
+     * still needed, negative ones index before them */
+    if (!netplay_near(frame) || frame - count + 1 < 0)
+      continue;
+    netplay_state.stats.received++;
+    for (i = 0; i < count; i++)
+      netplay_heard(frame - count + 1 + i, &packet.output[i]);
+
+    frame = ntohl(packet.check_frame);
+    if (frame >= 0 && netplay_near(frame)) {
+      check = &netplay_state.remote_checks[frame % NETPLAY_CHECKS];
+      check->frame = frame;
+      check->sum = ntohl(packet.check);
+      netplay_compare(frame);
+    }
+  }
+}
+
+/***
+ * A slot is about to be reused for a newer frame, so the frame it held is
+ * final. Its input is what the other machine sent a link delay earlier:
+ * sum up the link traffic of that frame in both directions.
+ */
+static void netplay_confirm(struct netplay_slot* slot) {
+  int32_t frame = slot->frame - netplay_state.link;
+  struct netplay_check* check;
+
+  netplay_state.confirmed[slot->frame % NETPLAY_CHECKS] = slot->output;
+  if (frame < 0)
+    return;
+  check = &netplay_state.checks[frame % NETPLAY_CHECKS];
+  check->frame = frame;
+  check->sum = netplay_hash(&netplay_state.confirmed[frame % NETPLAY_CHECKS]) +
+      netplay_hash(&slot->input);
+  check->compared = 0;
+  netplay_state.check_frame = frame;
+  netplay_compare(frame);
+}
+
+/* Run one frame on the input heard for it, or a guess */
+static void netplay_simulate(int32_t frame) {
+  struct netplay_slot* slot = &netplay_state.slots[frame % NETPLAY_WINDOW];
+  struct netplay_remote* remote;
+
+  if (slot->frame >= 0 && slot->frame != frame)
+    netplay_confirm(slot);
+  slot->frame = frame;
+  state_save(slot->state, STATE_SIZE);
+
+  memset(&slot->input, 0, sizeof(slot->input));
+  slot->predicted = 0;
+  if (frame >= netplay_state.link) {
+    remote = &netplay_state.remote[(frame - netplay_state.link) % NETPLAY_REMOTE];
+    if (remote->frame == frame - netplay_state.link) {
+      slot->input = remote->output;
+    } else {
+      /* The pins most likely did not move and nothing was sent */
+      slot->predicted = 1;
+      if (netplay_state.heard >= 0)
+        slot->input.parallel =
+            netplay_state.remote[netplay_state.heard % NETPLAY_REMOTE].output.parallel;
+    }
+  }
+  io_link_input(&slot->input);
+  z80_run_frame();
+  io_link_output(&slot->output);
+}
+
+/* Go back to the oldest frame that ran on wrong input and run up to now */
+static void netplay_replay(void) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  int32_t from = netplay_state.rollback, frame;
+  uint32_t count = netplay_state.frame - from;
+
+  netplay_state.rollback = INT32_MAX;
+  if (from >= netplay_state.frame)
+    return;
+  state_load(netplay_state.slots[from % NETPLAY_WINDOW].state, STATE_SIZE);
+  render_set_silent(1);
+  machine->psg.silent = 1;
+  for (frame = from; frame < netplay_state.frame; frame++)
+    netplay_simulate(frame);
+  machine->psg.silent = 0;
+  render_set_silent(0);
+  /* The sound of the replayed frames was played already */
+  psg_reset_output();
+
+  netplay_state.stats.rollbacks++;
+  netplay_state.stats.replayed += count;
+  netplay_state.stats.replays[count]++;
+  if (count > netplay_state.stats.max_replay)
+    netplay_state.stats.max_replay = count;
+  netplay_state.stats.rollback_ticks += SDL_GetPerformanceCounter() - start;
+#ifdef DEBUG
+  printf("Netplay rolled back to frame %d, replayed %u frames\n", from, count);
+#endif
+}
+
+/***
+ * Run the next frame, after undoing whatever ran on a wrong guess. Returns
+ * -1 without running anything while the other side is too far behind,
+ * the caller should try again a bit later.
+ */
+int netplay_run_frame(void) {
+  netplay_flush();
+  netplay_receive();
+  netplay_replay();
+  netplay_state.stats.lead = netplay_state.frame - netplay_state.heard - 1;
+  if (netplay_state.stats.lead >= NETPLAY_LEAD) {
+    netplay_state.stats.stalls++;
+    netplay_send();
+    return -1;
+  }
+
+  netplay_simulate(netplay_state.frame++);
+  netplay_state.stats.frames++;
+  netplay_send();
+  return 0;
+}
+
+/* Keep the link going without running new frames, so both sides settle
+ * on the same input before they stop */
+void netplay_drain(unsigned ms) {
+  uint64_t end = SDL_GetPerformanceCounter() + ms * SDL_GetPerformanceFrequency() / 1000;
+
+  while (SDL_GetPerformanceCounter() < end) {
+    netplay_flush();
+    netplay_receive();
+    netplay_replay();
+    netplay_send();
+    SDL_Delay(5);
+  }
+}
+
+void netplay_stats(struct netplay_stats* stats) {
+  *stats = netplay_state.stats;
+}
+
+void netplay_destroy(void) {
+  if (netplay_state.socket >= 0)
+    close(netplay_state.socket);
+  netplay_state.socket = -1;
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "page.h"
+
+/***
+ * Copy-on-write pages: a fork shares every page of its parent, both lose
+ * write access and whichever writes a page first copies it. The count of
+ * machines using a page is atomic, forks can run on other threads than
+ * their parent.
+ */
+struct page {
+  SDL_atomic_t users;
+  uint8_t data[PAGE_SZ];
+};
+
+static void page_release(struct page* page) {
+  /* The old value is returned, 1 means this was the last user */
+  if (page != NULL && SDL_AtomicAdd(&page->users, -1) == 1)
+    free(page);
+}
+
+static void page_set(struct page_table* table, uint32_t index, struct page* page,
+    int owned) {
+  table->pages[index] = page;
+  table->read[index] = page->data;
+  table->write[index] = owned ? page->data : NULL;
+}
+
+/* Give the table zeroed pages of its own, returns -1 if out of memory */
+int page_alloc(struct page_table* table) {
+  struct page* page;
+  uint32_t i;
+
+  for (i = 0; i < PAGE_COUNT; i++) {
+    page = calloc(1, sizeof(*page));
+    if (page == NULL) {
+      printf("Could not allocate memory pages\n");
+      return -1;
+    }
+    SDL_AtomicSet(&page->users, 1);
+    page_release(table->pages[i]);
+    page_set(table, i, page, 1);
+  }
+  return 0;
+}
+
+void page_free(struct page_table* table) {
+  uint32_t i;
+
+  for (i = 0; i < PAGE_COUNT; i++) {
+    page_release(table->pages[i]);
+    table->pages[i] = NULL;
+    table->read[i] = NULL;
+    table->write[i] = NULL;
+  }
+}
+
+/***
+ * Make child use the pages of parent, copy-on-write for both. Takes the
+ * same time however much of the memory is in use.
+ */
+void page_share(struct page_table* child, struct page_table* parent) {
+  uint32_t i;
+
+  for (i = 0; i < PAGE_COUNT; i++) {
+    SDL_AtomicAdd(&parent->pages[i]->users, 1);
+    page_release(child->pages[i]);
+    page_set(child, i, parent->pages[i], 0);
+    parent->write[i] = NULL;
+  }
+  parent->forks++;
+}
+
+/***
+ * Write access to a page, copying it if another machine still uses it.
+ * A page the others all let go of is taken over as it is.
+ */
+uint8_t* page_own(struct page_table* table, uint32_t index) {
+  struct page* shared = table->pages[index];
+  struct page* page;
+
+  if (SDL_AtomicGet(&shared->users) > 1) {
+    page = malloc(sizeof(*page));
+    if (page == NULL) {
+      printf("Could not copy a memory page\n");
+      exit(1);
+    }
+    SDL_AtomicSet(&page->users, 1);
+    memcpy(page->data, shared->data, PAGE_SZ);
+    page_release(shared);
+    table->copied++;
+    page_set(table, index, page, 1);
+  } else {
+    table->write[index] = shared->data;
+  }
+  return table->write[index];
+}
+
+/* Read size bytes from offset on, across pages */
+void page_copy_out(const struct page_table* table, uint32_t offset, uint8_t* out,
+    uint32_t size) {
+  uint32_t count;
+
+  while (size > 0) {
+    count = PAGE_SZ - (offset & (PAGE_SZ - 1));
+    if (count > size)
+      count = size;
+    memcpy(out, page_data(table, offset), count);
+    offset += count;
+    out += count;
+    size -= count;
+  }
+}
+
+/***
+ * Write size bytes from offset on, across pages. A shared page that is
+ * overwritten as a whole is replaced instead of copied.
+ */
+void page_copy_in(struct page_table* table, uint32_t offset, const uint8_t* in,
+    uint32_t size) {
+  struct page* page;
+  uint32_t count, index;
+
+  while (size > 0) {
+    index = offset >> PAGE_SHIFT;
+    count = PAGE_SZ - (offset & (PAGE_SZ - 1));
+    if (count > size)
+      count = size;
+    if (table->write[index] == NULL && count == PAGE_SZ &&
+        (page = malloc(sizeof(*page))) != NULL) {
+      SDL_AtomicSet(&page->users, 1);
+      page_release(table->pages[index]);
+      page_set(table, index, page, 1);
+    }
+    if (table->write[index] == NULL)
+      page_own(table, index);
+    memcpy(&table->write[index][offset & (PAGE_SZ - 1)], in, count);
+    offset += count;
+    in += count;
+    size -= count;
+  }
+}
+
+/* Pages still shared with a fork or a parent */
+uint32_t page_shared(const struct page_table* table) {
+  uint32_t i, count = 0;
+
+  for (i = 0; i < PAGE_COUNT; i++)
+    if (SDL_AtomicGet(&table->pages[i]->users) > 1)
+      count++;
+  return count;
+}
@@ -0,0 +1,297 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "psg.h"
+#include "z80.h"
+#include "machine.h"
+
+/* Band limited unit steps as impulses, each phase sums to 1 << 15 */
+static int16_t psg_blep[PSG_PHASES][PSG_TAPS];
+static int psg_blep_built;
+
+/* 2 dB per step, four channels at full volume still fit 16 bit */
+static const int16_t psg_volume[16] = {
+  6144, 4880, 3877, 3079, 2446, 1943, 1543, 1226,
+  974, 774, 614, 488, 388, 308, 245, 0
+};
+
+/***
+ * Blackman windowed sinc, cut off a little below Nyquist. The impulse of
+ * phase p sits p / PSG_PHASES of a sample after the middle tap. Rounding
+ * is corrected on the largest tap so a step always ends exactly at its
+ * height and the integrator does not drift.
+ */
+static void psg_build_blep(void) {
+  unsigned p, i, peak;
+  double d, x, w, taps[PSG_TAPS], total;
+  int sum;
+
+  for (p = 0; p < PSG_PHASES; p++) {
+    total = 0;
+    for (i = 0; i < PSG_TAPS; i++) {
+      d = (double)i - PSG_TAPS / 2 - (double)p / PSG_PHASES;
+      x = M_PI * 0.9 * d;
+      w = 0.42 + 0.5 * cos(M_PI * d / (PSG_TAPS / 2)) +
+          0.08 * cos(2 * M_PI * d / (PSG_TAPS / 2));
+      taps[i] = (x == 0 ? 1 : sin(x) / x) * (fabs(d) < PSG_TAPS / 2 ? w : 0);
+      total += taps[i];
+    }
+    sum = 0;
+    peak = 0;
+    for (i = 0; i < PSG_TAPS; i++) {
+      psg_blep[p][i] = (int16_t)lround(taps[i] / total * 32768);
+      sum += psg_blep[p][i];
+      if (psg_blep[p][i] > psg_blep[p][peak])
+        peak = i;
+    }
+    psg_blep[p][peak] += 32768 - sum;
+  }
+}
+
+/* Add a step of delta to one side at the given cycle */
+static void psg_add(uint8_t side, uint64_t when, int32_t delta) {
+  uint64_t pos = machine->psg.base_pos +
+      ((when - machine->psg.base_cycle) * machine->psg.factor >> 16);
+  uint32_t index = pos >> 16;
+  const int16_t* blep = psg_blep[(pos >> (16 - 5)) & (PSG_PHASES - 1)];
+  int32_t* out;
+  unsigned i;
+
+  /* A frame longer than the buffer loses its sound, not memory */
+  if (index >= PSG_BUFFER || machine->psg.silent)
+    return;
+  out = &machine->psg.buffer[side][index];
+  for (i = 0; i < PSG_TAPS; i++)
+    out[i] += delta * blep[i];
+  machine->psg.events++;
+}
+
+/* Bring what channel n adds to either side in line with its state */
+static void psg_update(uint8_t n, uint64_t when) {
+  struct psg_channel* ch = &machine->psg.channel[n];
+  int16_t amp, target;
+  uint8_t high, side;
+
+  if (n == 3)
+    high = machine->psg.lfsr & 1;
+  else
+    high = ch->output || ch->period < 2;
+  amp = high ? psg_volume[ch->volume] : 0;
+
+  /* Left enables are bits 4 - 7, right enables bits 0 - 3 */
+  for (side = 0; side < 2; side++) {
+    target = (machine->psg.stereo >> (n + (side ? 0 : 4))) & 1 ? amp : 0;
+    if (target != ch->amp[side]) {
+      psg_add(side, when, target - ch->amp[side]);
+      ch->amp[side] = target;
+    }
+  }
+}
+
+/* The noise shift register moves on every rising edge of its flip-flop */
+static void psg_noise_clock(uint64_t when) {
+  struct psg_channel* ch = &machine->psg.channel[3];
+  uint16_t lfsr = machine->psg.lfsr, feedback;
+
+  ch->output ^= 1;
+  if (!ch->output)
+    return;
+  if (ch->period & 4)
+    feedback = (lfsr ^ (lfsr >> 3)) & 1;
+  else
+    feedback = lfsr & 1;
+  machine->psg.lfsr = (lfsr >> 1) | (feedback << 15);
+  if ((lfsr ^ machine->psg.lfsr) & 1)
+    psg_update(3, when);
+}
+
+/***
+ * Run the channels up to the cycle. The counters count down at a 16th
+ * of the clock, so a tone toggles every period * 16 cycles. Periods
+ * below 2 hold the output high, games use that to play samples through
+ * the volume register.
+ */
+void psg_sync(uint64_t cycle) {
+  struct psg_channel* ch;
+  uint8_t n;
+
+  if (cycle <= machine->psg.time)
+    return;
+
+  for (n = 0; n < 3; n++) {
+    ch = &machine->psg.channel[n];
+    if (ch->period < 2) {
+      ch->next = cycle;
+      continue;
+    }
+    while (ch->next <= cycle) {
+      ch->output ^= 1;
+      psg_update(n, ch->next);
+      /* Noise rate 3 is clocked by the third tone channel */
+      if (n == 2 && (machine->psg.channel[3].period & 3) == 3)
+        psg_noise_clock(ch->next);
+      ch->next += ch->period * 16;
+    }
+  }
+
+  ch = &machine->psg.channel[3];
+  if ((ch->period & 3) != 3) {
+    while (ch->next <= cycle) {
+      psg_noise_clock(ch->next);
+      ch->next += (0x10 << (ch->period & 3)) * 16;
+    }
+  } else {
+    ch->next = cycle;
+  }
+
+  machine->psg.time = cycle;
+}
+
+/***
+ * Ports 0x40 - 0x7f. A byte with bit 7 set latches a channel and a
+ * register and writes the low 4 bits, a byte without writes the high 6
+ * bits of a tone period or the whole volume or noise register.
+ */
+void psg_write(uint8_t value) {
+  struct psg_channel* ch;
+  uint8_t n;
+  uint16_t period;
+
+  psg_sync(machine->z80.cycles);
+  if (value & 0x80)
+    machine->psg.latch = (value >> 4) & 7;
+  n = machine->psg.latch >> 1;
+  ch = &machine->psg.channel[n];
+
+  if (machine->psg.latch & 1) {
+    ch->volume = value & 0x0f;
+  } else if (n == 3) {
+    ch->period = value & 0x07;
+    machine->psg.lfsr = 0x8000;
+    if (ch->next < machine->psg.time)
+      ch->next = machine->psg.time;
+  } else {
+    period = ch->period;
+    if (value & 0x80)
+      ch->period = (ch->period & 0x3f0) | (value & 0x0f);
+    else
+      ch->period = (ch->period & 0x00f) | ((value & 0x3f) << 4);
+    /* A held channel starts counting again from now */
+    if (period < 2 && ch->period >= 2)
+      ch->next = machine->psg.time + ch->period * 16;
+  }
+  psg_update(n, machine->psg.time);
+}
+
+/* Port 0x06 */
+void psg_stereo_write(uint8_t value) {
+  uint8_t n;
+
+  psg_sync(machine->z80.cycles);
+  machine->psg.stereo = value;
+  for (n = 0; n < 4; n++)
+    psg_update(n, machine->psg.time);
+}
+
+/* Samples per cycle change, everything not read yet is dropped */
+void psg_set_rate(uint32_t rate) {
+  machine->psg.rate = rate;
+  machine->psg.factor = ((uint64_t)rate << 32) / Z80_CLOCK;
+  machine->psg.base_cycle = machine->psg.time;
+  machine->psg.base_pos = 0;
+  memset(machine->psg.buffer, 0, sizeof(machine->psg.buffer));
+  memset(machine->psg.sum, 0, sizeof(machine->psg.sum));
+}
+
+/* The channels jumped to another time, as on loading a state. Drop the
+ * deltas not played yet and continue from there. Run-ahead goes back to
+ * where the output stopped, then it continues without a gap */
+void psg_reset_output(void) {
+  if (machine->psg.base_cycle == machine->psg.time)
+    return;
+  machine->psg.base_cycle = machine->psg.time;
+  machine->psg.base_pos = 0;
+  memset(machine->psg.buffer, 0, sizeof(machine->psg.buffer));
+}
+
+/* Stretch the output by ratio for rate control, keeping what is buffered */
+void psg_set_ratio(double ratio) {
+  machine->psg.factor = (uint64_t)((double)((uint64_t)machine->psg.rate << 32) /
+      Z80_CLOCK * ratio);
+}
+
+/***
+ * Catch up to the cycle and integrate the deltas into samples. Writes
+ * interleaved left and right samples to out, which has to hold
+ * PSG_BUFFER of each, and returns how many pairs it wrote. The deltas
+ * past the last whole sample stay for the next frame.
+ */
+unsigned psg_end_frame(uint64_t cycle, int16_t* out) {
+  uint64_t pos;
+  unsigned count, i;
+  uint8_t side;
+  int32_t sample;
+
+  psg_sync(cycle);
+  pos = machine->psg.base_pos + ((cycle - machine->psg.base_cycle) * machine->psg.factor >> 16);
+  count = pos >> 16;
+  if (count > PSG_BUFFER)
+    count = PSG_BUFFER;
+
+  for (side = 0; side < 2; side++) {
+    for (i = 0; i < count; i++) {
+      machine->psg.sum[side] += machine->psg.buffer[side][i];
+      sample = machine->psg.sum[side] >> 15;
+      out[i * 2 + side] = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+      machine->psg.sum[side] -= machine->psg.sum[side] >> PSG_BASS_SHIFT;
+    }
+    memmove(machine->psg.buffer[side], machine->psg.buffer[side] + count,
+        (PSG_BUFFER + PSG_TAPS - count) * sizeof(int32_t));
+    memset(machine->psg.buffer[side] + PSG_BUFFER + PSG_TAPS - count, 0,
+        count * sizeof(int32_t));
+  }
+
+  machine->psg.base_cycle = cycle;
+  machine->psg.base_pos = pos & 0xffff;
+  machine->psg.total_events += machine->psg.events;
+  machine->psg.events = 0;
+  return count;
+}
+
+void psg_init(void) {
+  uint8_t n;
+
+  memset(&machine->psg, 0, sizeof(machine->psg));
+  if (!psg_blep_built) {
+    psg_build_blep();
+    psg_blep_built = 1;
+  }
+  for (n = 0; n < 4; n++)
+    machine->psg.channel[n].volume = 0x0f;
+  machine->psg.lfsr = 0x8000;
+  machine->psg.stereo = 0xff;
+  machine->psg.time = machine->z80.cycles;
+  psg_set_rate(PSG_RATE);
+}
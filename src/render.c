@@ -0,0 +1,810 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "render.h"
+#include "tile_decode.h"
+#include "machine.h"
+
+/* Decode every tile written since the last line was drawn */
+static void render_update_tiles(void) {
+  struct render_cache* cache = machine->render.cache;
+  uint16_t tile;
+
+  while (cache->dirty_count > 0) {
+    tile = cache->dirty_list[--cache->dirty_count];
+    cache->dirty[tile] = 0;
+    tile_decode(&cache->view.vram[tile * 32], cache->tiles[tile][0], cache->tiles[tile][1], 8);
+  }
+}
+
+/* Height of a sprite on screen with the given registers, zoom doubles it */
+static uint8_t render_sprite_height(const uint8_t* regs) {
+  return ((regs[1] & 0x02) ? 16 : 8) << (regs[1] & 0x01);
+}
+
+/* Add or remove a sprite from the lists of the lines it covers */
+static void render_sprite_lines(struct render_sprites* sprites, uint8_t n, uint8_t y,
+    int add) {
+  uint64_t bit = 1ULL << n;
+  uint16_t i;
+  uint8_t line;
+
+  for (i = 1; i <= sprites->height; i++) {
+    line = y + i;
+    if (add)
+      sprites->lines[line] |= bit;
+    else
+      sprites->lines[line] &= ~bit;
+  }
+}
+
+/* Index of the first sprite with Y = 0xd0, which ends the list in 192 line
+ * mode; changed is the Y about to be written for sprite n */
+static uint8_t render_sprite_end(const uint8_t* sat, uint8_t n, uint8_t changed) {
+  uint8_t i;
+
+  for (i = 0; i < 64; i++)
+    if ((i == n ? changed : sat[i]) == 0xd0)
+      break;
+  return i;
+}
+
+/* Build the lists from scratch for the registers and the SAT they point to */
+static void render_sprites_build(struct render_sprites* sprites, const uint8_t* regs,
+    const uint8_t* sat) {
+  uint8_t n;
+
+  sprites->base = (regs[5] & 0x7e) << 7;
+  sprites->height = render_sprite_height(regs);
+  memset(sprites->lines, 0, sizeof(sprites->lines));
+  for (n = 0; n < 64; n++)
+    render_sprite_lines(sprites, n, sat[n], 1);
+  sprites->end = render_sprite_end(sat, 0, sat[0]);
+}
+
+/* The lists are only valid for the SAT address and sprite size they were
+ * built with */
+static int render_sprites_valid(const struct render_sprites* sprites, const uint8_t* regs) {
+  return sprites->base == ((regs[5] & 0x7e) << 7) &&
+      sprites->height == render_sprite_height(regs);
+}
+
+/* Sprite n gets the given Y, sat is the table before the write */
+static void render_sprites_move(struct render_sprites* sprites, const uint8_t* sat,
+    uint8_t n, uint8_t y) {
+  render_sprite_lines(sprites, n, sat[n], 0);
+  render_sprite_lines(sprites, n, y, 1);
+  if (sat[n] == 0xd0 || y == 0xd0)
+    sprites->end = render_sprite_end(sat, n, y);
+}
+
+/* Sprites on a line in SAT order, see render_sprite_list() */
+static uint8_t render_sprites_on(const struct render_sprites* sprites, uint16_t line,
+    uint8_t* list) {
+  uint64_t mask = sprites->lines[line & 0xff];
+  uint8_t count = 0;
+
+  /* Sprites from the terminator on are not displayed */
+  if (sprites->end < 64)
+    mask &= (1ULL << sprites->end) - 1;
+
+  while (mask) {
+    if (count == 8)
+      return 9;
+    list[count++] = __builtin_ctzll(mask);
+    mask &= mask - 1;
+  }
+  return count;
+}
+
+/***
+ * Build the per-line sprite lists of the view from scratch. Needed
+ * whenever VRAM was replaced as a whole, and when the SAT moves or the
+ * sprite size changes.
+ */
+void render_sprite_rebuild(void) {
+  struct render_cache* cache = machine->render.cache;
+
+  render_sprites_build(&cache->sprites, cache->view.regs,
+      &cache->view.vram[(cache->view.regs[5] & 0x7e) << 7]);
+}
+
+static void render_sprite_check(void) {
+  struct render_cache* cache = machine->render.cache;
+
+  if (!render_sprites_valid(&cache->sprites, cache->view.regs))
+    render_sprite_rebuild();
+}
+
+/***
+ * Find the sprites of the view on a line in SAT order. Returns their
+ * number, 9 means more than 8 sprites were found and only the first 8 are
+ * listed.
+ */
+uint8_t render_sprite_list(uint16_t line, uint8_t* list) {
+  return render_sprites_on(&machine->render.cache->sprites, line, list);
+}
+
+/* Tile of a sprite on the given line and the row inside of it */
+uint16_t render_sprite_tile(uint16_t line, uint8_t n, uint8_t* row) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* sat = &cache->view.vram[(cache->view.regs[5] & 0x7e) << 7];
+  uint16_t tile = ((cache->view.regs[6] & 0x04) << 6) | sat[0x81 + 2 * n];
+
+  *row = (uint8_t)(line - sat[n] - 1) >> (cache->view.regs[1] & 0x01);
+  if (cache->view.regs[1] & 0x02)
+    tile = (tile & ~1) + (*row >> 3);
+  return tile & (RENDER_TILES - 1);
+}
+
+/* Registers a line depends on, packed for a quick compare */
+static uint64_t render_line_regs(void) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+
+  return (uint64_t)regs[0] | ((uint64_t)regs[1] << 8) | ((uint64_t)regs[2] << 16) |
+      ((uint64_t)regs[5] << 24) | ((uint64_t)regs[6] << 32) | ((uint64_t)regs[7] << 40) |
+      ((uint64_t)regs[8] << 48) | ((uint64_t)cache->view.vscroll << 56);
+}
+
+/* Check if nothing a line was drawn from changed since */
+static int render_line_clean(uint16_t line) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  uint16_t index = line - RENDER_GG_Y;
+  uint32_t drawn = cache->line_stamp[index];
+  uint16_t name = (regs[2] & 0x0e) << 10;
+  uint16_t row, block, addr, entry;
+  uint8_t list[8], count, col, first, k, pass, sprite_row;
+
+  if (!drawn || cache->line_regs[index] != render_line_regs() ||
+      cache->cram_stamp > drawn)
+    return 0;
+  /* Blanked lines only depend on the backdrop colour */
+  if (!(regs[1] & 0x40))
+    return 1;
+  if (cache->sprite_stamp[index] > drawn)
+    return 0;
+
+  /* Every column from the scrolled row, and with R0 bit 7 the columns
+   * shown at screen x 192 - 255 from the line itself, see render_fast.c */
+  row = (line + cache->view.vscroll) % 224;
+  first = 0;
+  count = 32;
+  for (pass = 0; pass < 2; pass++) {
+    block = (name >> 6) + (row >> 3);
+    if (cache->vram_stamp[block] > drawn)
+      return 0;
+    for (k = 0; k < count; k++) {
+      col = (first + k) & 31;
+      addr = (block << 6) + (col << 1);
+      entry = cache->view.vram[addr] | (cache->view.vram[addr + 1] << 8);
+      if (cache->tile_stamp[entry & 0x1ff] > drawn)
+        return 0;
+    }
+    if (!(regs[0] & 0x80))
+      break;
+    row = line;
+    first = (uint8_t)(192 - (((regs[0] & 0x40) && line < 16) ? 0 : regs[8])) >> 3;
+    count = 9;
+  }
+
+  count = render_sprite_list(line, list);
+  for (k = 0; k < count && k < 8; k++)
+    if (cache->tile_stamp[render_sprite_tile(line, list[k], &sprite_row)] > drawn)
+      return 0;
+  return 1;
+}
+
+/***
+ * Draw the screen pixels [from, to) of a line. Per line backends are only
+ * called for whole lines and skip lines nothing changed for.
+ */
+static void render_line(uint16_t line, uint16_t from, uint16_t to) {
+  struct render_cache* cache = machine->render.cache;
+  uint16_t index = line - RENDER_GG_Y;
+
+  if (!machine->render.backend->per_pixel && render_line_clean(line)) {
+    machine->render.lines_skipped++;
+    return;
+  }
+
+  machine->render.backend->draw(line, from, to, cache->framebuffer[index]);
+
+  cache->line_stamp[index] = cache->stamp;
+  cache->line_regs[index] = render_line_regs();
+  if (index < cache->frame_top)
+    cache->frame_top = index;
+  cache->frame_bottom = index + 1;
+  if (to == 256)
+    machine->render.lines_drawn++;
+}
+
+/* Mark the window lines a sprite at the given Y covers */
+static void render_mark_sprite(uint8_t y) {
+  struct render_cache* cache = machine->render.cache;
+  uint8_t height = render_sprite_height(cache->view.regs);
+  uint16_t i;
+  uint8_t line;
+
+  for (i = 1; i <= height; i++) {
+    line = y + i;
+    if (line >= RENDER_GG_Y && line < RENDER_GG_Y + GG_HEIGHT)
+      cache->sprite_stamp[line - RENDER_GG_Y] = cache->stamp;
+  }
+}
+
+/***
+ * Called before a byte of the sprite attribute table changes. A Y write
+ * affects the lines of the old and the new position, X and tile writes the
+ * lines the sprite is on. Moving the 0xd0 terminator shows or hides all
+ * sprites after it. Y writes also move the sprite between the line lists.
+ */
+static void render_sat_write(uint8_t offset, uint8_t value) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* sat = &cache->view.vram[(cache->view.regs[5] & 0x7e) << 7];
+  uint16_t i;
+
+  if (offset < 64) {
+    render_sprite_check();
+    render_sprites_move(&cache->sprites, sat, offset, value);
+    if (sat[offset] == 0xd0 || value == 0xd0) {
+      for (i = 0; i < GG_HEIGHT; i++)
+        cache->sprite_stamp[i] = cache->stamp;
+      return;
+    }
+    render_mark_sprite(sat[offset]);
+    render_mark_sprite(value);
+  } else if (offset >= 0x80) {
+    render_mark_sprite(sat[(offset - 0x80) >> 1]);
+  }
+}
+
+/***
+ * Called before a byte of VRAM is written. The tile is queued for decoding
+ * and stamped together with its 64 byte block.
+ */
+static void render_vram_write(uint16_t addr, uint8_t value) {
+  struct render_cache* cache = machine->render.cache;
+  uint16_t tile = (addr >> 5) & (RENDER_TILES - 1);
+
+  if (cache->view.vram[addr] == value)
+    return;
+
+  cache->tile_stamp[tile] = cache->stamp;
+  cache->vram_stamp[addr >> 6] = cache->stamp;
+  if ((addr >> 8) == ((cache->view.regs[5] & 0x7e) >> 1))
+    render_sat_write(addr & 0xff, value);
+
+  if (!cache->dirty[tile]) {
+    cache->dirty[tile] = 1;
+    cache->dirty_list[cache->dirty_count++] = tile;
+  }
+  cache->view.vram[addr] = value;
+}
+
+/***
+ * Draw the Game Gear window up to the given line and dot, with the
+ * registers and VRAM of the view as they are now. Only per pixel backends
+ * draw parts of a line.
+ */
+static void render_sync(uint16_t line, uint16_t dot) {
+  struct render_cache* cache = machine->render.cache;
+
+  if (line >= RENDER_GG_Y + GG_HEIGHT) {
+    line = RENDER_GG_Y + GG_HEIGHT;
+    dot = 0;
+  }
+  if (!machine->render.backend->per_pixel)
+    dot = 0;
+  else if (dot > 256)
+    dot = 256;
+  if (line < cache->line || (line == cache->line && dot <= cache->dot))
+    return;
+
+  render_update_tiles();
+  render_sprite_check();
+  for (; cache->line < line; cache->line++) {
+    render_line(cache->line, cache->dot, 256);
+    cache->dot = 0;
+  }
+  if (dot > 0) {
+    render_line(line, cache->dot, dot);
+    cache->dot = dot;
+  }
+  /* Writes from now on are newer than the lines just drawn */
+  cache->stamp++;
+}
+
+static void render_frame_start(void) {
+  struct render_cache* cache = machine->render.cache;
+
+  /* Tell the presentation which rows of the finished frame changed */
+  cache->update_top = cache->frame_top;
+  cache->update_bottom = cache->frame_bottom;
+  if (cache->update_top >= cache->update_bottom)
+    machine->render.frames_unchanged++;
+
+  cache->frame_top = GG_HEIGHT;
+  cache->frame_bottom = 0;
+  /* Lines above the Game Gear window are never visible */
+  cache->line = RENDER_GG_Y;
+  cache->dot = 0;
+}
+
+/***
+ * Play one VDP write into the view: all lines before the one the write
+ * happened on are drawn first, so every line sees the registers and VRAM
+ * it had on the real hardware. Runs on the CPU thread in synchronous mode
+ * and on the worker in pipelined mode, which is why both give the same
+ * picture.
+ */
+static void render_apply(const struct render_event* event) {
+  struct render_cache* cache = machine->render.cache;
+  uint8_t index;
+
+  render_sync(event->line, event->dot);
+  switch (event->type) {
+  case RENDER_VRAM:
+    render_vram_write(event->addr, event->value);
+    break;
+  case RENDER_CRAM:
+    /* Colours are looked up when a pixel is drawn, lines drawn before
+     * the change have to be drawn again */
+    index = event->addr;
+    cache->view.cram[index * 2] = event->value & 0xff;
+    cache->view.cram[index * 2 + 1] = event->value >> 8;
+    if (cache->view.colors[index] != event->value)
+      cache->cram_stamp = cache->stamp;
+    cache->view.colors[index] = event->value;
+    break;
+  case RENDER_REG:
+    cache->view.regs[event->addr] = event->value;
+    break;
+  case RENDER_FRAME_END:
+    render_sync(VDP_ACTIVE_LINES, 0);
+    render_frame_start();
+    cache->view.vscroll = cache->view.regs[9];
+    break;
+  }
+}
+
+/***
+ * Pipelined rendering: the CPU thread logs the VDP writes of a frame with
+ * the line they happened on. At the end of the frame the log goes to the
+ * worker, which plays it into the view and draws the frame while the CPU
+ * emulates the next one. Logs are double buffered.
+ */
+struct render_log {
+  struct render_event* events;
+  uint32_t count;
+  uint32_t size;
+};
+
+struct render_pipe {
+  struct render_log logs[2];
+  /* Log the CPU thread appends to */
+  int current;
+  /* Events in the current log up to the last frame end */
+  uint32_t frame_events;
+  int busy;
+  int quit;
+  SDL_Thread* thread;
+  SDL_sem* start;
+  SDL_sem* done;
+};
+
+static void render_log_append(struct render_log* log, const struct render_event* event) {
+  if (log->count == log->size) {
+    log->size = log->size ? log->size * 2 : 4096;
+    log->events = realloc(log->events, log->size * sizeof(*log->events));
+    if (log->events == NULL) {
+      printf("Could not grow the VDP log\n");
+      exit(1);
+    }
+  }
+  log->events[log->count++] = *event;
+}
+
+/* Draws for the machine it is given */
+static int render_worker(void* data) {
+  struct render_pipe* pipe;
+  struct render_log* log;
+  uint32_t i;
+
+  gg_machine_select(data);
+  pipe = machine->render.pipe;
+  for (;;) {
+    SDL_SemWait(pipe->start);
+    if (pipe->quit)
+      break;
+    log = &pipe->logs[pipe->current ^ 1];
+    for (i = 0; i < log->count; i++)
+      render_apply(&log->events[i]);
+    log->count = 0;
+    SDL_SemPost(pipe->done);
+  }
+  return 0;
+}
+
+/* Wait until the worker finished the frame it was given */
+static void render_wait(void) {
+  struct render_pipe* pipe = machine->render.pipe;
+
+  if (pipe != NULL && pipe->busy) {
+    SDL_SemWait(pipe->done);
+    pipe->busy = 0;
+  }
+}
+
+/* Lists of the live SAT, rebuilt when it moved or the sprite size changed */
+static struct render_sprites* render_live_sprites(void) {
+  struct render_sprites* sprites = &machine->render.sprites;
+  const uint8_t* regs = machine->vdp.regs;
+
+  if (!render_sprites_valid(sprites, regs))
+    render_sprites_build(sprites, regs,
+        page_data(&machine->pages, PAGE_VRAM + ((regs[5] & 0x7e) << 7)));
+  return sprites;
+}
+
+/***
+ * Sprite overflow and collision of a line, from the live SAT and VRAM.
+ * Only lines with two or more sprites can collide, the pixels are looked
+ * at for those alone.
+ */
+static uint8_t render_line_flags(const struct render_sprites* sprites, uint16_t line) {
+  const uint8_t* regs = machine->vdp.regs;
+  const uint8_t* sat = page_data(&machine->pages, PAGE_VRAM + sprites->base);
+  uint8_t zoom = regs[1] & 0x01;
+  uint8_t drawn[256];
+  const uint8_t* pattern;
+  uint8_t list[8], count, k, n, row, opaque, status = 0;
+  uint16_t tile, i;
+  int16_t x, px;
+
+  count = render_sprites_on(sprites, line, list);
+  if (count > 8) {
+    status |= VDP_STATUS_OVERFLOW;
+    count = 8;
+  }
+  if (count < 2)
+    return status;
+
+  memset(drawn, 0, sizeof(drawn));
+  for (k = 0; k < count; k++) {
+    n = list[k];
+    row = (uint8_t)(line - sat[n] - 1) >> zoom;
+    x = sat[0x80 + 2 * n] - ((regs[0] & 0x08) ? 8 : 0);
+    tile = ((regs[6] & 0x04) << 6) | sat[0x81 + 2 * n];
+    if (regs[1] & 0x02)
+      tile = (tile & ~1) + (row >> 3);
+    /* A pixel is opaque if any of its bitplanes is set */
+    pattern = page_data(&machine->pages,
+        PAGE_VRAM + (tile & (RENDER_TILES - 1)) * 32 + (row & 7) * 4);
+    opaque = pattern[0] | pattern[1] | pattern[2] | pattern[3];
+
+    for (i = 0; i < (8u << zoom); i++) {
+      px = x + i;
+      if (px < 0 || px > 255 || !(opaque & (0x80 >> (i >> zoom))))
+        continue;
+      /* Overlapping opaque pixels collide */
+      if (drawn[px])
+        status |= VDP_STATUS_COLLISION;
+      drawn[px] = 1;
+    }
+  }
+  return status;
+}
+
+/***
+ * Raise the sprite flags of the active lines before the given line. The
+ * CPU can read them mid-frame, so they are evaluated on the CPU thread
+ * from the live state in both modes, before every VDP write, also when
+ * frames are not drawn: games act on them. All 192 lines raise them, not
+ * just the ones in the Game Gear window.
+ */
+void render_flags_sync(uint16_t line) {
+  const struct render_sprites* sprites;
+
+  if (line > VDP_ACTIVE_LINES)
+    line = VDP_ACTIVE_LINES;
+  if (machine->render.flags_line >= line)
+    return;
+  /* A blank display shows no sprites */
+  if (!(machine->vdp.regs[1] & 0x40)) {
+    machine->render.flags_line = line;
+    return;
+  }
+  sprites = render_live_sprites();
+  for (; machine->render.flags_line < line; machine->render.flags_line++)
+    machine->vdp.status |= render_line_flags(sprites, machine->render.flags_line);
+}
+
+/* Keep the live sprite lists up to date, before a VDP write changes VRAM */
+static void render_live_write(uint16_t addr, uint8_t value) {
+  struct render_sprites* sprites = render_live_sprites();
+
+  if ((addr & 0x3f00) == sprites->base && (addr & 0xff) < 64)
+    render_sprites_move(sprites, page_data(&machine->pages, PAGE_VRAM + sprites->base),
+        addr & 0xff, value);
+}
+
+/***
+ * Set up the caches from scratch, from the live VDP state. They are only
+ * allocated once the machine draws, silent machines never need them.
+ * Returns -1 if there is no memory for them.
+ */
+static int render_setup(void) {
+  if (machine->render.cache == NULL) {
+    machine->render.cache = malloc(sizeof(*machine->render.cache));
+    if (machine->render.cache == NULL) {
+      printf("Could not allocate the renderer\n");
+      return -1;
+    }
+  }
+  memset(machine->render.cache, 0, sizeof(*machine->render.cache));
+  machine->render.cache->stamp = 1;
+  render_invalidate();
+  render_frame_start();
+  return 0;
+}
+
+/* Whether frames are drawn, the caches are set up on the first one */
+static int render_drawing(void) {
+  if (machine->render.silent)
+    return 0;
+  return machine->render.cache != NULL || render_setup() == 0;
+}
+
+/* Hand a VDP write to the renderer, before it changes the live state */
+void render_write(uint8_t type, uint16_t addr, uint16_t value) {
+  struct render_pipe* pipe = machine->render.pipe;
+  struct render_event event;
+
+  /* Rewriting VRAM with the same value changes nothing on screen */
+  if (type == RENDER_VRAM && page_read(&machine->pages, PAGE_VRAM + addr) == value)
+    return;
+
+  event.line = vdp_current_line();
+  event.dot = vdp_current_dot();
+  render_flags_sync(event.line);
+  if (type == RENDER_VRAM)
+    render_live_write(addr, value);
+  if (!render_drawing())
+    return;
+  event.type = type;
+  event.addr = addr;
+  event.value = value;
+  if (pipe != NULL)
+    render_log_append(&pipe->logs[pipe->current], &event);
+  else
+    render_apply(&event);
+}
+
+/* The VDP finished a frame */
+void render_frame_end(void) {
+  struct render_event event = { 0, 0, RENDER_FRAME_END, VDP_ACTIVE_LINES, 0 };
+  struct render_pipe* pipe = machine->render.pipe;
+
+  render_flags_sync(VDP_ACTIVE_LINES);
+  machine->render.flags_line = 0;
+
+  if (!render_drawing())
+    return;
+  if (pipe != NULL) {
+    render_log_append(&pipe->logs[pipe->current], &event);
+    pipe->frame_events = pipe->logs[pipe->current].count;
+  } else {
+    render_apply(&event);
+  }
+}
+
+/***
+ * Wait for the last frame to be finished. Between this and
+ * render_frame_release() the framebuffer, the update rows and the view
+ * can be read by the presentation.
+ */
+void render_frame_acquire(void) {
+  render_wait();
+}
+
+/***
+ * Give the frames emulated since the last call to the worker. Writes that
+ * already belong to the next frame stay in the log.
+ */
+void render_frame_release(void) {
+  struct render_pipe* pipe = machine->render.pipe;
+  struct render_log* log;
+  struct render_log* next;
+  uint32_t i;
+
+  if (pipe == NULL || !pipe->frame_events)
+    return;
+
+  render_wait();
+  log = &pipe->logs[pipe->current];
+  next = &pipe->logs[pipe->current ^ 1];
+  next->count = 0;
+  for (i = pipe->frame_events; i < log->count; i++)
+    render_log_append(next, &log->events[i]);
+  log->count = pipe->frame_events;
+  pipe->frame_events = 0;
+
+  pipe->current ^= 1;
+  pipe->busy = 1;
+  SDL_SemPost(pipe->start);
+}
+
+/***
+ * Switch between drawing on the CPU thread and on the worker. Turning the
+ * worker off plays the writes it did not get yet on the CPU thread.
+ */
+void render_set_pipelined(int enabled) {
+  struct render_pipe* pipe = machine->render.pipe;
+  struct render_log* log;
+  uint32_t i;
+
+  if (enabled == (pipe != NULL))
+    return;
+
+  if (enabled) {
+    /* Without a worker frames are drawn on this thread as before */
+    pipe = calloc(1, sizeof(*pipe));
+    if (pipe == NULL) {
+      printf("Could not allocate the VDP worker\n");
+      return;
+    }
+    pipe->start = SDL_CreateSemaphore(0);
+    pipe->done = SDL_CreateSemaphore(0);
+    machine->render.pipe = pipe;
+    if (pipe->start != NULL && pipe->done != NULL)
+      pipe->thread = SDL_CreateThread(render_worker, "vdp", machine);
+    if (pipe->thread == NULL) {
+      printf("%s\n", SDL_GetError());
+      if (pipe->start != NULL)
+        SDL_DestroySemaphore(pipe->start);
+      if (pipe->done != NULL)
+        SDL_DestroySemaphore(pipe->done);
+      free(pipe);
+      machine->render.pipe = NULL;
+    }
+    return;
+  }
+
+  render_wait();
+  pipe->quit = 1;
+  SDL_SemPost(pipe->start);
+  SDL_WaitThread(pipe->thread, NULL);
+  SDL_DestroySemaphore(pipe->start);
+  SDL_DestroySemaphore(pipe->done);
+  machine->render.pipe = NULL;
+
+  log = &pipe->logs[pipe->current];
+  for (i = 0; i < log->count; i++)
+    render_apply(&log->events[i]);
+  free(pipe->logs[0].events);
+  free(pipe->logs[1].events);
+  free(pipe);
+}
+
+/* Free the caches of the current machine, they are set up again if needed */
+void render_destroy(void) {
+  render_set_pipelined(0);
+  free(machine->render.cache);
+  machine->render.cache = NULL;
+}
+
+/***
+ * Emulate frames without drawing them, e.g. frames that are run ahead or
+ * replayed and never shown. The status flags are still raised, they can
+ * change what the game does. Turning drawing back on starts over from the
+ * live state, so only switch between frames.
+ */
+void render_set_silent(int silent) {
+  if (silent == machine->render.silent)
+    return;
+  machine->render.silent = silent;
+  if (!silent)
+    render_invalidate();
+}
+
+/***
+ * Pick the backend that draws the lines. Like the pipelined mode this is
+ * meant to be chosen at startup, the next frame is drawn in full.
+ */
+void render_set_backend(const struct render_backend* backend) {
+  struct render_cache* cache = machine->render.cache;
+
+  render_wait();
+  machine->render.backend = backend;
+  if (machine->render.cache != NULL)
+    memset(cache->line_stamp, 0, sizeof(cache->line_stamp));
+}
+
+/* Backend with the given name, NULL if there is none */
+const struct render_backend* render_find_backend(const char* name) {
+  if (!strcmp(name, render_fast.name))
+    return &render_fast;
+  if (!strcmp(name, render_accurate.name))
+    return &render_accurate;
+  return NULL;
+}
+
+void render_init(void) {
+  tile_decode_init();
+  machine->render.pipe = NULL;
+  machine->render.backend = &render_fast;
+  machine->render.silent = 0;
+  machine->render.lines_drawn = 0;
+  machine->render.lines_skipped = 0;
+  machine->render.frames_unchanged = 0;
+  machine->render.sprites.height = 0;
+  machine->render.flags_line = 0;
+  /* A machine powered on again starts over, a new one draws nothing yet */
+  if (machine->render.cache != NULL)
+    render_setup();
+}
+
+/***
+ * Start over from the live VDP state, e.g. after VRAM was replaced as a
+ * whole: all tiles are decoded and every line is drawn again. Writes the
+ * worker did not get yet are dropped, they are part of the old state.
+ * A silent machine only starts over once it draws again.
+ */
+void render_invalidate(void) {
+  struct render_cache* cache = machine->render.cache;
+  uint16_t tile, i;
+
+  render_wait();
+  if (machine->render.pipe != NULL) {
+    machine->render.pipe->logs[machine->render.pipe->current].count = 0;
+    machine->render.pipe->frame_events = 0;
+  }
+  machine->render.flags_line = 0;
+  machine->render.sprites.height = 0;
+  if (machine->render.silent || cache == NULL)
+    return;
+
+  page_copy_out(&machine->pages, PAGE_VRAM, cache->view.vram, VRAM_SZ);
+  memcpy(cache->view.cram, machine->vdp.cram, CRAM_SZ);
+  for (i = 0; i < CRAM_SZ / 2; i++)
+    cache->view.colors[i] = machine->vdp.cram[i * 2] |
+        (machine->vdp.cram[i * 2 + 1] & 0x0f) << 8;
+  memcpy(cache->view.regs, machine->vdp.regs, sizeof(cache->view.regs));
+  cache->view.vscroll = machine->vdp.vscroll;
+
+  cache->dirty_count = 0;
+  for (tile = 0; tile < RENDER_TILES; tile++) {
+    cache->dirty[tile] = 1;
+    cache->dirty_list[cache->dirty_count++] = tile;
+  }
+  memset(cache->line_stamp, 0, sizeof(cache->line_stamp));
+  render_sprite_rebuild();
+}
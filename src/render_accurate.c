@@ -0,0 +1,139 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "render.h"
+#include "machine.h"
+
+/***
+ * Per pixel renderer: every pixel is fetched with the registers, VRAM and
+ * CRAM of the dot it is displayed on, so writes in the middle of a line
+ * change the picture from that dot on. The sprites of a line are chosen
+ * when it starts, as the VDP evaluates them during the line before.
+ */
+
+static void render_accurate_evaluate(uint16_t line) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  const uint8_t* sat = &cache->view.vram[(regs[5] & 0x7e) << 7];
+  uint8_t list[8];
+  uint8_t k, count;
+
+  count = render_sprite_list(line, list);
+  if (count > 8)
+    count = 8;
+  for (k = 0; k < count; k++) {
+    cache->line_sprites.x[k] = sat[0x80 + 2 * list[k]] - ((regs[0] & 0x08) ? 8 : 0);
+    cache->line_sprites.tile[k] = render_sprite_tile(line, list[k],
+        &cache->line_sprites.row[k]);
+  }
+  cache->line_sprites.count = count;
+}
+
+/* Background pixel at screen x, the priority bit goes to prio */
+static uint8_t render_accurate_background(uint16_t line, uint16_t x, uint8_t* prio) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  uint16_t name = (regs[2] & 0x0e) << 10;
+  uint8_t hscroll = ((regs[0] & 0x40) && line < 16) ? 0 : regs[8];
+  uint8_t column = (x - hscroll) & 0xff;
+  uint16_t row, addr, entry;
+  uint8_t fine;
+
+  /* The rightmost 8 columns of the screen ignore the vertical scroll if
+   * R0 bit 7 is set */
+  if (x >= 192 && (regs[0] & 0x80))
+    row = line;
+  else
+    row = (line + cache->view.vscroll) % 224;
+
+  addr = name + ((row >> 3) << 6) + ((column >> 3) << 1);
+  entry = cache->view.vram[addr] | (cache->view.vram[addr + 1] << 8);
+
+  fine = row & 7;
+  if (entry & 0x400)
+    fine = 7 - fine;
+
+  *prio = (entry >> 12) & 1;
+  return cache->tiles[entry & 0x1ff][(entry >> 9) & 1][fine * 8 + (column & 7)] |
+      ((entry & 0x800) ? 0x10 : 0);
+}
+
+/* First opaque sprite pixel at screen x, 0 if there is none */
+static uint8_t render_accurate_sprite(uint16_t x) {
+  struct render_cache* cache = machine->render.cache;
+  uint8_t zoom = cache->view.regs[1] & 0x01;
+  uint8_t k, color;
+  int16_t offset;
+
+  for (k = 0; k < cache->line_sprites.count; k++) {
+    offset = x - cache->line_sprites.x[k];
+    if (offset < 0 || offset >= (8 << zoom))
+      continue;
+    color = cache->tiles[cache->line_sprites.tile[k]][0]
+        [(cache->line_sprites.row[k] & 7) * 8 + (offset >> zoom)];
+    if (color)
+      return color | 0x10;
+  }
+  return 0;
+}
+
+static void render_accurate_draw(uint16_t line, uint16_t from, uint16_t to, uint16_t* out) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  const uint16_t* colors = cache->view.colors;
+  uint8_t pixel, sprite, prio;
+  uint16_t x;
+
+  if (from == 0)
+    render_accurate_evaluate(line);
+
+  /* Only the Game Gear window is kept */
+  if (from < RENDER_GG_X)
+    from = RENDER_GG_X;
+  if (to > RENDER_GG_X + GG_WIDTH)
+    to = RENDER_GG_X + GG_WIDTH;
+
+  for (x = from; x < to; x++) {
+    /* Blanked display shows the backdrop colour */
+    if (!(regs[1] & 0x40)) {
+      out[x - RENDER_GG_X] = colors[0x10 | (regs[7] & 0x0f)];
+      continue;
+    }
+
+    pixel = render_accurate_background(line, x, &prio);
+    sprite = render_accurate_sprite(x);
+    /* High priority background pixels cover sprites unless transparent */
+    if (sprite && !(prio && (pixel & 0x0f)))
+      pixel = sprite;
+    out[x - RENDER_GG_X] = colors[pixel];
+  }
+}
+
+const struct render_backend render_accurate = {
+  "accurate",
+  1,
+  render_accurate_draw
+};
@@ -0,0 +1,170 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "render.h"
+#include "machine.h"
+
+/***
+ * Per line renderer: every line is drawn in one go with the registers and
+ * VRAM as they are at the start of the next line. Background tile rows are
+ * copied 8 pixels at a time, sprites come from the per-line lists.
+ */
+
+/***
+ * Draw count name table columns from first on, all from the same tile
+ * row, to their screen position in buf. Columns that straddle the right
+ * edge spill into the 8 pixels of slack.
+ */
+static void render_columns(uint16_t row, uint8_t hscroll, uint8_t first, uint8_t count,
+    uint8_t* buf, uint8_t* prio) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  uint16_t name = (regs[2] & 0x0e) << 10;
+  uint16_t addr, entry;
+  uint8_t col, sx, fine, i;
+  uint64_t pixels, palette;
+
+  for (i = 0; i < count; i++) {
+    col = (first + i) & 31;
+    addr = name + ((row >> 3) << 6) + (col << 1);
+    entry = cache->view.vram[addr] | (cache->view.vram[addr + 1] << 8);
+
+    fine = row & 7;
+    if (entry & 0x400)
+      fine = 7 - fine;
+
+    /* Copy a whole tile row and select the sprite palette in one go */
+    memcpy(&pixels, &cache->tiles[entry & 0x1ff][(entry >> 9) & 1][fine * 8], 8);
+    palette = (entry & 0x800) ? 0x1010101010101010ULL : 0;
+    pixels |= palette;
+
+    sx = col * 8 + hscroll;
+    memcpy(buf + sx, &pixels, 8);
+    memset(prio + sx, (entry >> 12) & 1, 8);
+  }
+}
+
+/***
+ * Draw the background of one line into buf (256 pixels plus 8 pixels of
+ * slack for the column that straddles the right edge). prio receives the
+ * priority bit of the name table entry for every pixel.
+ */
+static void render_background(uint16_t line, uint8_t* buf, uint8_t* prio) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  uint8_t hscroll = ((regs[0] & 0x40) && line < 16) ? 0 : regs[8];
+  uint8_t locked[256 + 8];
+  uint8_t locked_prio[256 + 8];
+
+  render_columns((line + cache->view.vscroll) % 224, hscroll, 0, 32, buf, prio);
+  /* The column that straddles the right edge wraps around to x = 0 */
+  memcpy(buf, buf + 256, hscroll & 7);
+  memcpy(prio, prio + 256, hscroll & 7);
+
+  /* Screen x 192 - 255 ignores the vertical scroll if R0 bit 7 is set.
+   * The 9 columns shown there are drawn again unscrolled, the first one
+   * may start left of x = 192 */
+  if (regs[0] & 0x80) {
+    render_columns(line, hscroll, (uint8_t)(192 - hscroll) >> 3, 9, locked, locked_prio);
+    memcpy(buf + 192, locked + 192, 64);
+    memcpy(prio + 192, locked_prio + 192, 64);
+  }
+}
+
+/***
+ * Draw the sprites of a line over buf. The status flags are raised by
+ * render_flags_sync() from the live VDP state instead.
+ */
+static void render_sprites(uint16_t line, uint8_t* buf, const uint8_t* prio) {
+  struct render_cache* cache = machine->render.cache;
+  const uint8_t* regs = cache->view.regs;
+  const uint8_t* sat = &cache->view.vram[(regs[5] & 0x7e) << 7];
+  uint8_t zoom = regs[1] & 0x01;
+  uint8_t drawn[256] = { 0 };
+  uint8_t list[8];
+  const uint8_t* pixels;
+  uint8_t n, k, row, count, color;
+  uint16_t tile, i;
+  int16_t x, px;
+
+  count = render_sprite_list(line, list);
+  if (count > 8)
+    count = 8;
+
+  for (k = 0; k < count; k++) {
+    n = list[k];
+    x = sat[0x80 + 2 * n] - ((regs[0] & 0x08) ? 8 : 0);
+    tile = render_sprite_tile(line, n, &row);
+    pixels = &cache->tiles[tile][0][(row & 7) * 8];
+
+    for (i = 0; i < (8u << zoom); i++) {
+      px = x + i;
+      if (px < 0 || px > 255)
+        continue;
+      color = pixels[i >> zoom];
+      if (!color)
+        continue;
+      /* Earlier sprites win, overlapping opaque pixels collide */
+      if (drawn[px])
+        continue;
+      drawn[px] = 1;
+      /* High priority background pixels cover sprites unless transparent */
+      if (prio[px] && (buf[px] & 0x0f))
+        continue;
+      buf[px] = color | 0x10;
+    }
+  }
+}
+
+/* Writes inside of a line only take effect on the next line drawn */
+static void render_fast_draw(uint16_t line, uint16_t from, uint16_t to, uint16_t* out) {
+  struct render_cache* cache = machine->render.cache;
+  const uint16_t* colors = cache->view.colors;
+  uint8_t buf[256 + 8];
+  uint8_t prio[256 + 8];
+  uint16_t x;
+  (void)from;
+  (void)to;
+
+  /* Blanked display shows the backdrop colour */
+  if (!(cache->view.regs[1] & 0x40)) {
+    out[0] = colors[0x10 | (cache->view.regs[7] & 0x0f)];
+    for (x = 1; x < GG_WIDTH; x++)
+      out[x] = out[0];
+    return;
+  }
+
+  render_background(line, buf, prio);
+  render_sprites(line, buf, prio);
+  for (x = 0; x < GG_WIDTH; x++)
+    out[x] = colors[buf[RENDER_GG_X + x]];
+}
+
+const struct render_backend render_fast = {
+  "fast",
+  0,
+  render_fast_draw
+};
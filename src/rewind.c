@@ -0,0 +1,294 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "rewind.h"
+#include "state.h"
+
+struct rewind_record {
+  size_t offset;      /* Start of the encoded snapshot in the data ring */
+  uint32_t size;
+  uint8_t key;        /* Encoded against zeros instead of the keyframe */
+};
+
+/***
+ * History of save states, newest last. Every REWIND_KEY_INTERVAL-th
+ * snapshot is a keyframe, the ones in between are XORed with the keyframe
+ * before them, which leaves zeros wherever the machine did not change.
+ * Both kinds are then run length encoded into a ring of budget bytes; when
+ * it is full the oldest keyframe goes, together with its deltas.
+ */
+static struct {
+  uint8_t* data;
+  size_t capacity;
+  size_t head;        /* Where the next snapshot goes */
+  size_t used;
+  struct rewind_record records[REWIND_RECORDS];
+  uint32_t first;     /* Oldest record */
+  uint32_t count;
+  uint32_t since_key; /* Records after the newest keyframe */
+  unsigned interval;  /* Frames between snapshots */
+  unsigned frames;    /* Frames since the last snapshot */
+  uint64_t captures;
+  uint64_t capture_ticks;
+  uint8_t key[STATE_SIZE];      /* Newest keyframe, decoded */
+  uint8_t state[STATE_SIZE];
+  uint8_t scratch[STATE_SIZE * 2];
+} rewind_state;
+
+static const uint8_t rewind_zeros[STATE_SIZE];
+
+static uint8_t* rewind_varint(uint8_t* out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = value | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+static const uint8_t* rewind_read_varint(const uint8_t* in, uint32_t* value) {
+  uint8_t shift = 0;
+
+  *value = 0;
+  do {
+    *value |= (uint32_t)(*in & 0x7f) << shift;
+    shift += 7;
+  } while (*in++ & 0x80);
+  return in;
+}
+
+/***
+ * Encode cur XOR key as pairs of a run of zeros and a run of literal XOR
+ * bytes, each preceded by its length. Equal stretches are skipped eight
+ * bytes at a time; a literal run ends at four equal bytes in a row.
+ * Returns the encoded size.
+ */
+static uint32_t rewind_encode(const uint8_t* cur, const uint8_t* key, uint8_t* out) {
+  uint8_t* start = out;
+  uint32_t i = 0, zeros, literal;
+  uint64_t a, b;
+
+  while (i < STATE_SIZE) {
+    zeros = i;
+    while (i + 8 <= STATE_SIZE) {
+      memcpy(&a, cur + i, 8);
+      memcpy(&b, key + i, 8);
+      if (a != b)
+        break;
+      i += 8;
+    }
+    while (i < STATE_SIZE && cur[i] == key[i])
+      i++;
+    zeros = i - zeros;
+
+    literal = i;
+    while (i < STATE_SIZE) {
+      if (cur[i] == key[i] && (i + 4 > STATE_SIZE ||
+          (cur[i + 1] == key[i + 1] && cur[i + 2] == key[i + 2] &&
+           cur[i + 3] == key[i + 3])))
+        break;
+      i++;
+    }
+    literal = i - literal;
+
+    out = rewind_varint(out, zeros);
+    out = rewind_varint(out, literal);
+    for (; literal > 0; literal--, out++)
+      *out = cur[i - literal] ^ key[i - literal];
+  }
+  return out - start;
+}
+
+static void rewind_decode(const uint8_t* in, uint32_t size, const uint8_t* key,
+    uint8_t* out) {
+  const uint8_t* end = in + size;
+  uint32_t i = 0, zeros, literal;
+
+  memcpy(out, key, STATE_SIZE);
+  while (in < end) {
+    in = rewind_read_varint(in, &zeros);
+    in = rewind_read_varint(in, &literal);
+    i += zeros;
+    for (; literal > 0; literal--)
+      out[i++] ^= *in++;
+  }
+}
+
+static struct rewind_record* rewind_record(uint32_t n) {
+  return &rewind_state.records[(rewind_state.first + n) % REWIND_RECORDS];
+}
+
+static void rewind_drop_oldest(void) {
+  struct rewind_record* record = rewind_record(0);
+
+  rewind_state.used -= record->size;
+  rewind_state.first = (rewind_state.first + 1) % REWIND_RECORDS;
+  rewind_state.count--;
+  if (rewind_state.since_key >= rewind_state.count)
+    rewind_state.since_key = rewind_state.count;
+}
+
+/* Deltas are useless without their keyframe, so the oldest keyframe goes
+ * with everything up to the next one */
+static void rewind_evict(void) {
+  do {
+    rewind_drop_oldest();
+  } while (rewind_state.count > 0 && !rewind_record(0)->key);
+}
+
+/* Find size bytes in the ring, evicting the oldest snapshots if needed.
+ * Returns the offset or SIZE_MAX if the snapshot is larger than the ring */
+static size_t rewind_alloc(size_t size) {
+  size_t oldest;
+
+  if (size >= rewind_state.capacity)
+    return SIZE_MAX;
+  for (;;) {
+    if (rewind_state.count == 0) {
+      rewind_state.head = 0;
+      return 0;
+    }
+    oldest = rewind_record(0)->offset;
+    if (rewind_state.head >= oldest) {
+      if (rewind_state.capacity - rewind_state.head >= size)
+        return rewind_state.head;
+      if (oldest > size)
+        return rewind_state.head = 0;
+    } else if (oldest - rewind_state.head > size) {
+      return rewind_state.head;
+    }
+    rewind_evict();
+  }
+}
+
+/* Keep up to budget bytes of snapshots, one every interval frames */
+int rewind_init(size_t budget, unsigned interval) {
+  memset(&rewind_state, 0, sizeof(rewind_state));
+  rewind_state.data = malloc(budget);
+  if (rewind_state.data == NULL) {
+    printf("Could not allocate %zu bytes for rewinding\n", budget);
+    return -1;
+  }
+  rewind_state.capacity = budget;
+  rewind_state.interval = interval > 0 ? interval : 1;
+  return 0;
+}
+
+/* Called once per frame, between frames */
+void rewind_capture(void) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  struct rewind_record* record;
+  const uint8_t* key;
+  uint32_t size;
+  size_t offset;
+  uint8_t is_key;
+
+  if (rewind_state.data == NULL || ++rewind_state.frames < rewind_state.interval)
+    return;
+  rewind_state.frames = 0;
+
+  state_save(rewind_state.state, STATE_SIZE);
+  is_key = rewind_state.count == 0 || rewind_state.since_key >= REWIND_KEY_INTERVAL - 1;
+  key = is_key ? rewind_zeros : rewind_state.key;
+  size = rewind_encode(rewind_state.state, key, rewind_state.scratch);
+
+  if (rewind_state.count == REWIND_RECORDS)
+    rewind_evict();
+  offset = rewind_alloc(size);
+  if (offset == SIZE_MAX)
+    return;
+  /* Evicting can take the keyframe this delta was made against */
+  if (!is_key && rewind_state.count == 0)
+    return;
+
+  memcpy(rewind_state.data + offset, rewind_state.scratch, size);
+  record = rewind_record(rewind_state.count++);
+  record->offset = offset;
+  record->size = size;
+  record->key = is_key;
+  rewind_state.head = offset + size;
+  rewind_state.used += size;
+  if (is_key) {
+    memcpy(rewind_state.key, rewind_state.state, STATE_SIZE);
+    rewind_state.since_key = 0;
+  } else {
+    rewind_state.since_key++;
+  }
+
+  rewind_state.captures++;
+  rewind_state.capture_ticks += SDL_GetPerformanceCounter() - start;
+}
+
+/***
+ * Go back to the newest snapshot and forget it, so repeated calls walk
+ * back through the history. Returns -1 once there is nothing left.
+ */
+int rewind_step(void) {
+  struct rewind_record* record;
+  uint32_t n;
+
+  if (rewind_state.count == 0)
+    return -1;
+
+  record = rewind_record(rewind_state.count - 1);
+  rewind_decode(rewind_state.data + record->offset, record->size,
+      record->key ? rewind_zeros : rewind_state.key, rewind_state.state);
+  rewind_state.count--;
+  rewind_state.used -= record->size;
+  rewind_state.head = record->offset;
+  rewind_state.frames = 0;
+
+  /* Popping a keyframe makes the one before it current again */
+  if (record->key) {
+    for (n = rewind_state.count; n > 0 && !rewind_record(n - 1)->key; n--)
+      ;
+    if (n > 0) {
+      record = rewind_record(n - 1);
+      rewind_decode(rewind_state.data + record->offset, record->size,
+          rewind_zeros, rewind_state.key);
+    }
+    rewind_state.since_key = rewind_state.count - n;
+  } else {
+    rewind_state.since_key--;
+  }
+
+  return state_load(rewind_state.state, STATE_SIZE);
+}
+
+void rewind_stats(struct rewind_stats* stats) {
+  stats->snapshots = rewind_state.count;
+  stats->frames = rewind_state.count * rewind_state.interval;
+  stats->bytes = rewind_state.used;
+  stats->captures = rewind_state.captures;
+  stats->capture_ticks = rewind_state.capture_ticks;
+}
+
+void rewind_destroy(void) {
+  free(rewind_state.data);
+  rewind_state.data = NULL;
+  rewind_state.count = 0;
+}
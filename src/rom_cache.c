@@ -0,0 +1,252 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <SDL2/SDL.h>
+
+#include "z80.h"
+#include "loader.h"
+#include "rom_cache.h"
+
+/***
+ * ROM images shared by all machines of the process. An image is found by
+ * the path, size and modification time of the files it was loaded from,
+ * so asking for a known ROM again reads nothing. A file not seen before
+ * is read and hashed, and still shares the image of a ROM with the same
+ * contents. An image is mapped read-only, so every machine running the
+ * same game points at the same pages, and is unmapped when the last
+ * machine using it is gone.
+ */
+struct rom_key {
+  char* path;
+  off_t size;
+  time_t mtime;
+  struct rom_key* next;
+};
+
+struct rom_image {
+  uint8_t* data;
+  uint32_t hash;
+  uint32_t users;
+  /* Files with these contents, none if the file could not be found */
+  struct rom_key* keys;
+  struct rom_image* next;
+};
+
+static struct {
+  struct rom_image* images;
+  struct rom_cache_stats stats;
+  SDL_SpinLock lock;
+} rom_cache;
+
+/* FNV-1a of the whole ROM space, identifies the ROM in save states */
+static uint32_t rom_cache_hash(const uint8_t* rom) {
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < ROM_SZ; i++)
+    hash = (hash ^ rom[i]) * 16777619u;
+  return hash;
+}
+
+/* Find the image loaded from the file and take it, lock held */
+static struct rom_image* rom_cache_find(const char* path, const struct stat* st) {
+  struct rom_image* image;
+  struct rom_key* key;
+
+  for (image = rom_cache.images; image != NULL; image = image->next) {
+    for (key = image->keys; key != NULL; key = key->next) {
+      if (key->size == st->st_size && key->mtime == st->st_mtime &&
+          !strcmp(key->path, path)) {
+        image->users++;
+        rom_cache.stats.users++;
+        rom_cache.stats.hits++;
+        return image;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void rom_cache_free_keys(struct rom_key* key) {
+  struct rom_key* next;
+
+  for (; key != NULL; key = next) {
+    next = key->next;
+    free(key->path);
+    free(key);
+  }
+}
+
+/* Take an image with this hash, lock held. The caller compares the
+ * contents after unlocking and puts it back if they differ */
+static struct rom_image* rom_cache_find_hash(uint32_t hash) {
+  struct rom_image* image;
+
+  for (image = rom_cache.images; image != NULL; image = image->next) {
+    if (image->hash == hash) {
+      image->users++;
+      rom_cache.stats.users++;
+      return image;
+    }
+  }
+  return NULL;
+}
+
+/***
+ * Load the ROM at path, or share the image already loaded from it or
+ * holding the same contents. Returns NULL if out of memory; a short or
+ * missing file still gives an image, the loader says so.
+ */
+const uint8_t* rom_cache_get(const char* path, uint32_t* hash) {
+  struct rom_image* image;
+  struct rom_image* fresh;
+  struct rom_key* key = NULL;
+  struct stat st;
+  int known = stat(path, &st) == 0;
+  uint8_t* data;
+
+  SDL_AtomicLock(&rom_cache.lock);
+  rom_cache.stats.loads++;
+  image = known ? rom_cache_find(path, &st) : NULL;
+  SDL_AtomicUnlock(&rom_cache.lock);
+  if (image != NULL) {
+    *hash = image->hash;
+    return image->data;
+  }
+
+  fresh = malloc(sizeof(*fresh));
+  if (known) {
+    key = malloc(sizeof(*key));
+    if (key != NULL) {
+      key->path = strdup(path);
+      key->size = st.st_size;
+      key->mtime = st.st_mtime;
+      key->next = NULL;
+    }
+  }
+  data = mmap(NULL, ROM_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fresh == NULL || data == MAP_FAILED || (known && (key == NULL || key->path == NULL))) {
+    if (data != MAP_FAILED)
+      munmap(data, ROM_SZ);
+    if (key != NULL)
+      free(key->path);
+    free(key);
+    free(fresh);
+    return NULL;
+  }
+  loader_load_rom(path, data);
+  *hash = rom_cache_hash(data);
+  if (mprotect(data, ROM_SZ, PROT_READ) != 0) {
+    printf("Could not protect the ROM image\n");
+    munmap(data, ROM_SZ);
+    rom_cache_free_keys(key);
+    free(fresh);
+    return NULL;
+  }
+
+  /* The images are read-only, the one taken can be compared unlocked */
+  SDL_AtomicLock(&rom_cache.lock);
+  rom_cache.stats.reads++;
+  image = rom_cache_find_hash(*hash);
+  SDL_AtomicUnlock(&rom_cache.lock);
+  if (image != NULL) {
+    if (!memcmp(image->data, data, ROM_SZ)) {
+      munmap(data, ROM_SZ);
+      free(fresh);
+      SDL_AtomicLock(&rom_cache.lock);
+      rom_cache.stats.hits++;
+      if (key != NULL) {
+        key->next = image->keys;
+        image->keys = key;
+      }
+      SDL_AtomicUnlock(&rom_cache.lock);
+      return image->data;
+    }
+    rom_cache_put(image->data);
+  }
+
+  fresh->data = data;
+  fresh->hash = *hash;
+  fresh->users = 1;
+  fresh->keys = key;
+  SDL_AtomicLock(&rom_cache.lock);
+  fresh->next = rom_cache.images;
+  rom_cache.images = fresh;
+  rom_cache.stats.users++;
+  rom_cache.stats.images++;
+  SDL_AtomicUnlock(&rom_cache.lock);
+  return data;
+}
+
+/* Another machine uses the image it got from rom_cache_get() */
+void rom_cache_share(const uint8_t* rom) {
+  struct rom_image* image;
+
+  SDL_AtomicLock(&rom_cache.lock);
+  for (image = rom_cache.images; image != NULL; image = image->next) {
+    if (image->data == rom) {
+      image->users++;
+      rom_cache.stats.users++;
+      break;
+    }
+  }
+  SDL_AtomicUnlock(&rom_cache.lock);
+}
+
+/* A machine is done with the image */
+void rom_cache_put(const uint8_t* rom) {
+  struct rom_image** link;
+  struct rom_image* image = NULL;
+
+  if (rom == NULL)
+    return;
+  SDL_AtomicLock(&rom_cache.lock);
+  for (link = &rom_cache.images; *link != NULL; link = &(*link)->next) {
+    if ((*link)->data != rom)
+      continue;
+    rom_cache.stats.users--;
+    if (--(*link)->users == 0) {
+      image = *link;
+      *link = image->next;
+      rom_cache.stats.images--;
+    }
+    break;
+  }
+  SDL_AtomicUnlock(&rom_cache.lock);
+
+  if (image != NULL) {
+    munmap(image->data, ROM_SZ);
+    rom_cache_free_keys(image->keys);
+    free(image);
+  }
+}
+
+void rom_cache_stats(struct rom_cache_stats* stats) {
+  SDL_AtomicLock(&rom_cache.lock);
+  *stats = rom_cache.stats;
+  SDL_AtomicUnlock(&rom_cache.lock);
+}
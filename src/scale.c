@@ -0,0 +1,518 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "../include/scale.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCALE_SSE2
+#endif
+
+/***
+ * Source frame in 32 bit pixels with a border of one row above and below
+ * and four pixels left and right that repeats the outermost pixels, so the
+ * filters never have to check for the edge. Pixel (0, 0) is at
+ * scale_buf[SCALE_PITCH + 4].
+ */
+static uint32_t scale_buf[(GG_HEIGHT + 2) * SCALE_PITCH] __attribute__((aligned(16)));
+/* The same pixels as packed YUV, for the filters that compare colours by
+ * similarity rather than equality */
+static uint32_t scale_yuv[(GG_HEIGHT + 2) * SCALE_PITCH] __attribute__((aligned(16)));
+
+#define SCALE_AT(buf, y) (&(buf)[((y) + 1) * SCALE_PITCH + 4])
+
+/* hq2x thresholds for Y, U and V, in the layout of scale_yuv */
+#define SCALE_YUV_THRESHOLD 0x00300706
+
+static uint32_t scale_rgb_to_yuv(uint32_t pixel) {
+  int r = (pixel >> 16) & 0xff, g = (pixel >> 8) & 0xff, b = pixel & 0xff;
+  uint32_t y = (r + g + b) >> 2;
+  uint32_t u = 128 + ((r - b) >> 2);
+  uint32_t v = 128 + ((-r + 2 * g - b) >> 3);
+
+  return (y << 16) | (u << 8) | v;
+}
+
+#ifndef SCALE_SSE2
+/* Average per channel, rounding up like pavgb */
+static uint32_t scale_avg(uint32_t a, uint32_t b) {
+  return (a | b) - (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+static int scale_similar(uint32_t a, uint32_t b) {
+  int i;
+  uint32_t x, y;
+
+  for (i = 0; i < 24; i += 8) {
+    x = (a >> i) & 0xff;
+    y = (b >> i) & 0xff;
+    if ((x > y ? x - y : y - x) > ((SCALE_YUV_THRESHOLD >> i) & 0xff))
+      return 0;
+  }
+  return 1;
+}
+#endif
+
+#ifdef SCALE_SSE2
+static inline __m128i scale_select(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* mask & ~not */
+static inline __m128i scale_and_not(__m128i mask, __m128i not) {
+  return _mm_andnot_si128(not, mask);
+}
+
+static inline __m128i scale_similar_sse2(__m128i a, __m128i b) {
+  __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+  __m128i over = _mm_subs_epu8(diff, _mm_set1_epi32(SCALE_YUV_THRESHOLD));
+
+  return _mm_cmpeq_epi32(over, _mm_setzero_si128());
+}
+#endif
+
+/* Plain pixel doubling and tripling, the baseline for the other filters */
+static void scale_nearest2x(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1) {
+  uint16_t x, y;
+  const uint32_t* e;
+  uint32_t* out;
+
+  for (y = y0; y < y1; y++, dst += 2 * pitch) {
+    e = SCALE_AT(scale_buf, y);
+    out = (uint32_t*)dst;
+#ifdef SCALE_SSE2
+    for (x = 0; x < GG_WIDTH; x += 4) {
+      __m128i v = _mm_load_si128((const __m128i*)(e + x));
+      _mm_storeu_si128((__m128i*)(out + 2 * x), _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i*)(out + 2 * x + 4), _mm_unpackhi_epi32(v, v));
+    }
+#else
+    for (x = 0; x < GG_WIDTH; x++)
+      out[2 * x] = out[2 * x + 1] = e[x];
+#endif
+    memcpy(dst + pitch, dst, GG_WIDTH * 2 * 4);
+  }
+}
+
+static void scale_nearest3x(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1) {
+  uint16_t x, y;
+  const uint32_t* e;
+  uint32_t* out;
+
+  for (y = y0; y < y1; y++, dst += 3 * pitch) {
+    e = SCALE_AT(scale_buf, y);
+    out = (uint32_t*)dst;
+#ifdef SCALE_SSE2
+    for (x = 0; x < GG_WIDTH; x += 4) {
+      __m128i v = _mm_load_si128((const __m128i*)(e + x));
+      _mm_storeu_si128((__m128i*)(out + 3 * x),
+          _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+      _mm_storeu_si128((__m128i*)(out + 3 * x + 4),
+          _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+      _mm_storeu_si128((__m128i*)(out + 3 * x + 8),
+          _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+    }
+#else
+    for (x = 0; x < GG_WIDTH; x++)
+      out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = e[x];
+#endif
+    memcpy(dst + pitch, dst, GG_WIDTH * 3 * 4);
+    memcpy(dst + 2 * pitch, dst, GG_WIDTH * 3 * 4);
+  }
+}
+
+/***
+ * Scale2x (AdvMAME2x). With B above, D left, F right and H below the
+ * pixel E, each quarter takes the colour of the two neighbours it touches
+ * if those are equal and the opposite ones are not.
+ */
+static void scale_scale2x(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1) {
+  uint16_t x, y;
+  const uint32_t *b, *e, *h;
+  uint32_t *out0, *out1;
+
+  for (y = y0; y < y1; y++, dst += 2 * pitch) {
+    b = SCALE_AT(scale_buf, y - 1);
+    e = SCALE_AT(scale_buf, y);
+    h = SCALE_AT(scale_buf, y + 1);
+    out0 = (uint32_t*)dst;
+    out1 = (uint32_t*)(dst + pitch);
+#ifdef SCALE_SSE2
+    for (x = 0; x < GG_WIDTH; x += 4) {
+      __m128i vb = _mm_load_si128((const __m128i*)(b + x));
+      __m128i vd = _mm_loadu_si128((const __m128i*)(e + x - 1));
+      __m128i ve = _mm_load_si128((const __m128i*)(e + x));
+      __m128i vf = _mm_loadu_si128((const __m128i*)(e + x + 1));
+      __m128i vh = _mm_load_si128((const __m128i*)(h + x));
+      __m128i db = _mm_cmpeq_epi32(vd, vb), bf = _mm_cmpeq_epi32(vb, vf);
+      __m128i dh = _mm_cmpeq_epi32(vd, vh), hf = _mm_cmpeq_epi32(vh, vf);
+      __m128i e0 = scale_select(scale_and_not(scale_and_not(db, bf), dh), vd, ve);
+      __m128i e1 = scale_select(scale_and_not(scale_and_not(bf, db), hf), vf, ve);
+      __m128i e2 = scale_select(scale_and_not(scale_and_not(dh, db), hf), vd, ve);
+      __m128i e3 = scale_select(scale_and_not(scale_and_not(hf, dh), bf), vf, ve);
+
+      _mm_storeu_si128((__m128i*)(out0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+      _mm_storeu_si128((__m128i*)(out0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+      _mm_storeu_si128((__m128i*)(out1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+      _mm_storeu_si128((__m128i*)(out1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+    }
+#else
+    for (x = 0; x < GG_WIDTH; x++) {
+      uint32_t B = b[x], D = e[x - 1], E = e[x], F = e[x + 1], H = h[x];
+
+      out0[2 * x] = D == B && B != F && D != H ? D : E;
+      out0[2 * x + 1] = B == F && B != D && F != H ? F : E;
+      out1[2 * x] = D == H && D != B && H != F ? D : E;
+      out1[2 * x + 1] = H == F && D != H && B != F ? F : E;
+    }
+#endif
+  }
+}
+
+/***
+ * Scale3x (AdvMAME3x). The corners follow the Scale2x rule, the edge
+ * centres also need the diagonal neighbours A, C, G and I to differ from
+ * E, so lines keep their width.
+ */
+static void scale_scale3x(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1) {
+  uint16_t x, y, i;
+  const uint32_t *b, *e, *h;
+  uint32_t *out0, *out1, *out2;
+
+  for (y = y0; y < y1; y++, dst += 3 * pitch) {
+    b = SCALE_AT(scale_buf, y - 1);
+    e = SCALE_AT(scale_buf, y);
+    h = SCALE_AT(scale_buf, y + 1);
+    out0 = (uint32_t*)dst;
+    out1 = (uint32_t*)(dst + pitch);
+    out2 = (uint32_t*)(dst + 2 * pitch);
+#ifdef SCALE_SSE2
+    for (x = 0; x < GG_WIDTH; x += 4) {
+      uint32_t row[9][4] __attribute__((aligned(16)));
+      __m128i va = _mm_loadu_si128((const __m128i*)(b + x - 1));
+      __m128i vb = _mm_load_si128((const __m128i*)(b + x));
+      __m128i vc = _mm_loadu_si128((const __m128i*)(b + x + 1));
+      __m128i vd = _mm_loadu_si128((const __m128i*)(e + x - 1));
+      __m128i ve = _mm_load_si128((const __m128i*)(e + x));
+      __m128i vf = _mm_loadu_si128((const __m128i*)(e + x + 1));
+      __m128i vg = _mm_loadu_si128((const __m128i*)(h + x - 1));
+      __m128i vh = _mm_load_si128((const __m128i*)(h + x));
+      __m128i vi = _mm_loadu_si128((const __m128i*)(h + x + 1));
+      __m128i db = _mm_cmpeq_epi32(vd, vb), bf = _mm_cmpeq_epi32(vb, vf);
+      __m128i dh = _mm_cmpeq_epi32(vd, vh), hf = _mm_cmpeq_epi32(vh, vf);
+      __m128i ea = _mm_cmpeq_epi32(ve, va), ec = _mm_cmpeq_epi32(ve, vc);
+      __m128i eg = _mm_cmpeq_epi32(ve, vg), ei = _mm_cmpeq_epi32(ve, vi);
+      __m128i cdb = scale_and_not(scale_and_not(db, bf), dh);
+      __m128i cbf = scale_and_not(scale_and_not(bf, db), hf);
+      __m128i cdh = scale_and_not(scale_and_not(dh, db), hf);
+      __m128i chf = scale_and_not(scale_and_not(hf, dh), bf);
+
+      _mm_store_si128((__m128i*)row[0], scale_select(cdb, vd, ve));
+      _mm_store_si128((__m128i*)row[1], scale_select(_mm_or_si128(
+          scale_and_not(cdb, ec), scale_and_not(cbf, ea)), vb, ve));
+      _mm_store_si128((__m128i*)row[2], scale_select(cbf, vf, ve));
+      _mm_store_si128((__m128i*)row[3], scale_select(_mm_or_si128(
+          scale_and_not(cdb, eg), scale_and_not(cdh, ea)), vd, ve));
+      _mm_store_si128((__m128i*)row[4], ve);
+      _mm_store_si128((__m128i*)row[5], scale_select(_mm_or_si128(
+          scale_and_not(cbf, ei), scale_and_not(chf, ec)), vf, ve));
+      _mm_store_si128((__m128i*)row[6], scale_select(cdh, vd, ve));
+      _mm_store_si128((__m128i*)row[7], scale_select(_mm_or_si128(
+          scale_and_not(cdh, ei), scale_and_not(chf, eg)), vh, ve));
+      _mm_store_si128((__m128i*)row[8], scale_select(chf, vf, ve));
+
+      /* Three outputs per pixel do not interleave with unpacks */
+      for (i = 0; i < 4; i++) {
+        out0[3 * (x + i)] = row[0][i];
+        out0[3 * (x + i) + 1] = row[1][i];
+        out0[3 * (x + i) + 2] = row[2][i];
+        out1[3 * (x + i)] = row[3][i];
+        out1[3 * (x + i) + 1] = row[4][i];
+        out1[3 * (x + i) + 2] = row[5][i];
+        out2[3 * (x + i)] = row[6][i];
+        out2[3 * (x + i) + 1] = row[7][i];
+        out2[3 * (x + i) + 2] = row[8][i];
+      }
+    }
+#else
+    (void)i;
+    for (x = 0; x < GG_WIDTH; x++) {
+      uint32_t A = b[x - 1], B = b[x], C = b[x + 1];
+      uint32_t D = e[x - 1], E = e[x], F = e[x + 1];
+      uint32_t G = h[x - 1], H = h[x], I = h[x + 1];
+      int cdb = D == B && B != F && D != H, cbf = B == F && B != D && F != H;
+      int cdh = D == H && D != B && H != F, chf = H == F && D != H && B != F;
+
+      out0[3 * x] = cdb ? D : E;
+      out0[3 * x + 1] = (cdb && E != C) || (cbf && E != A) ? B : E;
+      out0[3 * x + 2] = cbf ? F : E;
+      out1[3 * x] = (cdb && E != G) || (cdh && E != A) ? D : E;
+      out1[3 * x + 1] = E;
+      out1[3 * x + 2] = (cbf && E != I) || (chf && E != C) ? F : E;
+      out2[3 * x] = cdh ? D : E;
+      out2[3 * x + 1] = (cdh && E != I) || (chf && E != G) ? H : E;
+      out2[3 * x + 2] = chf ? F : E;
+    }
+#endif
+  }
+}
+
+/***
+ * HQ2x style: the Scale2x edge rule, but neighbours are compared by
+ * closeness in YUV with the hq2x thresholds and a corner on an edge is
+ * blended from E and the two neighbours, (2E + B + D) / 4, instead of
+ * replaced. This smooths gradients and anti-aliased edges that the
+ * exact match of Scale2x leaves alone, without hqx's 256 case tables.
+ */
+static void scale_hq2x(uint8_t* dst, int pitch, uint16_t y0, uint16_t y1) {
+  uint16_t x, y;
+  const uint32_t *b, *e, *h, *yb, *ye, *yh;
+  uint32_t *out0, *out1;
+
+  for (y = y0; y < y1; y++, dst += 2 * pitch) {
+    b = SCALE_AT(scale_buf, y - 1);
+    e = SCALE_AT(scale_buf, y);
+    h = SCALE_AT(scale_buf, y + 1);
+    yb = SCALE_AT(scale_yuv, y - 1);
+    ye = SCALE_AT(scale_yuv, y);
+    yh = SCALE_AT(scale_yuv, y + 1);
+    out0 = (uint32_t*)dst;
+    out1 = (uint32_t*)(dst + pitch);
+#ifdef SCALE_SSE2
+    for (x = 0; x < GG_WIDTH; x += 4) {
+      __m128i vb = _mm_load_si128((const __m128i*)(b + x));
+      __m128i vd = _mm_loadu_si128((const __m128i*)(e + x - 1));
+      __m128i ve = _mm_load_si128((const __m128i*)(e + x));
+      __m128i vf = _mm_loadu_si128((const __m128i*)(e + x + 1));
+      __m128i vh = _mm_load_si128((const __m128i*)(h + x));
+      __m128i ub = _mm_load_si128((const __m128i*)(yb + x));
+      __m128i ud = _mm_loadu_si128((const __m128i*)(ye + x - 1));
+      __m128i uf = _mm_loadu_si128((const __m128i*)(ye + x + 1));
+      __m128i uh = _mm_load_si128((const __m128i*)(yh + x));
+      __m128i db = scale_similar_sse2(ud, ub), bf = scale_similar_sse2(ub, uf);
+      __m128i dh = scale_similar_sse2(ud, uh), hf = scale_similar_sse2(uh, uf);
+      __m128i e0 = scale_select(scale_and_not(scale_and_not(db, bf), dh),
+          _mm_avg_epu8(ve, _mm_avg_epu8(vb, vd)), ve);
+      __m128i e1 = scale_select(scale_and_not(scale_and_not(bf, db), hf),
+          _mm_avg_epu8(ve, _mm_avg_epu8(vb, vf)), ve);
+      __m128i e2 = scale_select(scale_and_not(scale_and_not(dh, db), hf),
+          _mm_avg_epu8(ve, _mm_avg_epu8(vd, vh)), ve);
+      __m128i e3 = scale_select(scale_and_not(scale_and_not(hf, dh), bf),
+          _mm_avg_epu8(ve, _mm_avg_epu8(vh, vf)), ve);
+
+      _mm_storeu_si128((__m128i*)(out0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+      _mm_storeu_si128((__m128i*)(out0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+      _mm_storeu_si128((__m128i*)(out1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+      _mm_storeu_si128((__m128i*)(out1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+    }
+#else
+    for (x = 0; x < GG_WIDTH; x++) {
+      uint32_t B = b[x], D = e[x - 1], E = e[x], F = e[x + 1], H = h[x];
+      int db = scale_similar(ye[x - 1], yb[x]), bf = scale_similar(yb[x], ye[x + 1]);
+      int dh = scale_similar(ye[x - 1], yh[x]), hf = scale_similar(yh[x], ye[x + 1]);
+
+      out0[2 * x] = db && !bf && !dh ? scale_avg(E, scale_avg(B, D)) : E;
+      out0[2 * x + 1] = bf && !db && !hf ? scale_avg(E, scale_avg(B, F)) : E;
+      out1[2 * x] = dh && !db && !hf ? scale_avg(E, scale_avg(D, H)) : E;
+      out1[2 * x + 1] = hf && !dh && !bf ? scale_avg(E, scale_avg(H, F)) : E;
+    }
+#endif
+  }
+}
+
+static const struct scale_filter scale_list[] = {
+  { "none", 1, NULL },
+  { "nearest2x", 2, scale_nearest2x },
+  { "nearest3x", 3, scale_nearest3x },
+  { "scale2x", 2, scale_scale2x },
+  { "scale3x", 3, scale_scale3x },
+  { "hq2x", 2, scale_hq2x },
+};
+
+const struct scale_filter* scale_filters(unsigned* count) {
+  *count = sizeof(scale_list) / sizeof(scale_list[0]);
+  return scale_list;
+}
+
+const struct scale_filter* scale_find(const char* name) {
+  unsigned i;
+
+  for (i = 0; i < sizeof(scale_list) / sizeof(scale_list[0]); i++)
+    if (strcmp(scale_list[i].name, name) == 0)
+      return &scale_list[i];
+  return NULL;
+}
+
+/* Row y of the source frame, the caller fills in GG_WIDTH pixels */
+uint32_t* scale_source(uint16_t y) {
+  return SCALE_AT(scale_buf, y);
+}
+
+/***
+ * The source rows [top, bottom) were filled in, bring their border and
+ * YUV copy up to date. The rows above and below the frame repeat the first
+ * and the last row.
+ */
+void scale_update(uint16_t top, uint16_t bottom) {
+  int y, x;
+  uint32_t *row, *yuv;
+
+  for (y = top; y < bottom; y++) {
+    row = SCALE_AT(scale_buf, y);
+    yuv = SCALE_AT(scale_yuv, y);
+    for (x = -4; x < 0; x++)
+      row[x] = row[0];
+    for (x = GG_WIDTH; x < GG_WIDTH + 4; x++)
+      row[x] = row[GG_WIDTH - 1];
+    for (x = -4; x < GG_WIDTH + 4; x++)
+      yuv[x] = scale_rgb_to_yuv(row[x]);
+  }
+  if (top == 0 && bottom > 0) {
+    memcpy(SCALE_AT(scale_buf, -1) - 4, SCALE_AT(scale_buf, 0) - 4, SCALE_PITCH * 4);
+    memcpy(SCALE_AT(scale_yuv, -1) - 4, SCALE_AT(scale_yuv, 0) - 4, SCALE_PITCH * 4);
+  }
+  if (bottom == GG_HEIGHT && top < bottom) {
+    memcpy(SCALE_AT(scale_buf, GG_HEIGHT) - 4, SCALE_AT(scale_buf, GG_HEIGHT - 1) - 4,
+        SCALE_PITCH * 4);
+    memcpy(SCALE_AT(scale_yuv, GG_HEIGHT) - 4, SCALE_AT(scale_yuv, GG_HEIGHT - 1) - 4,
+        SCALE_PITCH * 4);
+  }
+}
+
+/* Output rows depend on the source rows next to them, so changed rows
+ * [top, bottom) have to be filtered again with one row either side */
+void scale_span(uint16_t* top, uint16_t* bottom) {
+  if (*top >= *bottom)
+    return;
+  if (*top > 0)
+    (*top)--;
+  if (*bottom < GG_HEIGHT)
+    (*bottom)++;
+}
+
+/***
+ * Thread pool: the frame is cut into horizontal bands, the calling thread
+ * filters the first and each worker one of the others. Filters only read
+ * the shared source, so the bands need no locking.
+ */
+struct scale_job {
+  const struct scale_filter* filter;
+  uint8_t* dst;
+  int pitch;
+  uint16_t y0;
+  uint16_t y1;
+};
+
+static struct {
+  unsigned threads;
+  SDL_Thread* thread[SCALE_THREADS];
+  SDL_sem* start[SCALE_THREADS];
+  SDL_sem* done;
+  struct scale_job job[SCALE_THREADS];
+  SDL_atomic_t quit;
+} scale_pool;
+
+static int scale_worker(void* data) {
+  unsigned n = (unsigned)(uintptr_t)data;
+  struct scale_job* job = &scale_pool.job[n];
+
+  for (;;) {
+    SDL_SemWait(scale_pool.start[n]);
+    if (SDL_AtomicGet(&scale_pool.quit))
+      return 0;
+    job->filter->run(job->dst, job->pitch, job->y0, job->y1);
+    SDL_SemPost(scale_pool.done);
+  }
+}
+
+/* Start threads - 1 workers, the caller is the remaining one */
+void scale_init(unsigned threads) {
+  unsigned i;
+
+  if (threads < 1)
+    threads = 1;
+  if (threads > SCALE_THREADS)
+    threads = SCALE_THREADS;
+
+  SDL_AtomicSet(&scale_pool.quit, 0);
+  scale_pool.done = SDL_CreateSemaphore(0);
+  scale_pool.threads = 1;
+  for (i = 1; i < threads; i++) {
+    scale_pool.start[i] = SDL_CreateSemaphore(0);
+    scale_pool.thread[i] = SDL_CreateThread(scale_worker, "scale",
+        (void*)(uintptr_t)i);
+    if (scale_pool.thread[i] == NULL) {
+      printf("%s\n", SDL_GetError());
+      SDL_DestroySemaphore(scale_pool.start[i]);
+      break;
+    }
+    scale_pool.threads++;
+  }
+}
+
+void scale_destroy(void) {
+  unsigned i;
+
+  SDL_AtomicSet(&scale_pool.quit, 1);
+  for (i = 1; i < scale_pool.threads; i++) {
+    SDL_SemPost(scale_pool.start[i]);
+    SDL_WaitThread(scale_pool.thread[i], NULL);
+    SDL_DestroySemaphore(scale_pool.start[i]);
+  }
+  if (scale_pool.done != NULL)
+    SDL_DestroySemaphore(scale_pool.done);
+  scale_pool.done = NULL;
+  scale_pool.threads = 0;
+}
+
+/* Filter the source rows [top, bottom) into dst, which points at output
+ * row top * factor. Returns when all bands are done */
+void scale_frame(const struct scale_filter* filter, uint8_t* dst, int pitch,
+    uint16_t top, uint16_t bottom) {
+  unsigned bands = scale_pool.threads, i;
+  uint16_t rows = bottom - top, y0, y1;
+
+  if (top >= bottom)
+    return;
+  if (bands < 1)
+    bands = 1;
+  if (bands > rows)
+    bands = rows;
+
+  for (i = bands - 1; i > 0; i--) {
+    y0 = top + rows * i / bands;
+    y1 = top + rows * (i + 1) / bands;
+    scale_pool.job[i].filter = filter;
+    scale_pool.job[i].dst = dst + (y0 - top) * filter->factor * pitch;
+    scale_pool.job[i].pitch = pitch;
+    scale_pool.job[i].y0 = y0;
+    scale_pool.job[i].y1 = y1;
+    SDL_SemPost(scale_pool.start[i]);
+  }
+  filter->run(dst, pitch, top, top + rows / bands);
+  for (i = 1; i < bands; i++)
+    SDL_SemWait(scale_pool.done);
+}
@@ -0,0 +1,141 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sched.h"
+#include "machine.h"
+
+/* Callbacks are registered once by the devices and are not part of the
+ * state, so the state can be copied around freely */
+static sched_callback sched_callbacks[SCHED_EVENTS];
+
+static void sched_swap(uint8_t a, uint8_t b) {
+  uint8_t tmp = machine->sched.heap[a];
+
+  machine->sched.heap[a] = machine->sched.heap[b];
+  machine->sched.heap[b] = tmp;
+  machine->sched.slot[machine->sched.heap[a]] = a;
+  machine->sched.slot[machine->sched.heap[b]] = b;
+}
+
+static uint64_t sched_when(uint8_t pos) {
+  return machine->sched.events[machine->sched.heap[pos]].when;
+}
+
+static void sched_sift_up(uint8_t pos) {
+  while (pos > 0 && sched_when((pos - 1) / 2) > sched_when(pos)) {
+    sched_swap(pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
+}
+
+static void sched_sift_down(uint8_t pos) {
+  uint8_t child;
+
+  while ((child = 2 * pos + 1) < machine->sched.count) {
+    if (child + 1 < machine->sched.count && sched_when(child + 1) < sched_when(child))
+      child++;
+    if (sched_when(pos) <= sched_when(child))
+      break;
+    sched_swap(pos, child);
+    pos = child;
+  }
+}
+
+void sched_init(void) {
+  memset(&machine->sched, 0, sizeof(machine->sched));
+  machine->sched.deadline = SCHED_NEVER;
+}
+
+void sched_register(enum sched_event event, sched_callback callback) {
+  /* Machines created later register the same callbacks again, while
+   * others run and read them */
+  if (sched_callbacks[event] != callback)
+    sched_callbacks[event] = callback;
+}
+
+void sched_add(enum sched_event event, uint64_t when) {
+  uint8_t pos;
+
+  if (machine->sched.events[event].pending) {
+    pos = machine->sched.slot[event];
+    machine->sched.events[event].when = when;
+    sched_sift_up(pos);
+    sched_sift_down(machine->sched.slot[event]);
+  } else {
+    pos = machine->sched.count++;
+    machine->sched.events[event].when = when;
+    machine->sched.events[event].pending = 1;
+    machine->sched.heap[pos] = event;
+    machine->sched.slot[event] = pos;
+    sched_sift_up(pos);
+  }
+
+  /* End the running block early if the new event is due before it */
+  if (when < machine->sched.deadline)
+    machine->sched.deadline = when;
+}
+
+void sched_cancel(enum sched_event event) {
+  uint8_t pos, moved;
+
+  if (!machine->sched.events[event].pending)
+    return;
+
+  pos = machine->sched.slot[event];
+  machine->sched.events[event].pending = 0;
+  machine->sched.count--;
+  if (pos == machine->sched.count)
+    return;
+
+  /* Move the last entry into the hole and restore the heap order */
+  sched_swap(pos, machine->sched.count);
+  moved = machine->sched.heap[pos];
+  sched_sift_up(pos);
+  sched_sift_down(machine->sched.slot[moved]);
+}
+
+uint64_t sched_next(void) {
+  if (machine->sched.count == 0)
+    return SCHED_NEVER;
+  return sched_when(0);
+}
+
+/* Run every event that is due at or before now, in order */
+void sched_dispatch(uint64_t now) {
+  uint8_t event;
+  uint64_t when;
+
+  while (machine->sched.count > 0 && sched_when(0) <= now) {
+    event = machine->sched.heap[0];
+    when = machine->sched.events[event].when;
+    sched_cancel(event);
+    if (sched_callbacks[event])
+      sched_callbacks[event](when);
+  }
+}
+
+/* Stop the running block after the current instruction */
+void sched_break(void) {
+  machine->sched.deadline = 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <SDL2/SDL.h>
+
+#include "serve.h"
+#include "state.h"
+#include "render.h"
+#include "machine.h"
+
+/***
+ * One thread reads a request, the commands are sorted into a list per
+ * instance, and the workers and the reading thread take instances off
+ * those lists until all ran. Every instance is headless: frames are only
+ * drawn and sound only made when a step asks for them.
+ */
+struct serve_worker {
+  SDL_Thread* thread;
+};
+
+static struct {
+  struct gg_machine* machines[SERVE_MAX_INSTANCES];
+  unsigned instances;
+  uint8_t* shm;
+  size_t shm_size;
+  size_t instance_size;
+
+  /* Commands of the request, chained per instance in order */
+  struct serve_command commands[SERVE_MAX_COMMANDS];
+  uint8_t status[SERVE_MAX_COMMANDS];
+  int32_t next[SERVE_MAX_COMMANDS];
+  int32_t first[SERVE_MAX_INSTANCES];
+  int32_t last[SERVE_MAX_INSTANCES];
+  uint16_t busy[SERVE_MAX_INSTANCES];
+  unsigned busy_count;
+  SDL_atomic_t taken;
+
+  struct serve_worker* workers;
+  unsigned worker_count;
+  SDL_sem* start;
+  SDL_sem* done;
+  int quit;
+} serve;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+static struct serve_instance* serve_block(unsigned instance) {
+  return (struct serve_instance*)(serve.shm + SERVE_HEADER_SIZE +
+      instance * serve.instance_size);
+}
+
+/* Sound of the frame just run, straight into the block while it fits */
+static void serve_observe_audio(struct serve_instance* block) {
+  static __thread int16_t samples[PSG_BUFFER * 2];
+  int16_t* out = &block->audio[block->audio_count * 2];
+  unsigned count, room = SERVE_AUDIO_SAMPLES - block->audio_count;
+
+  if (room >= PSG_BUFFER) {
+    block->audio_count += psg_end_frame(machine->z80.cycles, out);
+    return;
+  }
+  count = psg_end_frame(machine->z80.cycles, samples);
+  if (count > room) {
+    block->audio_dropped += count - room;
+    count = room;
+  }
+  memcpy(out, samples, count * 2 * sizeof(int16_t));
+  block->audio_count += count;
+}
+
+static int serve_step(const struct serve_command* command, struct serve_instance* block) {
+  int frame_wanted = command->flags & SERVE_FRAMEBUFFER;
+  int audio_wanted = command->flags & SERVE_AUDIO;
+  uint16_t i;
+
+  block->audio_count = 0;
+  block->audio_dropped = 0;
+  machine->psg.silent = !audio_wanted;
+  io_set_buttons(command->buttons);
+  for (i = 0; i < command->frames; i++) {
+    /* Only the frame that is looked at is drawn */
+    render_set_silent(!frame_wanted || i != command->frames - 1);
+    z80_run_frame();
+    if (audio_wanted)
+      serve_observe_audio(block);
+  }
+  if (!audio_wanted)
+    psg_reset_output();
+  block->frame += command->frames;
+  page_copy_out(&machine->pages, PAGE_RAM, block->ram, RAM_SZ);
+  if (frame_wanted && command->frames > 0 && machine->render.cache != NULL)
+    memcpy(block->framebuffer, machine->render.cache->framebuffer, sizeof(block->framebuffer));
+  return 0;
+}
+
+static int serve_execute(const struct serve_command* command) {
+  static __thread uint8_t state[STATE_SIZE];
+  struct serve_instance* block = serve_block(command->instance);
+
+  gg_machine_select(serve.machines[command->instance]);
+  switch (command->op) {
+  case SERVE_RESET:
+    block->frame = 0;
+    return gg_machine_reset(machine);
+  case SERVE_STEP:
+    return serve_step(command, block);
+  case SERVE_SAVE:
+    block->state_bytes = state_save(block->state, STATE_SIZE);
+    return block->state_bytes ? 0 : -1;
+  case SERVE_LOAD:
+    /* The client can write the block at any time, check a copy */
+    memcpy(state, block->state, STATE_SIZE);
+    return state_load(state, STATE_SIZE);
+  }
+  return -1;
+}
+
+/* Run the commands of instances until none are left */
+static void serve_drain(void) {
+  unsigned index;
+  int32_t i;
+
+  while ((index = SDL_AtomicAdd(&serve.taken, 1)) < serve.busy_count)
+    for (i = serve.first[serve.busy[index]]; i >= 0; i = serve.next[i])
+      serve.status[i] = serve_execute(&serve.commands[i]) != 0;
+  gg_machine_select(NULL);
+}
+
+static int serve_worker(void* data) {
+  (void)data;
+  for (;;) {
+    SDL_SemWait(serve.start);
+    if (serve.quit)
+      break;
+    serve_drain();
+    SDL_SemPost(serve.done);
+  }
+  return 0;
+}
+
+/* Run the commands of a request, returns how many failed */
+static uint32_t serve_dispatch(uint32_t count) {
+  struct serve_command* command;
+  uint32_t i, failed = 0;
+  unsigned n;
+
+  serve.busy_count = 0;
+  for (i = 0; i < count; i++) {
+    command = &serve.commands[i];
+    serve.next[i] = -1;
+    if (command->instance >= serve.instances) {
+      serve.status[i] = 1;
+      continue;
+    }
+    if (serve.first[command->instance] < 0) {
+      serve.first[command->instance] = i;
+      serve.busy[serve.busy_count++] = command->instance;
+    } else {
+      serve.next[serve.last[command->instance]] = i;
+    }
+    serve.last[command->instance] = i;
+  }
+
+  SDL_AtomicSet(&serve.taken, 0);
+  /* The reading thread takes one instance itself */
+  n = serve.busy_count > 0 ? serve.busy_count - 1 : 0;
+  if (n > serve.worker_count)
+    n = serve.worker_count;
+  for (i = 0; i < n; i++)
+    SDL_SemPost(serve.start);
+  serve_drain();
+  for (i = 0; i < n; i++)
+    SDL_SemWait(serve.done);
+
+  for (i = 0; i < serve.busy_count; i++)
+    serve.first[serve.busy[i]] = -1;
+  for (i = 0; i < count; i++)
+    failed += serve.status[i];
+  return failed;
+}
+
+static int serve_read(int fd, void* buf, size_t size) {
+  uint8_t* p = buf;
+  ssize_t n;
+
+  while (size > 0) {
+    n = read(fd, p, size);
+    if (n < 0 && errno == EINTR && !serve_stop)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int serve_write(int fd, const void* buf, size_t size) {
+  const uint8_t* p = buf;
+  ssize_t n;
+
+  while (size > 0) {
+    n = write(fd, p, size);
+    if (n < 0 && errno == EINTR && !serve_stop)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Round trips of one second or one client */
+struct serve_stats {
+  uint64_t trips;
+  uint64_t commands;
+  uint64_t service_ticks;
+  uint64_t max_ticks;
+  uint64_t client_ticks;  /* From a reply to the next request */
+};
+
+static void serve_report(const char* what, const struct serve_stats* stats) {
+  double us = 1e6 / SDL_GetPerformanceFrequency();
+
+  if (stats->trips == 0)
+    return;
+  printf("%s: %llu round trips, %.1f commands each, service %.1f us (max %.1f), "
+      "client and socket %.1f us\n", what, (unsigned long long)stats->trips,
+      (double)stats->commands / stats->trips, stats->service_ticks * us / stats->trips,
+      stats->max_ticks * us, stats->client_ticks * us / stats->trips);
+}
+
+static void serve_add(struct serve_stats* total, const struct serve_stats* part) {
+  total->trips += part->trips;
+  total->commands += part->commands;
+  total->service_ticks += part->service_ticks;
+  total->client_ticks += part->client_ticks;
+  if (part->max_ticks > total->max_ticks)
+    total->max_ticks = part->max_ticks;
+}
+
+/* Answer the requests of one client until it hangs up */
+static void serve_client(int fd, int stats) {
+  static uint8_t reply[sizeof(struct serve_reply) + SERVE_MAX_COMMANDS];
+  struct serve_reply* header = (struct serve_reply*)reply;
+  struct serve_stats second = { 0 }, total = { 0 };
+  uint64_t start, ticks, replied = 0, report = SDL_GetPerformanceCounter();
+  uint64_t frequency = SDL_GetPerformanceFrequency();
+  uint32_t count;
+
+  while (!serve_stop && serve_read(fd, &count, sizeof(count)) == 0) {
+    start = SDL_GetPerformanceCounter();
+    if (count > SERVE_MAX_COMMANDS) {
+      printf("Request of %u commands, at most %u are allowed\n", count,
+          SERVE_MAX_COMMANDS);
+      break;
+    }
+    if (serve_read(fd, serve.commands, count * sizeof(struct serve_command)) != 0)
+      break;
+
+    header->count = count;
+    header->failed = serve_dispatch(count);
+    memcpy(reply + sizeof(*header), serve.status, count);
+    ticks = SDL_GetPerformanceCounter() - start;
+    header->service_ns = ticks * 1000000000ull / frequency;
+    if (serve_write(fd, reply, sizeof(*header) + count) != 0)
+      break;
+
+    second.trips++;
+    second.commands += count;
+    second.service_ticks += ticks;
+    if (ticks > second.max_ticks)
+      second.max_ticks = ticks;
+    if (replied)
+      second.client_ticks += start - replied;
+    replied = SDL_GetPerformanceCounter();
+    if (replied - report >= frequency) {
+      if (stats)
+        serve_report("last second", &second);
+      serve_add(&total, &second);
+      memset(&second, 0, sizeof(second));
+      report = replied;
+    }
+  }
+  serve_add(&total, &second);
+  serve_report("client", &total);
+}
+
+static int serve_map(const char* path) {
+  struct serve_header* header;
+  int fd;
+
+  serve.instance_size = (sizeof(struct serve_instance) + 4095) & ~(size_t)4095;
+  serve.shm_size = SERVE_HEADER_SIZE + serve.instances * serve.instance_size;
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || ftruncate(fd, serve.shm_size) != 0) {
+    printf("Could not create %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  serve.shm = mmap(NULL, serve.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (serve.shm == MAP_FAILED) {
+    printf("Could not map %s\n", path);
+    return -1;
+  }
+  header = (struct serve_header*)serve.shm;
+  memcpy(header->magic, SERVE_MAGIC, sizeof(header->magic));
+  header->version = SERVE_VERSION;
+  header->instances = serve.instances;
+  header->instance_size = serve.instance_size;
+  header->state_size = STATE_SIZE;
+  return 0;
+}
+
+static int serve_listen(const char* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Socket path %s is too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 1) != 0) {
+    printf("Could not listen on %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/***
+ * Serve instances of the ROM on the socket at path until interrupted,
+ * one client at a time. With stats the round trips of every second are
+ * reported, otherwise those of every client when it hangs up.
+ */
+int serve_run(const char* path, const char* rom_path, unsigned instances, int stats) {
+  char shm_path[4096];
+  struct sigaction action;
+  int listen_fd, fd, result = -1;
+  unsigned i;
+
+  memset(&serve, 0, sizeof(serve));
+  serve.instances = instances < 1 ? 1 : instances;
+  if (serve.instances > SERVE_MAX_INSTANCES)
+    serve.instances = SERVE_MAX_INSTANCES;
+  snprintf(shm_path, sizeof(shm_path), "%s.shm", path);
+  if (serve_map(shm_path) != 0)
+    return -1;
+
+  for (i = 0; i < serve.instances; i++) {
+    serve.machines[i] = gg_machine_create(rom_path);
+    if (serve.machines[i] == NULL)
+      goto out;
+    machine->psg.silent = 1;
+    render_set_silent(1);
+    serve.first[i] = -1;
+  }
+  gg_machine_select(NULL);
+
+  listen_fd = serve_listen(path);
+  if (listen_fd < 0)
+    goto out;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = serve_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  serve.start = SDL_CreateSemaphore(0);
+  serve.done = SDL_CreateSemaphore(0);
+  serve.worker_count = SDL_GetCPUCount() - 1;
+  if (serve.worker_count > serve.instances - 1)
+    serve.worker_count = serve.instances - 1;
+  serve.workers = calloc(serve.worker_count + 1, sizeof(*serve.workers));
+  for (i = 0; i < serve.worker_count; i++)
+    serve.workers[i].thread = SDL_CreateThread(serve_worker, "serve", NULL);
+
+  printf("Serving %u instances on %s, observations in %s\n", serve.instances, path,
+      shm_path);
+  fflush(stdout);
+  while (!serve_stop) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    serve_client(fd, stats);
+    fflush(stdout);
+    close(fd);
+  }
+  result = 0;
+
+  serve.quit = 1;
+  for (i = 0; i < serve.worker_count; i++)
+    SDL_SemPost(serve.start);
+  for (i = 0; i < serve.worker_count; i++)
+    SDL_WaitThread(serve.workers[i].thread, NULL);
+  free(serve.workers);
+  SDL_DestroySemaphore(serve.start);
+  SDL_DestroySemaphore(serve.done);
+  close(listen_fd);
+  unlink(path);
+out:
+  for (i = 0; i < serve.instances; i++)
+    gg_machine_destroy(serve.machines[i]);
+  munmap(serve.shm, serve.shm_size);
+  unlink(shm_path);
+  return result;
+}
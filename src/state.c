@@ -0,0 +1,178 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "state.h"
+#include "render.h"
+#include "machine.h"
+
+/* Longest a channel's flip-flop can wait, a tone period of 0x3ff */
+#define STATE_PSG_WAIT (0x3ff * 16)
+
+/* Write the machine to buf, returns the bytes written or 0 if buf is too
+ * small. Only call this between frames */
+size_t state_save(uint8_t* buf, size_t size) {
+  struct state_blob* blob = (struct state_blob*)buf;
+
+  if (size < STATE_SIZE)
+    return 0;
+
+  /* Padding between the fields is part of the hashes of a state too */
+  memset(blob, 0, STATE_SIZE);
+  memcpy(blob->header.magic, STATE_MAGIC, sizeof(blob->header.magic));
+  blob->header.version = STATE_VERSION;
+  blob->header.size = STATE_SIZE;
+  blob->header.rom_hash = machine->rom_hash;
+  memcpy(&blob->z80, &machine->z80, sizeof(machine->z80));
+  page_copy_out(&machine->pages, PAGE_RAM, blob->ram, RAM_SZ);
+  page_copy_out(&machine->pages, PAGE_VRAM, blob->vram, VRAM_SZ);
+  memcpy(&blob->vdp, &machine->vdp, sizeof(machine->vdp));
+  memcpy(&blob->io, &machine->io, sizeof(machine->io));
+  memcpy(&blob->sched, &machine->sched, sizeof(machine->sched));
+  memcpy(blob->psg_channel, machine->psg.channel, sizeof(machine->psg.channel));
+  blob->psg_latch = machine->psg.latch;
+  blob->psg_stereo = machine->psg.stereo;
+  blob->psg_lfsr = machine->psg.lfsr;
+  blob->psg_time = machine->psg.time;
+  return STATE_SIZE;
+}
+
+/***
+ * Fields that index arrays or VRAM, a damaged or made up state must not
+ * take them out of range. Returns the first one that is, NULL if none.
+ */
+static const char* state_check(const struct state_blob* blob) {
+  uint8_t i, event, pending = 0;
+
+  if (blob->vdp.addr >= VRAM_SZ)
+    return "VDP address";
+  if (blob->io.tx_count > IO_LINK_BYTES || blob->io.rx_count > IO_LINK_BYTES)
+    return "link buffer";
+  if (blob->psg_latch >= 2 * 4)
+    return "PSG latch";
+  for (i = 0; i < 4; i++)
+    if (blob->psg_channel[i].volume > 0x0f)
+      return "PSG volume";
+  /* psg_sync() steps each running channel from next to the current cycle,
+   * next is never behind the channels or more than a period ahead */
+  for (i = 0; i < 4; i++) {
+    if (i < 3 ? blob->psg_channel[i].period < 2 : (blob->psg_channel[i].period & 3) == 3)
+      continue;
+    if (blob->psg_channel[i].next < blob->psg_time ||
+        blob->psg_channel[i].next - blob->psg_time > STATE_PSG_WAIT)
+      return "PSG channel time";
+  }
+
+  /* The heap holds every pending event once and slot[] points back */
+  if (blob->sched.count > SCHED_EVENTS)
+    return "scheduler count";
+  for (i = 0; i < SCHED_EVENTS; i++)
+    pending += blob->sched.events[i].pending != 0;
+  if (pending != blob->sched.count)
+    return "scheduler count";
+  for (i = 0; i < blob->sched.count; i++) {
+    event = blob->sched.heap[i];
+    if (event >= SCHED_EVENTS || !blob->sched.events[event].pending ||
+        blob->sched.slot[event] != i)
+      return "scheduler heap";
+  }
+  return NULL;
+}
+
+/* Restore the machine from buf, returns -1 and leaves it alone if buf does
+ * not hold a state of this build and ROM */
+int state_load(const uint8_t* buf, size_t size) {
+  const struct state_blob* blob = (const struct state_blob*)buf;
+  const char* damaged;
+
+  if (size < sizeof(blob->header) ||
+      memcmp(blob->header.magic, STATE_MAGIC, sizeof(blob->header.magic)) != 0) {
+    printf("Not a save state\n");
+    return -1;
+  }
+  if (blob->header.version != STATE_VERSION || blob->header.size != STATE_SIZE ||
+      size < STATE_SIZE) {
+    printf("Save state version %u (%u bytes) does not match %u (%u bytes)\n",
+        blob->header.version, blob->header.size, STATE_VERSION, (uint32_t)STATE_SIZE);
+    return -1;
+  }
+  if (blob->header.rom_hash != machine->rom_hash) {
+    printf("Save state belongs to a different ROM\n");
+    return -1;
+  }
+  damaged = state_check(blob);
+  if (damaged != NULL) {
+    printf("Save state is damaged, %s out of range\n", damaged);
+    return -1;
+  }
+
+  memcpy(&machine->z80, &blob->z80, sizeof(machine->z80));
+  page_copy_in(&machine->pages, PAGE_RAM, blob->ram, RAM_SZ);
+  page_copy_in(&machine->pages, PAGE_VRAM, blob->vram, VRAM_SZ);
+  memcpy(&machine->vdp, &blob->vdp, sizeof(machine->vdp));
+  memcpy(&machine->io, &blob->io, sizeof(machine->io));
+  memcpy(&machine->sched, &blob->sched, sizeof(machine->sched));
+  memcpy(machine->psg.channel, blob->psg_channel, sizeof(machine->psg.channel));
+  machine->psg.latch = blob->psg_latch;
+  machine->psg.stereo = blob->psg_stereo;
+  machine->psg.lfsr = blob->psg_lfsr;
+  machine->psg.time = blob->psg_time;
+
+  psg_reset_output();
+  render_invalidate();
+  return 0;
+}
+
+int state_save_file(const char* path) {
+  uint8_t buf[STATE_SIZE];
+  FILE* file;
+  size_t size = state_save(buf, sizeof(buf));
+
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+  if (fwrite(buf, 1, size, file) != size) {
+    printf("Could not write %s\n", path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
+
+int state_load_file(const char* path) {
+  uint8_t buf[STATE_SIZE];
+  FILE* file;
+  size_t size;
+
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+  size = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+  return state_load(buf, size);
+}
@@ -0,0 +1,215 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tile_decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TILE_DECODE_X86
+#endif
+
+tile_decode_fn tile_decode = tile_decode_scalar;
+
+/* Every bit of a byte spread out to one byte, bit 7 first and bit 0 first */
+static uint64_t tile_expand[256];
+static uint64_t tile_expand_flip[256];
+static int tile_expand_built;
+
+/* Bit by bit decoding, kept as the baseline for the benchmark */
+void tile_decode_reference(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows) {
+  unsigned row, x, bit;
+  uint8_t pixel;
+
+  for (row = 0; row < rows; row++) {
+    for (x = 0; x < 8; x++) {
+      bit = 7 - x;
+      pixel = ((src[0] >> bit) & 1) | (((src[1] >> bit) & 1) << 1) |
+          (((src[2] >> bit) & 1) << 2) | (((src[3] >> bit) & 1) << 3);
+      dst[row * 8 + x] = pixel;
+      flip[row * 8 + 7 - x] = pixel;
+    }
+    src += 4;
+  }
+}
+
+/* Table driven fallback: four lookups and shifts per row, the tables are
+ * laid out for little endian hosts */
+void tile_decode_scalar(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows) {
+  unsigned row;
+  uint64_t pixels;
+
+  for (row = 0; row < rows; row++) {
+    pixels = tile_expand[src[0]] | (tile_expand[src[1]] << 1) |
+        (tile_expand[src[2]] << 2) | (tile_expand[src[3]] << 3);
+    memcpy(dst + row * 8, &pixels, 8);
+    pixels = tile_expand_flip[src[0]] | (tile_expand_flip[src[1]] << 1) |
+        (tile_expand_flip[src[2]] << 2) | (tile_expand_flip[src[3]] << 3);
+    memcpy(flip + row * 8, &pixels, 8);
+    src += 4;
+  }
+}
+
+#ifdef TILE_DECODE_X86
+/***
+ * SSE2: two rows per iteration. The 8 plane bytes of the two rows are
+ * broadcast with unpacks so that every plane fills one vector, 8 copies for
+ * each row. Testing against a per-pixel bit mask turns that into 0x00/0xff
+ * per pixel, which selects the plane's weight. The mirrored mask yields the
+ * flipped rows from the same broadcasts.
+ */
+__attribute__((target("sse2")))
+static void tile_decode_sse2(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows) {
+  const __m128i mask = _mm_set_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+  const __m128i mask_flip = _mm_set_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+      (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+  __m128i x, y, lo, hi, a01, a23, b01, b23, plane[4], out, out_flip, weight;
+  unsigned row, p;
+
+  for (row = 0; row + 2 <= rows; row += 2) {
+    x = _mm_loadl_epi64((const __m128i*)src);
+    y = _mm_unpacklo_epi8(x, x);
+    lo = _mm_unpacklo_epi16(y, y);
+    hi = _mm_unpackhi_epi16(y, y);
+    a01 = _mm_unpacklo_epi32(lo, lo);
+    a23 = _mm_unpackhi_epi32(lo, lo);
+    b01 = _mm_unpacklo_epi32(hi, hi);
+    b23 = _mm_unpackhi_epi32(hi, hi);
+    plane[0] = _mm_unpacklo_epi64(a01, b01);
+    plane[1] = _mm_unpackhi_epi64(a01, b01);
+    plane[2] = _mm_unpacklo_epi64(a23, b23);
+    plane[3] = _mm_unpackhi_epi64(a23, b23);
+
+    out = _mm_setzero_si128();
+    out_flip = _mm_setzero_si128();
+    for (p = 0; p < 4; p++) {
+      weight = _mm_set1_epi8(1 << p);
+      out = _mm_or_si128(out, _mm_and_si128(weight,
+          _mm_cmpeq_epi8(_mm_and_si128(plane[p], mask), mask)));
+      out_flip = _mm_or_si128(out_flip, _mm_and_si128(weight,
+          _mm_cmpeq_epi8(_mm_and_si128(plane[p], mask_flip), mask_flip)));
+    }
+    _mm_storeu_si128((__m128i*)(dst + row * 8), out);
+    _mm_storeu_si128((__m128i*)(flip + row * 8), out_flip);
+    src += 8;
+  }
+
+  if (row < rows)
+    tile_decode_scalar(src, dst + row * 8, flip + row * 8, rows - row);
+}
+
+/***
+ * AVX2: four rows per iteration. The 16 source bytes are broadcast to both
+ * lanes and one byte shuffle per plane picks the plane byte of the row
+ * every output pixel belongs to.
+ */
+__attribute__((target("avx2")))
+static void tile_decode_avx2(const uint8_t* src, uint8_t* dst, uint8_t* flip,
+    unsigned rows) {
+  const __m256i mask = _mm256_set1_epi64x(0x0102040810204080LL);
+  const __m256i mask_flip = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+  /* Plane 0 byte of rows 0 and 1 in the low lane, rows 2 and 3 in the
+   * high lane, both lanes hold all four rows */
+  const __m256i index = _mm256_set_epi8(
+      12, 12, 12, 12, 12, 12, 12, 12, 8, 8, 8, 8, 8, 8, 8, 8,
+      4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+  __m256i x, plane, out, out_flip, weight;
+  unsigned row, p;
+
+  for (row = 0; row + 4 <= rows; row += 4) {
+    x = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)src));
+    out = _mm256_setzero_si256();
+    out_flip = _mm256_setzero_si256();
+    for (p = 0; p < 4; p++) {
+      plane = _mm256_shuffle_epi8(x, _mm256_add_epi8(index, _mm256_set1_epi8(p)));
+      weight = _mm256_set1_epi8(1 << p);
+      out = _mm256_or_si256(out, _mm256_and_si256(weight,
+          _mm256_cmpeq_epi8(_mm256_and_si256(plane, mask), mask)));
+      out_flip = _mm256_or_si256(out_flip, _mm256_and_si256(weight,
+          _mm256_cmpeq_epi8(_mm256_and_si256(plane, mask_flip), mask_flip)));
+    }
+    _mm256_storeu_si256((__m256i*)(dst + row * 8), out);
+    _mm256_storeu_si256((__m256i*)(flip + row * 8), out_flip);
+    src += 16;
+  }
+
+  if (row < rows)
+    tile_decode_sse2(src, dst + row * 8, flip + row * 8, rows - row);
+}
+#endif
+
+static const struct tile_decode_kernel tile_decode_all[] = {
+  { "reference", tile_decode_reference },
+  { "scalar", tile_decode_scalar },
+#ifdef TILE_DECODE_X86
+  { "sse2", tile_decode_sse2 },
+  { "avx2", tile_decode_avx2 },
+#endif
+};
+
+/* Kernels the host CPU can run, slowest first */
+const struct tile_decode_kernel* tile_decode_kernels(unsigned* count) {
+  *count = 2;
+#ifdef TILE_DECODE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    *count = 3;
+  if (__builtin_cpu_supports("avx2"))
+    *count = 4;
+#endif
+  return tile_decode_all;
+}
+
+/* Build the lookup tables and pick the fastest kernel via CPUID */
+void tile_decode_init(void) {
+  unsigned i, bit, count;
+
+  /* Every machine calls this, the tables only have to be built once */
+  if (tile_expand_built)
+    return;
+  tile_expand_built = 1;
+  for (i = 0; i < 256; i++) {
+    tile_expand[i] = 0;
+    tile_expand_flip[i] = 0;
+    for (bit = 0; bit < 8; bit++) {
+      if (i & (0x80 >> bit))
+        tile_expand[i] |= 1ULL << (bit * 8);
+      if (i & (0x01 << bit))
+        tile_expand_flip[i] |= 1ULL << (bit * 8);
+    }
+  }
+
+  /* The SSE2 kernel loses to the table lookups, bench/tile_decode_bench
+   * puts it at about 1.5 times the time of the scalar one. Only AVX2 is
+   * worth dispatching to */
+  tile_decode_kernels(&count);
+  tile_decode = tile_decode_scalar;
+#ifdef TILE_DECODE_X86
+  if (count > 3)
+    tile_decode = tile_decode_avx2;
+#endif
+}
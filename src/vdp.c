@@ -0,0 +1,218 @@
+/*
+ * This file is part of the SGGEmu project.
+ *
+ * Copyright (C) 2014 Julian Vetter <julian@sec.t-labs.tu-berlin.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "z80.h"
+#include "vdp.h"
+#include "sched.h"
+#include "render.h"
+#include "machine.h"
+
+static void vdp_schedule_frame(void) {
+  sched_add(SCHED_FRAME_IRQ, machine->vdp.frame_start + VDP_VBLANK_LINE * VDP_LINE_CYCLES);
+  sched_add(SCHED_FRAME_END, machine->vdp.frame_start + VDP_FRAME_CYCLES);
+  /* The line counter is reloaded during vblank and underflows at the end
+   * of the active line given by R10 */
+  if (machine->vdp.line_reload <= VDP_ACTIVE_LINES)
+    sched_add(SCHED_LINE_IRQ, machine->vdp.frame_start +
+        (machine->vdp.line_reload + 1) * VDP_LINE_CYCLES);
+}
+
+static void vdp_line_irq_event(uint64_t when) {
+  uint16_t line = (when - machine->vdp.frame_start) / VDP_LINE_CYCLES - 1;
+
+  machine->vdp.line_irq = 1;
+  vdp_update_irq();
+
+  /* Counter is reloaded from R10 on underflow */
+  line += machine->vdp.regs[10] + 1;
+  if (line <= VDP_ACTIVE_LINES)
+    sched_add(SCHED_LINE_IRQ, machine->vdp.frame_start + (line + 1) * VDP_LINE_CYCLES);
+}
+
+static void vdp_frame_irq_event(uint64_t when) {
+  (void)when;
+  machine->vdp.status |= VDP_STATUS_VBLANK;
+  vdp_update_irq();
+}
+
+static void vdp_frame_end_event(uint64_t when) {
+  /* Finish the picture before the next frame starts */
+  render_frame_end();
+
+  machine->vdp.vscroll = machine->vdp.regs[9];
+  machine->vdp.frame_start = when;
+  machine->vdp.frame++;
+  machine->vdp.line_reload = machine->vdp.regs[10];
+  vdp_schedule_frame();
+}
+
+void vdp_init(void) {
+  memset(&machine->vdp, 0, sizeof(machine->vdp));
+  machine->vdp.frame_start = machine->z80.cycles;
+  machine->vdp.line_reload = 0xff;
+
+  sched_register(SCHED_LINE_IRQ, vdp_line_irq_event);
+  sched_register(SCHED_FRAME_IRQ, vdp_frame_irq_event);
+  sched_register(SCHED_FRAME_END, vdp_frame_end_event);
+  vdp_schedule_frame();
+  render_init();
+}
+
+uint16_t vdp_current_line(void) {
+  return (machine->z80.cycles - machine->vdp.frame_start) / VDP_LINE_CYCLES;
+}
+
+/* Dot of the current line, 342 per line */
+uint16_t vdp_current_dot(void) {
+  return (machine->z80.cycles - machine->vdp.frame_start) % VDP_LINE_CYCLES * 342 / VDP_LINE_CYCLES;
+}
+
+/* Cycle the next scanline, and with it the V counter, starts on */
+uint64_t vdp_next_line(void) {
+  return machine->vdp.frame_start + (vdp_current_line() + 1) * VDP_LINE_CYCLES;
+}
+
+/* Cycle the V counter reads the given value next, searching one frame.
+ * The current cycle if it reads the value already */
+uint64_t vdp_vcounter_reached(uint8_t value) {
+  uint16_t line = vdp_current_line();
+  uint16_t i, l;
+
+  for (i = 0; i < VDP_LINES; i++) {
+    l = (line + i) % VDP_LINES;
+    if (((l > 0xda) ? l - 6 : l) != value)
+      continue;
+    if (i == 0)
+      return machine->z80.cycles;
+    return machine->vdp.frame_start + (line + i) * (uint64_t)VDP_LINE_CYCLES;
+  }
+  return SCHED_NEVER;
+}
+
+/* The VDP drives the CPU's maskable interrupt line */
+void vdp_update_irq(void) {
+  z80_set_irq(((machine->vdp.status & VDP_STATUS_VBLANK) && (machine->vdp.regs[1] & 0x20)) ||
+      (machine->vdp.line_irq && (machine->vdp.regs[0] & 0x10)));
+}
+
+uint8_t vdp_data_read(uint8_t port) {
+  uint8_t value = machine->vdp.read_buffer;
+  (void)port;
+
+  machine->vdp.latch_full = 0;
+  machine->vdp.read_buffer = page_read(&machine->pages, PAGE_VRAM + machine->vdp.addr);
+  machine->vdp.addr = (machine->vdp.addr + 1) & (VRAM_SZ - 1);
+  return value;
+}
+
+void vdp_data_write(uint8_t port, uint8_t value) {
+  uint8_t index;
+  (void)port;
+
+  machine->vdp.latch_full = 0;
+  if (machine->vdp.code == VDP_CODE_CRAM_WRITE) {
+    /* The Game Gear latches the even byte and writes both bytes of the
+     * 12 bit colour on the odd address */
+    if (machine->vdp.addr & 1) {
+      index = (machine->vdp.addr & (CRAM_SZ - 1)) >> 1;
+      render_write(RENDER_CRAM, index,
+          machine->vdp.cram_latch | ((value & 0x0f) << 8));
+      machine->vdp.cram[index * 2] = machine->vdp.cram_latch;
+      machine->vdp.cram[index * 2 + 1] = value & 0x0f;
+    } else {
+      machine->vdp.cram_latch = value;
+    }
+  } else {
+    render_write(RENDER_VRAM, machine->vdp.addr, value);
+    page_write(&machine->pages, PAGE_VRAM + machine->vdp.addr, value);
+  }
+  machine->vdp.read_buffer = value;
+  machine->vdp.addr = (machine->vdp.addr + 1) & (VRAM_SZ - 1);
+}
+
+uint8_t vdp_control_read(uint8_t port) {
+  uint8_t value;
+  (void)port;
+
+  /* Sprite flags are raised while lines are drawn */
+  render_flags_sync(vdp_current_line());
+  value = machine->vdp.status | 0x1f;
+
+  /* Reading the status clears all flags and the control latch */
+  machine->vdp.status = 0;
+  machine->vdp.line_irq = 0;
+  machine->vdp.latch_full = 0;
+  vdp_update_irq();
+  return value;
+}
+
+void vdp_control_write(uint8_t port, uint8_t value) {
+  (void)port;
+
+  if (!machine->vdp.latch_full) {
+    machine->vdp.latch = value;
+    machine->vdp.addr = (machine->vdp.addr & 0x3f00) | value;
+    machine->vdp.latch_full = 1;
+    return;
+  }
+
+  machine->vdp.latch_full = 0;
+  machine->vdp.code = value >> 6;
+  machine->vdp.addr = ((value & 0x3f) << 8) | machine->vdp.latch;
+
+  switch (machine->vdp.code) {
+  case VDP_CODE_VRAM_READ:
+    machine->vdp.read_buffer = page_read(&machine->pages, PAGE_VRAM + machine->vdp.addr);
+    machine->vdp.addr = (machine->vdp.addr + 1) & (VRAM_SZ - 1);
+    break;
+  case VDP_CODE_REG_WRITE:
+    render_write(RENDER_REG, value & 0x0f, machine->vdp.latch);
+    machine->vdp.regs[value & 0x0f] = machine->vdp.latch;
+#ifdef DEBUG
+    printf("VDP R%u = 0x%02x\n", value & 0x0f, machine->vdp.latch);
+#endif
+    /* R0 and R1 hold the interrupt enables */
+    if ((value & 0x0f) < 2)
+      vdp_update_irq();
+    break;
+  }
+}
+
+uint8_t vdp_vcounter_read(uint8_t port) {
+  uint16_t line = vdp_current_line();
+  (void)port;
+
+  /* NTSC 192 line mode counts 0x00 - 0xda and jumps back to 0xd5 */
+  if (line > 0xda)
+    return line - 6;
+  return line;
+}
+
+uint8_t vdp_hcounter_read(uint8_t port) {
+  uint32_t cycle = (machine->z80.cycles - machine->vdp.frame_start) % VDP_LINE_CYCLES;
+  (void)port;
+
+  /* 342 pixels per line, the counter runs at half the pixel clock */
+  return (cycle * 342 / VDP_LINE_CYCLES) >> 1;
+}
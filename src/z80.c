@@ -25,34 +25,11 @@
 #include "encodings.h"
 #include "z80.h"
 #include "loader.h"
-
-uint8_t* rom_handle;
-
-/***
-* Struct which holds the Z80's processor state
-*/
-struct z80_vCPU {
-  uint8_t gp[12]; /* General Purpose Registers */
-  uint8_t acc;  /* Accumulator */
-  uint8_t flags;  /* Flags register */
-  uint8_t acc_;   /* A' */
-  uint8_t flags_; /* F' */
-  uint8_t r;    /* Memory Refresh */
-  uint8_t i;    /* Interrupt Vector */
-  uint16_t ix;  /* Index Register */
-  uint16_t iy;  /* Index Register */
-  uint16_t sp;  /* Stack Pointer */
-  uint16_t pc;  /* Program Counter */
-  uint8_t iff1;   /*Interrupt Enable/Disable Flip-Flop I*/
-  uint8_t iff2;   /*Interrupt Enable/Disable Flip-Flop II*/
-};
-
-struct z80_state {
-  struct z80_vCPU vcpu;
-  uint8_t stack[256];
-  uint8_t ram[RAM_SZ];  /* 8KB RAM */
-  uint8_t vram[VRAM_SZ]; /* 16KB VRAM */
-} z80_state;
+#include "io.h"
+#include "vdp.h"
+#include "sched.h"
+#include "psg.h"
+#include "machine.h"
 
 const char* z80_decode_gp_reg(uint16_t enc) {
   switch(enc) {
@@ -69,35 +46,104 @@ const char* z80_decode_gp_reg(uint16_t enc) {
 }
 
 void dump_stack() {
-  uint16_t i;
+  uint32_t i;
+  uint32_t top = (machine->z80.vcpu.sp & 0xfff0) + 64;
 
   printf("TOP of STACK:\n-----------------------------------");
-  for(i = 255; i > 191; i--) {
-    if((i % 16) == 15)
+  for(i = machine->z80.vcpu.sp & 0xfff0; i < top; i++) {
+    if((i % 16) == 0)
       printf("\n%04x: ", i);
-    if(z80_state.vcpu.sp == i)
-      printf("[%02x] ", z80_state.stack[i]);
+    if(machine->z80.vcpu.sp == i)
+      printf("[%02x] ", z80_read_byte(i & 0xffff));
     else
-      printf(" %02x  ", z80_state.stack[i]);
+      printf(" %02x  ", z80_read_byte(i & 0xffff));
   }
   printf("\n-----------------------------------\n\n");
 }
 
+/***
+ * T-states of the unprefixed opcodes. Conditional instructions list the
+ * cost of the untaken path, the decoder adds the rest when a branch is
+ * taken. 0xCB, 0xDD, 0xED and 0xFD only count the prefix fetch.
+ */
+static const uint8_t z80_cycles_main[256] = {
+  /*       0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f */
+  /* 0 */  4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,
+  /* 1 */  8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,
+  /* 2 */  7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,
+  /* 3 */  7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,
+  /* 4 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* 5 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* 6 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* 7 */  7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* 8 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* 9 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* a */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* b */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+  /* c */  5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  8, 10, 17,  7, 11,
+  /* d */  5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  4,  7, 11,
+  /* e */  5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,
+  /* f */  5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  4,  7, 11,
+};
+
+/* T-states of the 0xED prefixed opcodes, including the prefix */
+static uint8_t z80_cycles_ed(uint8_t insn) {
+  if (insn >= 0x40 && insn < 0x80) {
+    switch (insn & 0x07) {
+    case 0: /* IN r, (C) */
+    case 1: /* OUT (C), r */
+      return 12;
+    case 2: /* SBC/ADC HL, ss */
+      return 15;
+    case 3: /* LD (nn), dd / LD dd, (nn) */
+      return 20;
+    case 5: /* RETN / RETI */
+      return 14;
+    case 7: /* LD I/R, A, LD A, I/R, RRD, RLD */
+      if (insn == 0x67 || insn == 0x6f)
+        return 18;
+      return (insn < 0x60) ? 9 : 8;
+    default: /* NEG, IM */
+      return 8;
+    }
+  }
+  /* Block transfer, search and I/O, repeating forms add 5 per iteration */
+  if ((insn & 0xe4) == 0xa0)
+    return 16;
+  return 8;
+}
+
+/* T-states of a 0xDD/0xFD prefixed opcode after the prefix */
+static uint8_t z80_cycles_index(uint8_t insn) {
+  /* Accesses to (IX+d) and (IY+d) add the displacement calculation */
+  if ((insn & 0x07) == 0x06 || (insn & 0xf8) == 0x70)
+    return z80_cycles_main[insn] + 8;
+  return z80_cycles_main[insn];
+}
+
 void z80_emulate_cycle(void) {
-  /* Fetch OpCode */
+  /* Fetch, decode and execute a single instruction */
   z80_decode_insn();
-  /* Decode OpCode */
-  /* Execute OpCode */
   /* Update Timers */
-  return;
+  sched_dispatch(machine->z80.cycles);
 }
 
-void z80_init(const char* rom_path) {
-  /* Set PC to first address in RAM */
-  rom_handle = (uint8_t*)malloc(512 * 1024 * sizeof(uint8_t));
-  loader_load_rom(rom_path, rom_handle);
-  z80_state.vcpu.pc = 0x8000;
-  z80_state.vcpu.sp = 255;
+/* Power up the current machine, its ROM is loaded already */
+void z80_init(void) {
+  /* Mapper powers up with banks 0, 1 and 2 in the three slots */
+  machine->z80.mapper[1] = 0;
+  machine->z80.mapper[2] = 1;
+  machine->z80.mapper[3] = 2;
+  sched_init();
+  io_init();
+  /* Region 3 and 4 are Master System cartridges */
+  machine->io.sms_mode = (loader_rom_region(machine->rom) == 3 ||
+      loader_rom_region(machine->rom) == 4);
+  vdp_init();
+  psg_init();
+  /* Without a BIOS the cartridge starts at the reset vector */
+  machine->z80.vcpu.pc = 0x0000;
+  machine->z80.vcpu.sp = 0xdff0;
   return;
 }
 
@@ -110,69 +156,69 @@ int z80_flag_set(uint8_t mask, uint8_t flag) {
 int z80_condition_true(uint8_t cc) {
   switch(cc) {
   case 0x0: /*NZ non zero*/
-    return !(z80_state.vcpu.flags & ZERO_FLAG);
+    return !(machine->z80.vcpu.flags & ZERO_FLAG);
   case 0x1: /*Z zero*/
-    return (z80_state.vcpu.flags & ZERO_FLAG);
+    return (machine->z80.vcpu.flags & ZERO_FLAG);
   case 0x2: /*NC no carry*/
-    return !(z80_state.vcpu.flags & CARRY_FLAG);
+    return !(machine->z80.vcpu.flags & CARRY_FLAG);
   case 0x3: /*C carry*/
-    return (z80_state.vcpu.flags & CARRY_FLAG);
+    return (machine->z80.vcpu.flags & CARRY_FLAG);
   case 0x4: /*PO parity odd*/
-    return !(z80_state.vcpu.flags & PARITYOVERFLOW_FLAG);
+    return !(machine->z80.vcpu.flags & PARITYOVERFLOW_FLAG);
   case 0x5: /*PE parity even*/
-    return (z80_state.vcpu.flags & PARITYOVERFLOW_FLAG);
+    return (machine->z80.vcpu.flags & PARITYOVERFLOW_FLAG);
   case 0x6: /*P sign positive*/
-    return !(z80_state.vcpu.flags & SIGN_FLAG);
+    return !(machine->z80.vcpu.flags & SIGN_FLAG);
   case 0x7: /*M sign negative*/
-    return (z80_state.vcpu.flags & SIGN_FLAG);
+    return (machine->z80.vcpu.flags & SIGN_FLAG);
   }
   return 0;
 }
 
 void z80_set_carry_flag() {
-  z80_state.vcpu.flags |= CARRY_FLAG;
+  machine->z80.vcpu.flags |= CARRY_FLAG;
 }
 
 void z80_clear_carry_flag() {
-  z80_state.vcpu.flags &= ~CARRY_FLAG;
+  machine->z80.vcpu.flags &= ~CARRY_FLAG;
 }
 
 void z80_update_flags(uint8_t value, uint8_t mask) {
   if(z80_flag_set(mask, SIGN_FLAG)) {
     /* S is set if result is negative; reset otherwise*/
     if((value & 0x80) == 0x80)
-      z80_state.vcpu.flags |= SIGN_FLAG;
+      machine->z80.vcpu.flags |= SIGN_FLAG;
     else
-      z80_state.vcpu.flags &= ~SIGN_FLAG;
+      machine->z80.vcpu.flags &= ~SIGN_FLAG;
   }
 
   if(z80_flag_set(mask, ZERO_FLAG)) {
     /* Z is set if result is zero; reset otherwise */
     if (value == 0)
-      z80_state.vcpu.flags |= ZERO_FLAG;
+      machine->z80.vcpu.flags |= ZERO_FLAG;
     else
-      z80_state.vcpu.flags &= ~ZERO_FLAG;
+      machine->z80.vcpu.flags &= ~ZERO_FLAG;
   }
 
   if(z80_flag_set(mask, HALFCARRY_FLAG)) {
     /* H is set if carry from bit 3; reset otherwise */
     if((value & 0x10) == 0x10)
-      z80_state.vcpu.flags |= HALFCARRY_FLAG;
+      machine->z80.vcpu.flags |= HALFCARRY_FLAG;
     else
-      z80_state.vcpu.flags &= ~HALFCARRY_FLAG;
+      machine->z80.vcpu.flags &= ~HALFCARRY_FLAG;
   }
 
   if(z80_flag_set(mask, ADDSUB_FLAG)) {
     /* N is reset */
-    z80_state.vcpu.flags &= ~ADDSUB_FLAG;
+    machine->z80.vcpu.flags &= ~ADDSUB_FLAG;
   }
 
   if(z80_flag_set(mask, PARITYOVERFLOW_FLAG)) {
     /* Store state of iff2 in parity flag*/
-    if(z80_state.vcpu.iff2)
-      z80_state.vcpu.flags |= PARITYOVERFLOW_FLAG;
+    if(machine->z80.vcpu.iff2)
+      machine->z80.vcpu.flags |= PARITYOVERFLOW_FLAG;
     else
-      z80_state.vcpu.flags &= ~PARITYOVERFLOW_FLAG;
+      machine->z80.vcpu.flags &= ~PARITYOVERFLOW_FLAG;
   }
 }
 
@@ -217,12 +263,293 @@ int z80_ram_valid(uint16_t value) {
 
 uint8_t z80_fetch_byte(void) {
   /* Check if PC points to valid position */
-  //if (!z80_ram_valid(z80_state.vcpu.pc)) {
-  //  printf("Unknown PC position %u\n", z80_state.vcpu.pc);
+  //if (!z80_ram_valid(machine->z80.vcpu.pc)) {
+  //  printf("Unknown PC position %u\n", machine->z80.vcpu.pc);
   //  return 0;
   //}
   /* Increment PC after returning instruction */
-  return rom_handle[z80_state.vcpu.pc++];
+  return z80_read_byte(machine->z80.vcpu.pc++);
+}
+
+/***
+ * Memory map of the Game Gear: three 16KB ROM slots selected by the Sega
+ * mapper (the first 1KB is never paged out) and 8KB of RAM mirrored in
+ * 0xc000 - 0xffff.
+ */
+uint8_t z80_read_byte(uint16_t addr) {
+  if (addr >= 0xc000)
+    return page_read(&machine->pages, PAGE_RAM + (addr & (RAM_SZ - 1)));
+  if (addr < 0x0400)
+    return machine->rom[addr];
+  return machine->rom[((machine->z80.mapper[1 + (addr >> 14)] * ROM_BANK_SZ) |
+      (addr & (ROM_BANK_SZ - 1))) & (ROM_SZ - 1)];
+}
+
+void z80_write_byte(uint16_t addr, uint8_t value) {
+  if (addr < 0xc000)
+    return;
+  page_write(&machine->pages, PAGE_RAM + (addr & (RAM_SZ - 1)), value);
+  if (addr >= 0xfffc)
+    machine->z80.mapper[addr & 0x3] = value;
+}
+
+/* Map a 3 bit register encoding to its storage, A lives outside of gp[] */
+static uint8_t* z80_reg(uint8_t enc) {
+  if (enc == A)
+    return &machine->z80.vcpu.acc;
+  return &machine->z80.vcpu.gp[enc];
+}
+
+static int z80_parity(uint8_t value) {
+  value ^= value >> 4;
+  value ^= value >> 2;
+  value ^= value >> 1;
+  return !(value & 1);
+}
+
+/* Flags after IN r, (C): S, Z and P/V from the value, H and N reset */
+static void z80_in_flags(uint8_t value) {
+  machine->z80.vcpu.flags &= CARRY_FLAG;
+  if (value & 0x80)
+    machine->z80.vcpu.flags |= SIGN_FLAG;
+  if (value == 0)
+    machine->z80.vcpu.flags |= ZERO_FLAG;
+  if (z80_parity(value))
+    machine->z80.vcpu.flags |= PARITYOVERFLOW_FLAG;
+}
+
+/***
+ * Block I/O (INI, IND, OUTI, OUTD and their repeating forms). The repeating
+ * forms rewind the PC while B is non-zero so that every iteration is a
+ * separate, interruptible instruction like on the real CPU.
+ */
+static void z80_block_io(uint8_t insn) {
+  uint16_t hl = (machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L];
+  uint8_t port = machine->z80.vcpu.gp[reg_C];
+
+  /* Bit 0 selects OUT, bit 3 decrement and bit 4 repeat */
+  if (insn & 0x01) {
+    machine->z80.vcpu.gp[reg_B]--;
+    io_write(port, z80_read_byte(hl));
+  } else {
+    z80_write_byte(hl, io_read(port));
+    machine->z80.vcpu.gp[reg_B]--;
+  }
+
+  hl += (insn & 0x08) ? -1 : 1;
+  machine->z80.vcpu.gp[reg_H] = hl >> 8;
+  machine->z80.vcpu.gp[reg_L] = hl & 0xff;
+
+  machine->z80.vcpu.flags |= ADDSUB_FLAG;
+  if (machine->z80.vcpu.gp[reg_B] == 0)
+    machine->z80.vcpu.flags |= ZERO_FLAG;
+  else
+    machine->z80.vcpu.flags &= ~ZERO_FLAG;
+
+  if ((insn & 0x10) && machine->z80.vcpu.gp[reg_B] != 0) {
+    machine->z80.vcpu.pc -= 2;
+    machine->z80.cycles += 5;
+  }
+}
+
+/* Flags of A - value without storing the result */
+static void z80_compare(uint8_t value) {
+  uint8_t result = machine->z80.vcpu.acc - value;
+  uint8_t flags = ADDSUB_FLAG;
+
+  if (result & 0x80)
+    flags |= SIGN_FLAG;
+  if (result == 0)
+    flags |= ZERO_FLAG;
+  if ((machine->z80.vcpu.acc & 0x0f) < (value & 0x0f))
+    flags |= HALFCARRY_FLAG;
+  if ((machine->z80.vcpu.acc ^ value) & (machine->z80.vcpu.acc ^ result) & 0x80)
+    flags |= PARITYOVERFLOW_FLAG;
+  if (machine->z80.vcpu.acc < value)
+    flags |= CARRY_FLAG;
+  machine->z80.vcpu.flags = flags;
+}
+
+/***
+ * Idle loop detection, called when a conditional relative jump branches
+ * back. Recognizes side-effect free polling loops of the form
+ *
+ *   loop: IN A, (n)
+ *         CP m | AND m | AND A | OR A
+ *         JR NZ/Z, loop
+ *
+ * Such a loop can only exit once the polled port changes, so all whole
+ * iterations up to that point (or the next event) are skipped at once.
+ */
+static void z80_idle_loop(uint16_t target, uint16_t branch) {
+  uint8_t port, insn;
+  uint16_t length;
+  uint32_t iteration;
+  uint64_t wake, iterations;
+
+  if (target == branch) {
+    /* JR $ can only be left by an interrupt */
+    wake = machine->sched.deadline;
+    iteration = 12;
+  } else {
+    if (z80_read_byte(target) != 0xdb)
+      return;
+    port = z80_read_byte(target + 1);
+    insn = z80_read_byte(target + 2);
+
+    /* IN A, (n) 11 + compare + JR cc taken 12 */
+    if (insn == 0xfe || insn == 0xe6) {
+      length = 6;
+      iteration = 11 + 7 + 12;
+    } else if (insn == 0xa7 || insn == 0xb7) {
+      length = 5;
+      iteration = 11 + 4 + 12;
+    } else {
+      return;
+    }
+    /* The branch has to be the last instruction of the loop */
+    if (branch != (uint16_t)(target + length - 2))
+      return;
+
+    wake = io_read_stable_until(port);
+    if (wake == 0)
+      return;
+    /* CP m; JR NZ on the V counter waits for an exact line */
+    if (insn == 0xfe && z80_read_byte(branch) == 0x20 &&
+        io_read_map[port] == vdp_vcounter_read)
+      wake = vdp_vcounter_reached(z80_read_byte(target + 3));
+    if (wake > machine->sched.deadline)
+      wake = machine->sched.deadline;
+  }
+
+  if (wake <= machine->z80.cycles)
+    return;
+
+  iterations = (wake - machine->z80.cycles) / iteration;
+  machine->z80.cycles += iterations * iteration;
+  machine->z80.idle_cycles += iterations * iteration;
+}
+
+static void z80_push16(uint16_t value) {
+  z80_write_byte(--machine->z80.vcpu.sp, value >> 8);
+  z80_write_byte(--machine->z80.vcpu.sp, value & 0xff);
+}
+
+static uint16_t z80_pop16(void) {
+  uint16_t value = z80_read_byte(machine->z80.vcpu.sp++);
+  return value | (z80_read_byte(machine->z80.vcpu.sp++) << 8);
+}
+
+void z80_set_irq(uint8_t level) {
+  /* A rising edge ends the running block so the CPU can take it */
+  if (level && !machine->z80.irq_line)
+    sched_break();
+  machine->z80.irq_line = level;
+}
+
+void z80_nmi(void) {
+  machine->z80.nmi_pending = 1;
+  sched_break();
+}
+
+/* Accept a pending NMI or maskable interrupt */
+static void z80_interrupt(void) {
+  if (machine->z80.nmi_pending) {
+    machine->z80.nmi_pending = 0;
+    machine->z80.halted = 0;
+    machine->z80.vcpu.iff1 = 0;
+    z80_push16(machine->z80.vcpu.pc);
+    machine->z80.vcpu.pc = 0x0066;
+    machine->z80.cycles += 11;
+    return;
+  }
+
+  if (!machine->z80.irq_line || !machine->z80.vcpu.iff1)
+    return;
+
+  machine->z80.halted = 0;
+  machine->z80.vcpu.iff1 = 0;
+  machine->z80.vcpu.iff2 = 0;
+  z80_push16(machine->z80.vcpu.pc);
+
+  switch (machine->z80.vcpu.im) {
+  case 2:
+    /* Nothing drives the data bus, so the vector low byte reads 0xff */
+    machine->z80.vcpu.pc = z80_read_byte((machine->z80.vcpu.i << 8) | 0xff) |
+        (z80_read_byte(((machine->z80.vcpu.i << 8) | 0xff) + 1) << 8);
+    machine->z80.cycles += 19;
+    break;
+  default:
+    /* IM 0 executes 0xff from the floating bus, which is RST 38h */
+    machine->z80.vcpu.pc = 0x0038;
+    machine->z80.cycles += 13;
+    break;
+  }
+}
+
+/***
+ * Run the CPU until the given cycle. Instructions are executed in one block
+ * up to the next scheduled event, then the due events are dispatched and
+ * pending interrupts are accepted before the next block starts. With a
+ * stop_pc other than -1 it also stops before executing the instruction
+ * there and returns 1; inlined into each caller, so z80_run() does not
+ * pay for the check.
+ */
+static inline __attribute__((always_inline)) int z80_run_loop(uint64_t until,
+    int32_t stop_pc) {
+  uint64_t next;
+
+  while (machine->z80.cycles < until) {
+    if (machine->z80.ei_delay) {
+      /* EI enables interrupts only after the following instruction, so
+       * that one can be the stop as well; the delay is kept for later */
+      if (stop_pc >= 0 && !machine->z80.halted && machine->z80.vcpu.pc == stop_pc)
+        return 1;
+      machine->z80.ei_delay = 0;
+      if (!machine->z80.halted)
+        z80_decode_insn();
+    } else {
+      z80_interrupt();
+
+      next = sched_next();
+      machine->sched.deadline = (next < until) ? next : until;
+
+      if (machine->z80.halted) {
+        /* HALT executes NOPs until an interrupt arrives, nothing but an
+         * event can end it so skip straight to the deadline */
+        if (machine->sched.deadline > machine->z80.cycles) {
+          next = (machine->sched.deadline - machine->z80.cycles + 3) & ~3ULL;
+          machine->z80.cycles += next;
+          machine->z80.idle_cycles += next;
+        }
+      } else {
+        while (machine->z80.cycles < machine->sched.deadline) {
+          if (stop_pc >= 0 && machine->z80.vcpu.pc == stop_pc)
+            return 1;
+          z80_decode_insn();
+        }
+      }
+    }
+    sched_dispatch(machine->z80.cycles);
+  }
+  return 0;
+}
+
+void z80_run(uint64_t until) {
+  z80_run_loop(until, -1);
+}
+
+/***
+ * Like z80_run(), but stop early when the CPU is about to execute the
+ * instruction at pc. Returns 1 if it did, running on continues from there.
+ */
+int z80_run_to(uint64_t until, uint16_t pc) {
+  return z80_run_loop(until, pc);
+}
+
+/* Run until the VDP finished the current frame */
+void z80_run_frame(void) {
+  z80_run(machine->vdp.frame_start + VDP_FRAME_CYCLES);
 }
 
 /***
@@ -236,18 +563,27 @@ void z80_decode_insn() {
   uint16_t tmp;
 
   operand_1 = z80_fetch_byte();
+  machine->z80.cycles += z80_cycles_main[operand_1];
 #ifdef DEBUG
-  printf("0x%04x:\t0x%02x\t", z80_state.vcpu.pc - 1, operand_1);
+  printf("0x%04x:\t0x%02x\t", machine->z80.vcpu.pc - 1, operand_1);
+#endif
+
+  /* HALT */
+  if (operand_1 == 0x76) {
+    machine->z80.halted = 1;
+    sched_break();
+#ifdef DEBUG
+    printf("HALT\n");
 #endif
 
   /* LD r, r' */
-  if ((operand_1 & 0xC0) == 0x40) {
+  } else if ((operand_1 & 0xC0) == 0x40) {
     /* Get source and destination registers */
     s_reg = z80_get_s_reg(operand_1);
     t_reg = z80_get_t_reg(operand_1);
 
     /* Store value of source register in target register*/
-    z80_state.vcpu.gp[t_reg] = z80_state.vcpu.gp[s_reg];
+    machine->z80.vcpu.gp[t_reg] = machine->z80.vcpu.gp[s_reg];
 #ifdef DEBUG
     printf("LD %s, %s'\n", z80_decode_gp_reg(t_reg), z80_decode_gp_reg(s_reg));
 #endif
@@ -261,7 +597,7 @@ void z80_decode_insn() {
     t_reg = z80_get_t_reg(operand_1);
 
     /* Store operand_2 in target register */
-    z80_state.vcpu.gp[t_reg] = operand_2;
+    machine->z80.vcpu.gp[t_reg] = operand_2;
 #ifdef DEBUG
     printf("LD %s, 0x%0x\n", z80_decode_gp_reg(t_reg), operand_2);
 #endif
@@ -271,12 +607,12 @@ void z80_decode_insn() {
 
     t_reg = z80_get_t_reg(operand_1);
 
-    s_reg = ((z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L]);
+    s_reg = ((machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L]);
 
     if (!z80_ram_valid(s_reg)) {
       printf("Unkown source RAM address %u for LD instruction\n", s_reg);
     }
-    z80_state.vcpu.gp[t_reg] = z80_state.ram[s_reg];
+    machine->z80.vcpu.gp[t_reg] = z80_read_byte(s_reg);
 #ifdef DEBUG
     printf("LD r, (HL)\n");
 #endif
@@ -284,36 +620,37 @@ void z80_decode_insn() {
   } else if (operand_1 == 0xDD) {
     operand_2 = z80_fetch_byte();
     operand_3 = z80_fetch_byte();
+    machine->z80.cycles += z80_cycles_index(operand_2);
 
     /* LD r, (IX+d) */
     if((operand_2 & 0xC7) == 0x46) {
       t_reg = z80_get_t_reg(operand_2);
-      z80_state.vcpu.gp[t_reg] = z80_state.vcpu.ix + operand_3;
+      machine->z80.vcpu.gp[t_reg] = machine->z80.vcpu.ix + operand_3;
 #ifdef DEBUG
-      printf("LD %s, (0x%0x + 0x%0x)\n", z80_decode_gp_reg(t_reg), z80_state.vcpu.ix, operand_3);
+      printf("LD %s, (0x%0x + 0x%0x)\n", z80_decode_gp_reg(t_reg), machine->z80.vcpu.ix, operand_3);
 #endif
     /* LD (IX+d), r)*/
     } else if((operand_2 & 0xF8) == 0x70) {
       s_reg = z80_get_t_reg(operand_2);
-      t_reg = z80_state.vcpu.ix + operand_3;
+      t_reg = machine->z80.vcpu.ix + operand_3;
 
       if(!z80_ram_valid(t_reg)) {
         printf("Unknown target RAM address 0x%x for LD instruction\n", t_reg);
       }
-      z80_state.ram[t_reg] = s_reg;
+      z80_write_byte(t_reg, s_reg);
 
 #ifdef DEBUG
-      printf("LD (0x%0x + 0x%0x), %s\n", z80_state.vcpu.ix, operand_3, z80_decode_gp_reg(s_reg));
+      printf("LD (0x%0x + 0x%0x), %s\n", machine->z80.vcpu.ix, operand_3, z80_decode_gp_reg(s_reg));
 #endif
     /* LD (IX+d), n */
     } else if (operand_2 == 0x36) {
       operand_4 = z80_fetch_byte();
-      tmp = z80_state.vcpu.ix + operand_3;
+      tmp = machine->z80.vcpu.ix + operand_3;
 
       if(!z80_ram_valid(t_reg)) {
         printf("Unknown target RAM address 0x%x for LD instruction\n", t_reg);
       }
-      z80_state.ram[tmp] = operand_4;
+      z80_write_byte(tmp, operand_4);
 #ifdef DEBUG
       printf("LD (0x%04x), 0x%02x\n", tmp, operand_4);
 #endif
@@ -321,7 +658,7 @@ void z80_decode_insn() {
     } else if (operand_2 == 0x21) {
       operand_3 = z80_fetch_byte();
       operand_4 = z80_fetch_byte();
-      z80_state.vcpu.ix = ((operand_4 << 8) | operand_3);
+      machine->z80.vcpu.ix = ((operand_4 << 8) | operand_3);
 #ifdef DEBUG
       printf("LD IX, nn\n");
 #endif
@@ -346,7 +683,7 @@ void z80_decode_insn() {
           s_reg);
       }
 
-      z80_state.vcpu.ix = (z80_state.ram[t_reg] << 8) | z80_state.ram[s_reg];
+      machine->z80.vcpu.ix = (z80_read_byte(t_reg) << 8) | z80_read_byte(s_reg);
 #ifdef DEBUG
       printf("LD IX, (nn)\n");
 #endif
@@ -372,32 +709,30 @@ void z80_decode_insn() {
           s_reg);
       }
       /* Mask out upper 8bits of the ix and write to memory */
-      z80_state.ram[s_reg] = (uint8_t) z80_state.vcpu.ix;
+      z80_write_byte(s_reg, (uint8_t) machine->z80.vcpu.ix);
       /* Shift high bits to right and write to memory */
-      z80_state.ram[t_reg] = (uint8_t) (z80_state.vcpu.ix >> 8);
+      z80_write_byte(t_reg, (uint8_t) (machine->z80.vcpu.ix >> 8));
 #ifdef DEBUG
       printf("LD (nn), IX\n");
 #endif
 
     /* LD SP, IX */
     } else if (operand_2 == 0xF9) {
-      z80_state.vcpu.sp = z80_state.vcpu.ix;
+      machine->z80.vcpu.sp = machine->z80.vcpu.ix;
 #ifdef DEBUG
-      printf("LD SP, 0x%0x\n", z80_state.vcpu.ix);
+      printf("LD SP, 0x%0x\n", machine->z80.vcpu.ix);
 #endif
 
     /* PUSH IX */
     } else if (operand_2 == 0xE5) {
-      z80_state.vcpu.sp--;
-      z80_state.stack[z80_state.vcpu.sp] = z80_state.vcpu.ix;
+      z80_push16(machine->z80.vcpu.ix);
 #ifdef DEBUG
       printf("PUSH IX\n");
 #endif
 
     /* POP IX */
     } else if (operand_2 == 0xE1) {
-      z80_state.vcpu.ix = z80_state.stack[z80_state.vcpu.sp];
-      z80_state.vcpu.sp++;
+      machine->z80.vcpu.ix = z80_pop16();
 
 #ifdef DEBUG
       printf("POP IX\n");
@@ -405,8 +740,8 @@ void z80_decode_insn() {
 
     /* EX (SP), IX */
     } else if (operand_2 == 0xE3) {
-      s_reg = z80_state.vcpu.sp;
-      t_reg = z80_state.vcpu.sp+1;
+      s_reg = machine->z80.vcpu.sp;
+      t_reg = machine->z80.vcpu.sp+1;
 
       if(!z80_ram_valid(s_reg)) {
         printf("Unknown target RAM address 0x%x for PUSH qq \
@@ -419,11 +754,12 @@ void z80_decode_insn() {
       }
 
       /*Missuse operands 3 and 4 to store immediate values*/
-      operand_3 = (uint8_t) z80_state.vcpu.ix;
-      operand_4 = (uint8_t) (z80_state.vcpu.ix >> 8);
+      operand_3 = (uint8_t) machine->z80.vcpu.ix;
+      operand_4 = (uint8_t) (machine->z80.vcpu.ix >> 8);
 
-      z80_swap_reg(&z80_state.ram[s_reg], &operand_3);
-      z80_swap_reg(&z80_state.ram[t_reg], &operand_4);
+      machine->z80.vcpu.ix = (z80_read_byte(t_reg) << 8) | z80_read_byte(s_reg);
+      z80_write_byte(s_reg, operand_3);
+      z80_write_byte(t_reg, operand_4);
 #ifdef DEBUG
       printf("EX (SP), IX\n");
 #endif
@@ -447,22 +783,23 @@ void z80_decode_insn() {
   } else if (operand_1 == 0xFD) {
     operand_2 = z80_fetch_byte();
     operand_3 = z80_fetch_byte();
+    machine->z80.cycles += z80_cycles_index(operand_2);
     t_reg = z80_get_t_reg(operand_2);
 
-    z80_state.vcpu.gp[t_reg] = z80_state.vcpu.iy + operand_3;
+    machine->z80.vcpu.gp[t_reg] = machine->z80.vcpu.iy + operand_3;
 #ifdef DEBUG
-    printf("LD %s, (0x%0x + 0x%0x)\n", z80_decode_gp_reg(t_reg), z80_state.vcpu.iy, operand_3);
+    printf("LD %s, (0x%0x + 0x%0x)\n", z80_decode_gp_reg(t_reg), machine->z80.vcpu.iy, operand_3);
 #endif
 
   /* LD (HL), r */
   } else if ((operand_1 & 0xF8) == 0x70) {
-    t_reg = ((z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L]);
+    t_reg = ((machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L]);
 
     if(!z80_ram_valid(t_reg)) {
       printf("Unknown target RAM address 0x%x for LD instruction\n",
           t_reg);
     }
-    z80_state.ram[t_reg] = z80_get_s_reg(operand_1);
+    z80_write_byte(t_reg, z80_get_s_reg(operand_1));
 #ifdef DEBUG
     printf("LD (HL), r\n");
 #endif
@@ -473,13 +810,13 @@ void z80_decode_insn() {
     if((operand_2 & 0xF8) == 0x70) {
       s_reg = z80_get_s_reg(operand_2);
       operand_3 = z80_fetch_byte();
-      t_reg = z80_state.vcpu.iy + (int8_t)operand_3;
+      t_reg = machine->z80.vcpu.iy + (int8_t)operand_3;
 
       if(!z80_ram_valid(t_reg)) {
         printf("Unknown target RAM address 0x%x for LD instruction\n",
           t_reg);
       }
-      z80_state.ram[t_reg] = z80_state.vcpu.gp[s_reg];
+      z80_write_byte(t_reg, machine->z80.vcpu.gp[s_reg]);
 #ifdef DEBUG
       printf("LD (IY+d), r\n");
 #endif
@@ -488,19 +825,19 @@ void z80_decode_insn() {
     } else if (operand_2 == 0x36) {
       operand_3 = z80_fetch_byte();
       operand_4 = z80_fetch_byte();
-      t_reg = z80_state.vcpu.iy + (int8_t)operand_3;
+      t_reg = machine->z80.vcpu.iy + (int8_t)operand_3;
 
       if(!z80_ram_valid(t_reg)) {
         printf("Unknown target RAM address 0x%x for LD instruction\n",
           t_reg);
       }
-      z80_state.ram[t_reg] = operand_4;
+      z80_write_byte(t_reg, operand_4);
 
     /* LD IY, nn */
     } else if (operand_2 == 0x21) {
       operand_3 = z80_fetch_byte();
       operand_4 = z80_fetch_byte();
-      z80_state.vcpu.iy = ((operand_4 << 8) | operand_3);
+      machine->z80.vcpu.iy = ((operand_4 << 8) | operand_3);
 
     /* LD IY, (nn) */
     } else if (operand_2 == 0x2A) {
@@ -522,7 +859,7 @@ void z80_decode_insn() {
           s_reg);
       }
 
-      z80_state.vcpu.iy = (z80_state.ram[t_reg] << 8) | z80_state.ram[s_reg];
+      machine->z80.vcpu.iy = (z80_read_byte(t_reg) << 8) | z80_read_byte(s_reg);
 
     /* LD (nn), IY */
     } else if (operand_2 == 0x22) {
@@ -545,30 +882,27 @@ void z80_decode_insn() {
           s_reg);
       }
       /* Mask out upper 8bits of the ix and write to memory */
-      z80_state.ram[s_reg] = (uint8_t) z80_state.vcpu.iy;
+      z80_write_byte(s_reg, (uint8_t) machine->z80.vcpu.iy);
       /* Shift high bits to right and write to memory */
-      z80_state.ram[t_reg] = (uint8_t) (z80_state.vcpu.iy >> 8);
+      z80_write_byte(t_reg, (uint8_t) (machine->z80.vcpu.iy >> 8));
 
     /* LD SP, IY */
     } else if (operand_2 == 0xF9) {
-      z80_state.vcpu.sp = z80_state.vcpu.iy;
+      machine->z80.vcpu.sp = machine->z80.vcpu.iy;
 #ifdef DEBUG
       printf("LD SP, IY\n");
 #endif
 
     /* PUSH IY */
     } else if (operand_2 == 0xE5) {
-      z80_state.vcpu.sp--;
-
-      z80_state.stack[z80_state.vcpu.sp] = z80_state.vcpu.iy;
+      z80_push16(machine->z80.vcpu.iy);
 #ifdef DEBUG
       printf("PUSH IY\n");
 #endif
 
     /* POP IY */
     } else if (operand_2 == 0xE1) {
-      z80_state.vcpu.iy = z80_state.stack[z80_state.vcpu.sp];
-      z80_state.vcpu.sp++;
+      machine->z80.vcpu.iy = z80_pop16();
 #ifdef DEBUG
       printf("POP IY\n");
 #endif
@@ -576,32 +910,32 @@ void z80_decode_insn() {
   /* LD (HL), n */
   } else if (operand_1 == 0x36) {
     operand_2 = z80_fetch_byte();
-    tmp = ((z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L]);
+    tmp = ((machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L]);
 
-    z80_state.ram[t_reg] = operand_2;
+    z80_write_byte(t_reg, operand_2);
 #ifdef DEBUG
     printf("LD (0x%04x), 0x%02x\n", t_reg, operand_2);
 #endif
 
   /* LD A, (BC) */
   } else if (operand_1 == 0x0A) {
-    s_reg = ((z80_state.vcpu.gp[reg_B] << 8) | z80_state.vcpu.gp[reg_C]);
+    s_reg = ((machine->z80.vcpu.gp[reg_B] << 8) | machine->z80.vcpu.gp[reg_C]);
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for LD instruction\n",
           s_reg);
     }
     /* Load memory from BC into accumulator */
-    z80_state.vcpu.acc = z80_state.ram[s_reg];
+    machine->z80.vcpu.acc = z80_read_byte(s_reg);
 
   /* LD A, (DE) */
   } else if (operand_1 == 0x1A) {
-    s_reg = ((z80_state.vcpu.gp[reg_D] << 8) | z80_state.vcpu.gp[reg_E]);
+    s_reg = ((machine->z80.vcpu.gp[reg_D] << 8) | machine->z80.vcpu.gp[reg_E]);
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for LD instruction\n",
           s_reg);
     }
     /* Load memory from BC into accumulator */
-    z80_state.vcpu.acc = z80_state.ram[s_reg];
+    machine->z80.vcpu.acc = z80_read_byte(s_reg);
   /* LD A, (nn) */
   } else if (operand_1 == 0x3A) {
     operand_3 = z80_fetch_byte();
@@ -615,27 +949,27 @@ void z80_decode_insn() {
     }
 
     /* Load accumulator content into ram position */
-    z80_state.ram[t_reg] = z80_state.vcpu.acc;
+    z80_write_byte(t_reg, machine->z80.vcpu.acc);
 
   /* LD (BC), A */
   } else if (operand_1 == 0x02) {
-    t_reg = ((z80_state.vcpu.gp[reg_B] << 8) | z80_state.vcpu.gp[reg_C]);
+    t_reg = ((machine->z80.vcpu.gp[reg_B] << 8) | machine->z80.vcpu.gp[reg_C]);
 
     if(!z80_ram_valid(t_reg)) {
       printf("Unknown target RAM address 0x%x for LD (BC), A \
           instruction\n", t_reg);
     }
-    z80_state.ram[t_reg] = z80_state.vcpu.acc;
+    z80_write_byte(t_reg, machine->z80.vcpu.acc);
 
   /* LD (DE), A */
   } else if (operand_1 == 0x12) {
-    t_reg = ((z80_state.vcpu.gp[reg_D] << 8) | z80_state.vcpu.gp[reg_E]);
+    t_reg = ((machine->z80.vcpu.gp[reg_D] << 8) | machine->z80.vcpu.gp[reg_E]);
 
     if(!z80_ram_valid(t_reg)) {
       printf("Unknown target RAM address 0x%x for LD (DE), A \
           instruction\n", t_reg);
     }
-    z80_state.ram[t_reg] = z80_state.vcpu.acc;
+    z80_write_byte(t_reg, machine->z80.vcpu.acc);
 
   /* LD (nn), A */
   } else if (operand_1 == 0x32) {
@@ -650,14 +984,15 @@ void z80_decode_insn() {
     }
 
     /* Load conent from ram position into accumulator */
-    z80_state.vcpu.acc = z80_state.ram[s_reg];
+    machine->z80.vcpu.acc = z80_read_byte(s_reg);
 
   } else if (operand_1 == 0xED) {
     operand_2 = z80_fetch_byte();
+    machine->z80.cycles += z80_cycles_ed(operand_2);
     /* LD A, I */
     if (operand_2 == 0x57) {
-      z80_state.vcpu.acc = z80_state.vcpu.i;
-      z80_update_flags(z80_state.vcpu.i, SIGN_FLAG | ZERO_FLAG |
+      machine->z80.vcpu.acc = machine->z80.vcpu.i;
+      z80_update_flags(machine->z80.vcpu.i, SIGN_FLAG | ZERO_FLAG |
           HALFCARRY_FLAG | PARITYOVERFLOW_FLAG | ADDSUB_FLAG);
 #ifdef DEBUG
       printf("LD, A, I\n");
@@ -665,8 +1000,8 @@ void z80_decode_insn() {
 
     /* LD A, R */
     } else if (operand_2 == 0x5F) {
-      z80_state.vcpu.acc = z80_state.vcpu.r;
-      z80_update_flags(z80_state.vcpu.i, SIGN_FLAG | ZERO_FLAG |
+      machine->z80.vcpu.acc = machine->z80.vcpu.r;
+      z80_update_flags(machine->z80.vcpu.i, SIGN_FLAG | ZERO_FLAG |
           HALFCARRY_FLAG | PARITYOVERFLOW_FLAG | ADDSUB_FLAG);
 #ifdef DEBUG
       printf("LD, A, R\n");
@@ -674,14 +1009,14 @@ void z80_decode_insn() {
 
     /* LD I, A */
     } else if (operand_2 == 0x47) {
-      z80_state.vcpu.i = z80_state.vcpu.acc;
+      machine->z80.vcpu.i = machine->z80.vcpu.acc;
 #ifdef DEBUG
       printf("LD, I, A\n");
 #endif
 
     /* LD R, A */
     } else if (operand_2 == 0x4F) {
-      z80_state.vcpu.r = z80_state.vcpu.acc;
+      machine->z80.vcpu.r = machine->z80.vcpu.acc;
 #ifdef DEBUG
       printf("LD, R, A\n");
 #endif
@@ -693,34 +1028,34 @@ void z80_decode_insn() {
       /*Target: BC*/
       if((operand_2 & 0x30) == 0x00) {
         tmp = (operand_3 << 8 | operand_4);
-        z80_state.vcpu.gp[reg_C] = z80_state.ram[tmp];
-        z80_state.vcpu.gp[reg_B] = z80_state.ram[tmp + 1];
+        machine->z80.vcpu.gp[reg_C] = z80_read_byte(tmp);
+        machine->z80.vcpu.gp[reg_B] = z80_read_byte(tmp + 1);
 
 #ifdef DEBUG
-        printf("LD BC, (0x%04x)\t; 0x%02x%02x\n", tmp, z80_state.vcpu.gp[reg_B], z80_state.vcpu.gp[reg_C]);
+        printf("LD BC, (0x%04x)\t; 0x%02x%02x\n", tmp, machine->z80.vcpu.gp[reg_B], machine->z80.vcpu.gp[reg_C]);
 #endif
       /*Target: DE*/
       } else if((operand_2 & 0x30) == 0x10) {
         tmp = (operand_3 << 8 | operand_4);
-        z80_state.vcpu.gp[reg_E] = z80_state.ram[tmp];
-        z80_state.vcpu.gp[reg_D] = z80_state.ram[tmp + 1];
+        machine->z80.vcpu.gp[reg_E] = z80_read_byte(tmp);
+        machine->z80.vcpu.gp[reg_D] = z80_read_byte(tmp + 1);
 #ifdef DEBUG
-        printf("LD DE, (0x%04x)\t; 0x%02x%02x\n", tmp, z80_state.vcpu.gp[reg_D], z80_state.vcpu.gp[reg_E]);
+        printf("LD DE, (0x%04x)\t; 0x%02x%02x\n", tmp, machine->z80.vcpu.gp[reg_D], machine->z80.vcpu.gp[reg_E]);
 #endif
       /*Target: HL*/
       } else if((operand_2 & 0x30) == 0x20) {
         tmp = (operand_3 << 8 | operand_4);
-        z80_state.vcpu.gp[reg_L] = z80_state.ram[tmp];
-        z80_state.vcpu.gp[reg_H] = z80_state.ram[tmp + 1];
+        machine->z80.vcpu.gp[reg_L] = z80_read_byte(tmp);
+        machine->z80.vcpu.gp[reg_H] = z80_read_byte(tmp + 1);
 #ifdef DEBUG
-        printf("LD HL, (0x%04x)\t; 0x%02x%02x\n", tmp, z80_state.vcpu.gp[reg_H], z80_state.vcpu.gp[reg_L]);
+        printf("LD HL, (0x%04x)\t; 0x%02x%02x\n", tmp, machine->z80.vcpu.gp[reg_H], machine->z80.vcpu.gp[reg_L]);
 #endif
       /*Target: SP*/
       } else if((operand_2 & 0x30) == 0x30) {
         tmp = (operand_3 << 8 | operand_4);
-        z80_state.vcpu.sp = (z80_state.ram[tmp + 1] << 8) | z80_state.ram[tmp];
+        machine->z80.vcpu.sp = (z80_read_byte(tmp + 1) << 8) | z80_read_byte(tmp);
 #ifdef DEBUG
-        printf("LD SP, (0x%04x)\t; 0x%04x\n", tmp, z80_state.vcpu.sp);
+        printf("LD SP, (0x%04x)\t; 0x%04x\n", tmp, machine->z80.vcpu.sp);
 #endif
       }
     /* LD (nn), dd */
@@ -741,6 +1076,51 @@ void z80_decode_insn() {
     } else if (operand_2 == 0xA9) {
     /* CPDR */
     } else if (operand_2 == 0xB9) {
+
+    /* IN r, (C) */
+    } else if ((operand_2 & 0xC7) == 0x40) {
+      operand_3 = io_read(machine->z80.vcpu.gp[reg_C]);
+      t_reg = (operand_2 & 0x38) >> 3;
+      /* IN F, (C) (t_reg == 6) only affects the flags */
+      if (t_reg != 6)
+        *z80_reg(t_reg) = operand_3;
+      z80_in_flags(operand_3);
+#ifdef DEBUG
+      printf("IN %s, (C)\t; 0x%02x\n", z80_decode_gp_reg(t_reg), operand_3);
+#endif
+
+    /* OUT (C), r */
+    } else if ((operand_2 & 0xC7) == 0x41) {
+      s_reg = (operand_2 & 0x38) >> 3;
+      /* OUT (C), 0 (s_reg == 6) writes zero on NMOS parts */
+      io_write(machine->z80.vcpu.gp[reg_C], (s_reg == 6) ? 0 : *z80_reg(s_reg));
+#ifdef DEBUG
+      printf("OUT (C), %s\n", z80_decode_gp_reg(s_reg));
+#endif
+
+    /* IM 0, IM 1, IM 2 */
+    } else if ((operand_2 & 0xC7) == 0x46) {
+      /* Bits 3-4: 0 and 1 select IM 0, 2 IM 1 and 3 IM 2 */
+      tmp = (operand_2 >> 3) & 0x3;
+      machine->z80.vcpu.im = tmp ? tmp - 1 : 0;
+#ifdef DEBUG
+      printf("IM %u\n", machine->z80.vcpu.im);
+#endif
+
+    /* RETN, RETI */
+    } else if ((operand_2 & 0xC7) == 0x45) {
+      machine->z80.vcpu.pc = z80_pop16();
+      machine->z80.vcpu.iff1 = machine->z80.vcpu.iff2;
+#ifdef DEBUG
+      printf("%s\t; 0x%04x\n", (operand_2 == 0x4D) ? "RETI" : "RETN", machine->z80.vcpu.pc);
+#endif
+
+    /* INI, INIR, IND, INDR, OUTI, OTIR, OUTD, OTDR */
+    } else if ((operand_2 & 0xE6) == 0xA2) {
+      z80_block_io(operand_2);
+#ifdef DEBUG
+      printf("Block I/O 0x%02x\n", operand_2);
+#endif
     }
   /* LD dd, nn */
   } else if ((operand_1 & 0xCF) == 0x1) {
@@ -749,28 +1129,28 @@ void z80_decode_insn() {
 
     switch((operand_1 & 0x30) >> 4) {
     case 0: /*BC*/
-      z80_state.vcpu.gp[reg_B] = operand_2;
-      z80_state.vcpu.gp[reg_C] = operand_3;
+      machine->z80.vcpu.gp[reg_B] = operand_2;
+      machine->z80.vcpu.gp[reg_C] = operand_3;
 #ifdef DEBUG
       printf("LD BC, 0x%02x%02x\n", operand_2, operand_3);
 #endif
       break;
     case 1: /*DE*/
-      z80_state.vcpu.gp[reg_D] = operand_2;
-      z80_state.vcpu.gp[reg_E] = operand_3;
+      machine->z80.vcpu.gp[reg_D] = operand_2;
+      machine->z80.vcpu.gp[reg_E] = operand_3;
 #ifdef DEBUG
       printf("LD DE, 0x%02x%02x\n", operand_2, operand_3);
 #endif
       break;
     case 2: /*HL*/
-      z80_state.vcpu.gp[reg_H] = operand_2;
-      z80_state.vcpu.gp[reg_L] = operand_3;
+      machine->z80.vcpu.gp[reg_H] = operand_2;
+      machine->z80.vcpu.gp[reg_L] = operand_3;
 #ifdef DEBUG
       printf("LD HL, 0x%02x%02x\n", operand_2, operand_3);
 #endif
       break;
     case 3: /*SP*/
-      z80_state.vcpu.sp  = (operand_3 << 8) | operand_2;
+      machine->z80.vcpu.sp  = (operand_3 << 8) | operand_2;
 #ifdef DEBUG
       printf("LD SP, 0x%02x%02x\n", operand_2, operand_3);
 #endif
@@ -788,7 +1168,7 @@ void z80_decode_insn() {
       printf("Unknown target RAM address 0x%x for LD HL, (nn) \
           instruction\n", s_reg);
     }
-    z80_state.vcpu.gp[reg_L] = z80_state.ram[s_reg];
+    machine->z80.vcpu.gp[reg_L] = z80_read_byte(s_reg);
 
     /* Get nn+1 */
     s_reg++;
@@ -798,7 +1178,7 @@ void z80_decode_insn() {
       printf("Unknown target RAM address 0x%x for LD HL, (nn) \
           instruction\n", s_reg);
     }
-    z80_state.vcpu.gp[reg_H] = z80_state.ram[s_reg];
+    machine->z80.vcpu.gp[reg_H] = z80_read_byte(s_reg);
 
   /* LD (nn), HL */
   } else if (operand_1 == 0x22) {
@@ -811,7 +1191,7 @@ void z80_decode_insn() {
       printf("Unknown target RAM address 0x%x for LD (nn), HL \
           instruction\n", t_reg);
     }
-    z80_state.ram[t_reg] = z80_state.vcpu.gp[reg_L];
+    z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_L]);
 
     /* Get nn+1 */
     t_reg++;
@@ -821,16 +1201,16 @@ void z80_decode_insn() {
       printf("Unknown target RAM address 0x%x for LD (nn), HL \
           instruction\n", t_reg);
     }
-    z80_state.ram[t_reg] = z80_state.vcpu.gp[reg_H];
+    z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_H]);
 
   /* LD SP, HL */
   } else if (operand_1 == 0xF9) {
-    z80_state.vcpu.sp = (z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L];
+    machine->z80.vcpu.sp = (machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L];
 
   /* PUSH qq */
   } else if ((operand_1 & 0xCF) == 0xC5) {
-    s_reg = --z80_state.vcpu.sp;
-    t_reg = --z80_state.vcpu.sp;
+    s_reg = --machine->z80.vcpu.sp;
+    t_reg = --machine->z80.vcpu.sp;
 
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for PUSH qq \
@@ -844,27 +1224,27 @@ void z80_decode_insn() {
 
     switch((operand_1 & 0x30) >> 4) {
     case 0: /*BC*/
-      z80_state.ram[s_reg] = z80_state.vcpu.gp[reg_B];
-      z80_state.ram[t_reg] = z80_state.vcpu.gp[reg_C];
+      z80_write_byte(s_reg, machine->z80.vcpu.gp[reg_B]);
+      z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_C]);
       break;
     case 1: /*DE*/
-      z80_state.ram[s_reg] = z80_state.vcpu.gp[reg_D];
-      z80_state.ram[t_reg] = z80_state.vcpu.gp[reg_E];
+      z80_write_byte(s_reg, machine->z80.vcpu.gp[reg_D]);
+      z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_E]);
       break;
     case 2: /*HL*/
-      z80_state.ram[s_reg] = z80_state.vcpu.gp[reg_H];
-      z80_state.ram[t_reg] = z80_state.vcpu.gp[reg_L];
+      z80_write_byte(s_reg, machine->z80.vcpu.gp[reg_H]);
+      z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_L]);
       break;
     case 3: /*AF*/
-      z80_state.ram[s_reg] = z80_state.vcpu.acc;
-      z80_state.ram[t_reg] = z80_state.vcpu.flags;
+      z80_write_byte(s_reg, machine->z80.vcpu.acc);
+      z80_write_byte(t_reg, machine->z80.vcpu.flags);
       break;
     }
 
   /* POP qq */
   } else if ((operand_1 & 0xCF) == 0xC1) {
-    s_reg = z80_state.vcpu.sp++;
-    t_reg = z80_state.vcpu.sp++;
+    s_reg = machine->z80.vcpu.sp++;
+    t_reg = machine->z80.vcpu.sp++;
 
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for PUSH qq \
@@ -878,20 +1258,20 @@ void z80_decode_insn() {
 
     switch((operand_1 & 0x30) >> 4) {
     case 0: /*BC*/
-      z80_state.vcpu.gp[reg_B] = z80_state.ram[s_reg];
-      z80_state.vcpu.gp[reg_C] = z80_state.ram[t_reg];
+      machine->z80.vcpu.gp[reg_B] = z80_read_byte(s_reg);
+      machine->z80.vcpu.gp[reg_C] = z80_read_byte(t_reg);
       break;
     case 1: /*DE*/
-      z80_state.vcpu.gp[reg_D] = z80_state.ram[s_reg];
-      z80_state.vcpu.gp[reg_E] = z80_state.ram[t_reg];
+      machine->z80.vcpu.gp[reg_D] = z80_read_byte(s_reg);
+      machine->z80.vcpu.gp[reg_E] = z80_read_byte(t_reg);
       break;
     case 2: /*HL*/
-      z80_state.vcpu.gp[reg_H] = z80_state.ram[s_reg];
-      z80_state.vcpu.gp[reg_L] = z80_state.ram[t_reg];
+      machine->z80.vcpu.gp[reg_H] = z80_read_byte(s_reg);
+      machine->z80.vcpu.gp[reg_L] = z80_read_byte(t_reg);
       break;
     case 3: /*AF*/
-      z80_state.vcpu.acc = z80_state.ram[s_reg];
-      z80_state.vcpu.flags = z80_state.ram[t_reg];
+      machine->z80.vcpu.acc = z80_read_byte(s_reg);
+      machine->z80.vcpu.flags = z80_read_byte(t_reg);
       break;
     }
 
@@ -899,27 +1279,27 @@ void z80_decode_insn() {
   /* EX DE, HL */
   } else if(operand_1 == 0xEB) {
 
-    z80_swap_reg(&z80_state.vcpu.gp[reg_D], &z80_state.vcpu.gp[reg_H]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_E], &z80_state.vcpu.gp[reg_L]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_D], &machine->z80.vcpu.gp[reg_H]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_E], &machine->z80.vcpu.gp[reg_L]);
 
   /* EX AF, AF' */
   } else if(operand_1 == 0x08) {
-    z80_swap_reg(&z80_state.vcpu.acc, &z80_state.vcpu.acc_);
-    z80_swap_reg(&z80_state.vcpu.flags, &z80_state.vcpu.flags_);
+    z80_swap_reg(&machine->z80.vcpu.acc, &machine->z80.vcpu.acc_);
+    z80_swap_reg(&machine->z80.vcpu.flags, &machine->z80.vcpu.flags_);
 
   /* EXX */
   } else if(operand_1 == 0xD9) {
-    z80_swap_reg(&z80_state.vcpu.gp[reg_B], &z80_state.vcpu.gp[reg_B_]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_C], &z80_state.vcpu.gp[reg_C_]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_D], &z80_state.vcpu.gp[reg_D_]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_E], &z80_state.vcpu.gp[reg_E_]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_H], &z80_state.vcpu.gp[reg_H_]);
-    z80_swap_reg(&z80_state.vcpu.gp[reg_L], &z80_state.vcpu.gp[reg_L_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_B], &machine->z80.vcpu.gp[reg_B_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_C], &machine->z80.vcpu.gp[reg_C_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_D], &machine->z80.vcpu.gp[reg_D_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_E], &machine->z80.vcpu.gp[reg_E_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_H], &machine->z80.vcpu.gp[reg_H_]);
+    z80_swap_reg(&machine->z80.vcpu.gp[reg_L], &machine->z80.vcpu.gp[reg_L_]);
 
   /* EX (SP), HL */
   } else if(operand_1 == 0xE3) {
-    s_reg = z80_state.vcpu.sp;
-    t_reg = z80_state.vcpu.sp+1;
+    s_reg = machine->z80.vcpu.sp;
+    t_reg = machine->z80.vcpu.sp+1;
 
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for PUSH qq \
@@ -931,8 +1311,12 @@ void z80_decode_insn() {
           instruction\n", t_reg);
     }
 
-    z80_swap_reg(&z80_state.ram[s_reg], &z80_state.vcpu.gp[reg_L]);
-    z80_swap_reg(&z80_state.ram[t_reg], &z80_state.vcpu.gp[reg_H]);
+    operand_3 = z80_read_byte(s_reg);
+    operand_4 = z80_read_byte(t_reg);
+    z80_write_byte(s_reg, machine->z80.vcpu.gp[reg_L]);
+    z80_write_byte(t_reg, machine->z80.vcpu.gp[reg_H]);
+    machine->z80.vcpu.gp[reg_L] = operand_3;
+    machine->z80.vcpu.gp[reg_H] = operand_4;
 
 //  /* EX (SP), IY */
 //  } else if(1) {
@@ -942,24 +1326,24 @@ void z80_decode_insn() {
   } else if((operand_1 & 0x07) == 0x80) {
     /* TODO: Set condition flags correctly */
     s_reg = z80_get_s_reg(operand_1);
-    z80_state.vcpu.acc += s_reg;
+    machine->z80.vcpu.acc += s_reg;
 
   /* ADD A, n */
   } else if(operand_1 == 0xC6) {
     /* TODO: Set condition flags correctly */
     operand_2 = z80_fetch_byte();
-    z80_state.vcpu.acc += operand_2;
+    machine->z80.vcpu.acc += operand_2;
 
   /* ADD A, (HL) */
   } else if(operand_1 == 0x86) {
     /* TODO: Set condition flags correctly */
-    s_reg = (z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L];
+    s_reg = (machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L];
 
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for PUSH qq \
           instruction\n", s_reg);
     }
-    z80_state.vcpu.acc += z80_state.ram[s_reg];
+    machine->z80.vcpu.acc += z80_read_byte(s_reg);
 
   /* ADD A, (IY+d) */
 //  } else if(1) {
@@ -969,24 +1353,38 @@ void z80_decode_insn() {
   } else if((operand_1 & 0xF8) ==  0x90) {
     /* TODO: Set condition flags correctly */
     s_reg = z80_get_s_reg(operand_1);
-    z80_state.vcpu.acc -= s_reg;
+    machine->z80.vcpu.acc -= s_reg;
 
   /* SUB n */
   } else if (operand_1 == 0xD6) {
     /* TODO: Set condition flags correctly */
     operand_2 = z80_fetch_byte();
-    z80_state.vcpu.acc -= operand_2;
+    machine->z80.vcpu.acc -= operand_2;
 
 //  /* SBC A, s */
 //  } else if(1) {
-//  /* AND s */
-//  } else if(1) {
+  /* AND n */
+  } else if (operand_1 == 0xE6) {
+    operand_2 = z80_fetch_byte();
+    machine->z80.vcpu.acc &= operand_2;
+    z80_in_flags(machine->z80.vcpu.acc);
+    machine->z80.vcpu.flags = (machine->z80.vcpu.flags & ~CARRY_FLAG) | HALFCARRY_FLAG;
+#ifdef DEBUG
+    printf("AND 0x%02x\n", operand_2);
+#endif
+
 //  /* OR s */
 //  } else if(1) {
 //  /* XOR s */
 //  } else if(1) {
-//  /* CP s*/
-//  } else if(1) {
+  /* CP n */
+  } else if (operand_1 == 0xFE) {
+    operand_2 = z80_fetch_byte();
+    z80_compare(operand_2);
+#ifdef DEBUG
+    printf("CP 0x%02x\n", operand_2);
+#endif
+
 //  /* INC r */
 //  } else if(1) {
 //  /* INC (HL) */
@@ -1013,8 +1411,8 @@ void z80_decode_insn() {
 //  } else if(1) {
   /* DI */
   } else if(operand_1 == 0xF3) {
-    z80_state.vcpu.iff1 = 0x0;
-    z80_state.vcpu.iff2 = 0x0;
+    machine->z80.vcpu.iff1 = 0x0;
+    machine->z80.vcpu.iff2 = 0x0;
 
 #ifdef DEBUG
     printf("DI\n");
@@ -1022,17 +1420,15 @@ void z80_decode_insn() {
 
   /* EI */
   } else if(operand_1 == 0xFB) {
-    z80_state.vcpu.iff1 = 0x1;
-    z80_state.vcpu.iff2 = 0x1;
+    machine->z80.vcpu.iff1 = 0x1;
+    machine->z80.vcpu.iff2 = 0x1;
+    machine->z80.ei_delay = 1;
+    sched_break();
 #ifdef DEBUG
     printf("EI\n");
 #endif
-//  /* IM 0 */
-//  } else if(1) {
-//  /* IM 1 */
-//  } else if(1) {
-//  /* IM 2 */
-//
+
+  /* IM 0, IM 1 and IM 2 are decoded with the other 0xED instructions */
 //
 //  /* ADD HL, ss */
 //  } else if(1) {
@@ -1070,7 +1466,7 @@ void z80_decode_insn() {
   } else if(operand_1 == 0xCB) {
     /* TODO: Set condition flags correctly */
     s_reg = z80_get_s_reg(z80_fetch_byte());
-    z80_state.vcpu.gp[s_reg] <<= 1;
+    machine->z80.vcpu.gp[s_reg] <<= 1;
 #ifdef DEBUG
     printf("RLC %s\t; 0x%02x\n", z80_decode_gp_reg(s_reg), s_reg);
 #endif
@@ -1129,7 +1525,7 @@ void z80_decode_insn() {
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for JP nn instruction\n", s_reg);
     }
-    z80_state.vcpu.pc = z80_state.ram[s_reg];
+    machine->z80.vcpu.pc = z80_read_byte(s_reg);
 
   /* JP cc, nn */
   } else if((operand_1 & 0xC7) == 0xC2) {
@@ -1138,7 +1534,7 @@ void z80_decode_insn() {
 
     if(z80_condition_true(operand_1 & 0x38 >> 3)) {
       s_reg = ((operand_3 << 8) | operand_2);
-      z80_state.vcpu.pc = s_reg;
+      machine->z80.vcpu.pc = s_reg;
 #ifdef DEBUG
       printf("JP cc, 0x%04x\t; true\n", s_reg);
 #endif
@@ -1150,24 +1546,27 @@ void z80_decode_insn() {
   /* JR e */
   } else if(operand_1 == 0x18) {
     operand_2 = z80_fetch_byte();
-    s_reg = z80_state.vcpu.pc + operand_2;
+    s_reg = machine->z80.vcpu.pc + (int8_t)operand_2;
     if(!z80_ram_valid(s_reg)) {
       printf("Unknown target RAM address 0x%x for JR e \
           instruction\n", s_reg);
     }
-    z80_state.vcpu.pc = s_reg;
+    machine->z80.vcpu.pc = s_reg;
+    /* JR $ waits for an interrupt */
+    if ((int8_t)operand_2 == -2)
+      z80_idle_loop(s_reg, s_reg);
 
   /* JR C, e */
   } else if(operand_1 == 0x38) {
     printf("ERROR!\n");
-    if(z80_flag_set(z80_state.vcpu.flags, CARRY_FLAG)) {
+    if(z80_flag_set(machine->z80.vcpu.flags, CARRY_FLAG)) {
       operand_2 = z80_fetch_byte();
-      if(!z80_ram_valid(z80_state.vcpu.pc + operand_2)) {
+      if(!z80_ram_valid(machine->z80.vcpu.pc + operand_2)) {
         printf("Unknown target RAM address 0x%x for JR C, e \
             instruction\n", s_reg);
       }
-      /*TODO: Check if this is right not sure if I have to add 1*/
-      z80_state.vcpu.pc += operand_2;
+      machine->z80.vcpu.pc += (int8_t)operand_2;
+      machine->z80.cycles += 5;
     } else {
       /* Just skip the branch value*/
       z80_fetch_byte();
@@ -1176,14 +1575,14 @@ void z80_decode_insn() {
   /* JR NC, e */
   } else if(operand_1 == 0x30) {
     printf("ERROR!\n");
-    if(!z80_flag_set(z80_state.vcpu.flags, CARRY_FLAG)) {
+    if(!z80_flag_set(machine->z80.vcpu.flags, CARRY_FLAG)) {
       operand_2 = z80_fetch_byte();
-      if(!z80_ram_valid(z80_state.vcpu.pc + operand_2)) {
+      if(!z80_ram_valid(machine->z80.vcpu.pc + operand_2)) {
         printf("Unknown target RAM address 0x%x for JR C, e \
             instruction\n", s_reg);
       }
-      /*TODO: Check if this is right not sure if I have to add 1*/
-      z80_state.vcpu.pc += operand_2;
+      machine->z80.vcpu.pc += (int8_t)operand_2;
+      machine->z80.cycles += 5;
     } else {
       /* Just skip the branch value*/
       z80_fetch_byte();
@@ -1192,30 +1591,35 @@ void z80_decode_insn() {
   /* JR Z, e */
   } else if(operand_1 == 0x28) {
     operand_2 = z80_fetch_byte();
-    if(z80_flag_set(z80_state.vcpu.flags, ZERO_FLAG)) {
-      if(!z80_ram_valid(z80_state.vcpu.pc + operand_2)) {
+    if(z80_flag_set(machine->z80.vcpu.flags, ZERO_FLAG)) {
+      if(!z80_ram_valid(machine->z80.vcpu.pc + operand_2)) {
         printf("Unknown target RAM address 0x%x for JR Z, e instruction\n", s_reg);
       }
-      z80_state.vcpu.pc += operand_2;
+      machine->z80.vcpu.pc += (int8_t)operand_2;
+      machine->z80.cycles += 5;
+      if ((int8_t)operand_2 < 0)
+        z80_idle_loop(machine->z80.vcpu.pc, machine->z80.vcpu.pc - (int8_t)operand_2 - 2);
 #ifdef DEBUG
-    printf("JR Z, 0x%04x\t; true\n", z80_state.vcpu.pc);
+    printf("JR Z, 0x%04x\t; true\n", machine->z80.vcpu.pc);
 #endif
     } else {
 #ifdef DEBUG
-      printf("JR Z, 0x%04x\t; false\n", z80_state.vcpu.pc);
+      printf("JR Z, 0x%04x\t; false\n", machine->z80.vcpu.pc);
 #endif
     }
 
   /* JR NZ, e */
   } else if(operand_1 == 0x20) {
-    if(!z80_flag_set(z80_state.vcpu.flags, ZERO_FLAG)) {
+    if(!z80_flag_set(machine->z80.vcpu.flags, ZERO_FLAG)) {
       operand_2 = z80_fetch_byte();
-      if(!z80_ram_valid(z80_state.vcpu.pc + operand_2)) {
+      if(!z80_ram_valid(machine->z80.vcpu.pc + operand_2)) {
         printf("Unknown target RAM address 0x%x for JR Z, e \
             instruction\n", s_reg);
       }
-      /*TODO: Check if this is right not sure if I have to add 1*/
-      z80_state.vcpu.pc += operand_2;
+      machine->z80.vcpu.pc += (int8_t)operand_2;
+      machine->z80.cycles += 5;
+      if ((int8_t)operand_2 < 0)
+        z80_idle_loop(machine->z80.vcpu.pc, machine->z80.vcpu.pc - (int8_t)operand_2 - 2);
     } else {
       /* Just skip the branch value*/
       z80_fetch_byte();
@@ -1226,13 +1630,13 @@ void z80_decode_insn() {
 #ifdef DEBUG
     printf("jp (HL)\n");
 #endif
-    s_reg = ((z80_state.vcpu.gp[reg_H] << 8) | z80_state.vcpu.gp[reg_L]);
+    s_reg = ((machine->z80.vcpu.gp[reg_H] << 8) | machine->z80.vcpu.gp[reg_L]);
 
     if (!z80_ram_valid(s_reg)) {
       printf("Unkown source RAM address %u for JP (HL) instruction\n",
           s_reg);
     }
-    z80_state.vcpu.pc = z80_state.ram[s_reg];
+    machine->z80.vcpu.pc = z80_read_byte(s_reg);
 
 
 //  /* JP (IX) */
@@ -1245,12 +1649,10 @@ void z80_decode_insn() {
   /* CALL nn */
   } else if(operand_1 == 0xCD) {
     tmp = (z80_fetch_byte()) | (z80_fetch_byte() << 8);
-    z80_state.vcpu.sp--;
-    z80_state.stack[z80_state.vcpu.sp--] = (uint8_t)((z80_state.vcpu.pc & 0xff00) >> 8);
-    z80_state.stack[z80_state.vcpu.sp] = (uint8_t)(z80_state.vcpu.pc & 0x00ff);
-    z80_state.vcpu.pc = tmp;
+    z80_push16(machine->z80.vcpu.pc);
+    machine->z80.vcpu.pc = tmp;
 #ifdef DEBUG
-    printf("CALL 0x%0x (SP=0x%04x)\n", z80_state.vcpu.pc, z80_state.vcpu.sp);
+    printf("CALL 0x%0x (SP=0x%04x)\n", machine->z80.vcpu.pc, machine->z80.vcpu.sp);
     dump_stack();
 #endif
 
@@ -1258,64 +1660,52 @@ void z80_decode_insn() {
 //  } else if(1) {
   /* RET */
   } else if(operand_1 == 0xC9) {
-    z80_state.vcpu.pc = z80_state.stack[z80_state.vcpu.sp];
-    z80_state.vcpu.sp++;
+    machine->z80.vcpu.pc = z80_pop16();
 
 #ifdef DEBUG
-    printf("RET\t; 0x%04x\n", z80_state.vcpu.pc);
+    printf("RET\t; 0x%04x\n", machine->z80.vcpu.pc);
     dump_stack();
 #endif
   /* RET cc */
   } else if((operand_1 & 0xC7) == 0xC0) {
-    tmp = z80_state.stack[z80_state.vcpu.sp++] | (z80_state.stack[z80_state.vcpu.sp] << 8);
-    z80_state.vcpu.sp++;
-    z80_state.vcpu.pc = tmp;
+    if(z80_condition_true((operand_1 & 0x38) >> 3)) {
+      machine->z80.vcpu.pc = z80_pop16();
+      machine->z80.cycles += 6;
+    }
 #ifdef DEBUG
-    printf("RET cc ; 0x%04x\n", z80_state.vcpu.pc);
+    printf("RET cc ; 0x%04x\n", machine->z80.vcpu.pc);
 
     dump_stack();
 #endif
-//  /* RETI */
-//  } else if(1) {
-//  /* RETN */
-//  } else if(1) {
-//  /*RST p */
-//  } else if(1) {
-//
-//  /* Input/Output */
+  /* RST p */
+  } else if((operand_1 & 0xC7) == 0xC7) {
+    z80_push16(machine->z80.vcpu.pc);
+    machine->z80.vcpu.pc = operand_1 & 0x38;
+#ifdef DEBUG
+    printf("RST 0x%02x\n", operand_1 & 0x38);
+#endif
+
+  /* Input/Output */
   /* IN A, (n) */
   } else if(operand_1 == 0xdb) {
-    z80_state.vcpu.acc = z80_fetch_byte();
+    operand_2 = z80_fetch_byte();
+    machine->z80.vcpu.acc = io_read(operand_2);
 #ifdef DEBUG
-    printf("IN A, (0x%02x)\n", z80_state.vcpu.acc);
+    printf("IN A, (0x%02x)\t; 0x%02x\n", operand_2, machine->z80.vcpu.acc);
+#endif
+
+  /* OUT (n), A */
+  } else if(operand_1 == 0xd3) {
+    operand_2 = z80_fetch_byte();
+    io_write(operand_2, machine->z80.vcpu.acc);
+#ifdef DEBUG
+    printf("OUT (0x%02x), A\t; 0x%02x\n", operand_2, machine->z80.vcpu.acc);
 #endif
-  }
-//  /* IN r (C)*/
-//  } else if(1) {
-//  /* INI */
-//  } else if(1) {
-//  /* INIR */
-//  } else if(1) {
-//  /* IND */
-//  } else if(1) {
-//  /* INDR */
-//  } else if(1) {
-//  /* OUT (n), A */
-//  } else if(1) {
-//  /* OUT (C), r */
-//  } else if(1) {
-//  /* OUTI */
-//  } else if(1) {
-//  /* OTIR */
-//  } else if(1) {
-//  /* OUTD */
-//  } else if(1) {
-//  /* OTDR */
-//  } else if(1) {
-//  }
 
-  else {
-    printf("Decode missing for 0x%02x @0x%0x\n", operand_1, z80_state.vcpu.pc);
+  /* IN r (C), INI, INIR, IND, INDR, OUT (C), r, OUTI, OTIR, OUTD and OTDR
+   * are decoded with the other 0xED instructions above */
+  } else {
+    printf("Decode missing for 0x%02x @0x%0x\n", operand_1, machine->z80.vcpu.pc);
     return;
   }
 }